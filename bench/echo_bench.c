@@ -0,0 +1,369 @@
+/* Frames echoed per second by one reactor over loopback, with epoll and then
+ * with io_uring. Every client keeps a few frames in flight the way a busy
+ * client does, so the reactor has a batch of sockets ready each time it
+ * wakes up.
+ *
+ * Usage: echo_bench [clients] [frames per client]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "reactor.h"
+#include "util.h"
+
+#define DEFAULT_CLIENTS (32)
+#define DEFAULT_FRAMES (20000)
+
+/* Bytes in a frame, about a header and a short message */
+#define FRAME_LEN (64)
+
+/* Frames each client has in flight */
+#define DEPTH (4)
+
+/* Room for everything a client can have in flight */
+#define ECHO_BUF (FRAME_LEN * DEPTH)
+
+/* One accepted socket, everything it sends is sent straight back */
+struct echo {
+    struct reactor *reactor;
+    struct watch *watch;
+    int fd;
+    char buf[ECHO_BUF];         /* Waiting to go back */
+    size_t len;                 /* Bytes in buf */
+    char out[ECHO_BUF];         /* Being sent (io_uring) */
+    struct iovec iov;           /* Points at out */
+    struct msghdr msg;          /* Points at iov */
+    bool sending;               /* A reactor_send() is in flight */
+    bool closed;                /* The client has gone (io_uring) */
+};
+
+/* What every client thread in a run needs to know */
+struct run {
+    struct sockaddr_in addr;    /* The listening socket */
+    long frames;                /* Sent by each client */
+    pthread_barrier_t start;    /* Everybody starts together */
+};
+
+/* Helper functions */
+static double bench(enum reactor_backend, const char *, int, long);
+static int listen_on(struct sockaddr_in *addr);
+static void on_accept(void *arg, int fd);
+static void on_ready(void *arg, uint32_t events);
+static void on_recv(void *arg, const char *data, ssize_t len);
+static void on_sent(void *arg, ssize_t ret);
+static void echo_free(struct echo *echo);
+static void *client(void *arg);
+static int write_all(int fd, const char *buf, size_t len);
+static int read_all(int fd, char *buf, size_t len);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+    int clients = (argc > 1) ? atoi(argv[1]) : DEFAULT_CLIENTS;
+    long frames = (argc > 2) ? atol(argv[2]) : DEFAULT_FRAMES;
+
+    if (clients <= 0 || frames <= 0) {
+        fprintf(stderr, "Usage: %s [clients] [frames per client]\n",
+            argv[0]);
+        return 1;
+    }
+
+    printf("%d clients, %ld frames each, %d in flight, 1 reactor\n",
+        clients, frames, DEPTH);
+
+    double old = bench(reactor_epoll, "epoll", clients, frames);
+    double new = bench(reactor_uring, "io_uring", clients, frames);
+
+    if (old > 0 && new > 0)
+        printf("%-12s %.2fx\n", "speed up", new / old);
+
+    return 0;
+}
+
+/* Echo every client's frames on a fresh reactor using the backend. Print and
+ * return the number of frames through it per second, 0 if the backend isn't
+ * there */
+static double bench
+(
+    enum reactor_backend backend,
+    const char *name,
+    int clients,
+    long frames
+)
+{
+    struct run run = {
+        .frames = frames,
+    };
+
+    struct reactor *reactor = reactor_init(backend);
+    if (reactor == NULL) {
+        fprintf(stderr, "reactor_init: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (reactor_get_backend(reactor) != backend) {
+        printf("%-12s not supported by this kernel\n", name);
+        return 0;
+    }
+
+    int sock = listen_on(&run.addr);
+    if (sock < 0 || reactor_accept(reactor, sock, on_accept, reactor) == NULL
+        || reactor_start(reactor) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+
+    pthread_barrier_init(&run.start, NULL, clients + 1);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * clients);
+    if (threads == NULL)
+        abort();
+
+    for (int i = 0; i < clients; i++) {
+        if (pthread_create(&threads[i], NULL, client, &run) != 0)
+            abort();
+    }
+
+    pthread_barrier_wait(&run.start);
+    double start = now();
+
+    for (int i = 0; i < clients; i++)
+        pthread_join(threads[i], NULL);
+
+    double secs = now() - start;
+
+    pthread_barrier_destroy(&run.start);
+    free(threads);
+
+    // There's no stopping a reactor, this one is left to idle on its own
+    // socket once the clients have gone
+    double rate = frames * clients / secs;
+    printf("%-12s %8.3fs %12.0f frames/s\n", name, secs, rate);
+    return rate;
+}
+
+/* Listen on a loopback port picked by the kernel, filling in its address.
+ * Return the (non-blocking) socket, -1 on error */
+static int listen_on(struct sockaddr_in *addr)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0)
+        return -1;
+
+    *addr = (struct sockaddr_in) {0};
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t len = sizeof(struct sockaddr_in);
+    if (bind(sock, (struct sockaddr *) addr, len) < 0
+        || listen(sock, SOMAXCONN) < 0
+        || getsockname(sock, (struct sockaddr *) addr, &len) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* A client has connected, echo it with whatever the reactor has */
+static void on_accept(void *arg, int fd)
+{
+    struct reactor *reactor = arg;
+
+    if (fd < 0)
+        return;
+
+    struct echo *echo = calloc(1, sizeof(struct echo));
+    if (echo == NULL)
+        abort();
+
+    echo->reactor = reactor;
+    echo->fd = fd;
+
+    if (reactor_get_backend(reactor) == reactor_uring)
+        echo->watch = reactor_stream(reactor, fd, on_recv, on_sent, echo);
+    else
+        echo->watch = reactor_add(reactor, fd, EPOLLIN, on_ready, echo);
+
+    if (echo->watch == NULL)
+        abort();
+}
+
+/* epoll: drain the socket, writing each read straight back. A client never
+ * has more in flight than the socket buffers hold, so the writes don't
+ * block */
+static void on_ready(void *arg, UNUSED uint32_t events)
+{
+    struct echo *echo = arg;
+
+    while (1) {
+        ssize_t n = recv(echo->fd, echo->buf, ECHO_BUF, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0 || write_all(echo->fd, echo->buf, n) < 0) {
+            echo_free(echo);
+            return;
+        }
+    }
+}
+
+/* io_uring: queue what's arrived to go back, it's sent as soon as the last
+ * send is done */
+static void on_recv(void *arg, const char *data, ssize_t len)
+{
+    struct echo *echo = arg;
+
+    // Freed once the send in flight is done
+    if (len <= 0) {
+        if (echo->sending == false)
+            echo_free(echo);
+        else
+            echo->closed = true;
+        return;
+    }
+
+    if (echo->len + len > ECHO_BUF)
+        abort();
+
+    memcpy(echo->buf + echo->len, data, len);
+    echo->len += len;
+
+    if (echo->sending == false)
+        on_sent(echo, 0);
+}
+
+/* io_uring: the last send is done ("ret" bytes of it), send whatever has
+ * come in since */
+static void on_sent(void *arg, ssize_t ret)
+{
+    struct echo *echo = arg;
+    echo->sending = false;
+
+    if (ret < 0 || echo->closed == true) {
+        echo_free(echo);
+        return;
+    }
+
+    // What didn't fit goes back to the front
+    size_t left = echo->iov.iov_len - ret;
+    if (left > 0) {
+        memmove(echo->buf + left, echo->buf, echo->len);
+        memcpy(echo->buf, echo->out + ret, left);
+        echo->len += left;
+    }
+    echo->iov.iov_len = 0;
+
+    if (echo->len == 0)
+        return;
+
+    memcpy(echo->out, echo->buf, echo->len);
+    echo->iov = (struct iovec) {
+        .iov_base = echo->out,
+        .iov_len = echo->len,
+    };
+    echo->msg = (struct msghdr) {
+        .msg_iov = &echo->iov,
+        .msg_iovlen = 1,
+    };
+    echo->len = 0;
+
+    if (reactor_send(echo->reactor, echo->watch, &echo->msg) < 0)
+        abort();
+    echo->sending = true;
+}
+
+/* The client has gone, so does its echo */
+static void echo_free(struct echo *echo)
+{
+    reactor_del(echo->reactor, echo->watch);
+    close(echo->fd);
+    free(echo);
+}
+
+/* Send the frames DEPTH at a time, sending the next as each comes back */
+static void *client(void *arg)
+{
+    struct run *run = arg;
+    char frame[FRAME_LEN] = {0};
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0
+        || connect(sock, (struct sockaddr *) &run->addr, sizeof(run->addr)) < 0)
+        abort();
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_barrier_wait(&run->start);
+
+    long sent = 0;
+    for (; sent < DEPTH && sent < run->frames; sent++) {
+        if (write_all(sock, frame, FRAME_LEN) < 0)
+            abort();
+    }
+
+    for (long got = 0; got < run->frames; got++) {
+        if (read_all(sock, frame, FRAME_LEN) < 0)
+            abort();
+        if (sent < run->frames) {
+            if (write_all(sock, frame, FRAME_LEN) < 0)
+                abort();
+            sent += 1;
+        }
+    }
+
+    close(sock);
+    return NULL;
+}
+
+/* Write all "len" bytes of buf to the (blocking) fd, return -1 on error */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read exactly "len" bytes from the (blocking) fd into buf, return -1 on
+ * error or if it's closed first */
+static int read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Seconds since some point in the past */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "locked_queue.h"
+#include "synch.h"
+
+struct node {
+    struct node *next;
+    struct node *prev;
+    void *item;
+};
+
+struct locked_queue {
+    struct node *first;
+    struct node *last;
+    int len;
+    struct lock *lock;
+};
+
+struct locked_queue *locked_queue_init(void)
+{
+    struct locked_queue *ret = malloc(sizeof(struct locked_queue));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct locked_queue) {0};
+
+    ret->lock = lock_init();
+    if (ret->lock == NULL) {
+        free (ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+int locked_queue_push(struct locked_queue *queue, void *item)
+{
+    struct node *node = malloc(sizeof(struct node));
+    if (node == NULL)
+        return -1;
+
+    *node = (struct node) {0};
+    node->item = item;
+
+    lock_acquire(queue->lock);
+    if (queue->first == NULL) {
+        queue->first = node;
+        queue->last = node;
+    } else {
+        node->next = queue->last;
+        queue->last->prev = node;
+        queue->last = node;
+    }
+    queue->len += 1;
+    lock_release(queue->lock);
+    return 0;
+}
+
+void *locked_queue_pop(struct locked_queue *queue)
+{
+    struct node *dead_node;
+
+    lock_acquire(queue->lock);
+    if (queue->len == 0) {
+        dead_node = NULL;
+    } else if (queue->len == 1) {
+        dead_node = queue->first;
+        queue->first = queue->last = NULL;
+        queue->len = 0;
+    } else {
+        dead_node = queue->first;
+        queue->first = queue->first->prev;
+        queue->first->next = NULL;
+        queue->len -= 1;
+    }
+    lock_release(queue->lock);
+
+    if (dead_node == NULL)
+        return NULL;
+
+    void *item = dead_node->item;
+    free (dead_node);
+    return item;
+}
+
+void locked_queue_free(struct locked_queue *queue)
+{
+    while (locked_queue_pop(queue) != NULL)
+        ;
+    lock_free(queue->lock);
+    free(queue);
+}
+
+bool locked_queue_is_empty(struct locked_queue *q)
+{
+    assert (q != NULL);
+    bool ret;
+    lock_acquire(q->lock);
+    ret = (q->len == 0);
+    lock_release(q->lock);
+    return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef LOCKED_QUEUE_H
+#define LOCKED_QUEUE_H
+
+/* The queue that src/queue.c used to be (a linked list behind a lock), kept
+ * so the benchmark has something to compare against */
+
+#include <stdbool.h>
+
+/* Defined in locked_queue.c */
+struct locked_queue;
+
+/* Initialise the queue, return NULL on error */
+struct locked_queue *locked_queue_init(void);
+
+/* Add item to the back of the queue, return -1 on error */
+int locked_queue_push(struct locked_queue *queue, void *item);
+
+/* Pop item off the front of the queue, NULL if the queue is empty */
+void *locked_queue_pop(struct locked_queue *queue);
+
+/* Free the queue from memory, the items are untouched */
+void locked_queue_free(struct locked_queue *queue);
+
+/* Return true if the queue contains zero items, otherwise return false */
+bool locked_queue_is_empty(struct locked_queue *queue);
+
+#endif /* LOCKED_QUEUE_H */
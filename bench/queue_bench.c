@@ -0,0 +1,168 @@
+/* Throughput of the queue with many producers and one consumer, the way a
+ * reactor's mailbox (or a popular user's backlog) is used. The old locked
+ * queue is run the same way for comparison.
+ *
+ * Usage: queue_bench [producers] [items per producer]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "config.h"
+#include "locked_queue.h"
+#include "queue.h"
+
+#define DEFAULT_PRODUCERS (16)
+#define DEFAULT_ITEMS (1000000)
+
+/* What every thread in a run needs to know */
+struct run {
+    void *queue;                /* struct queue or struct locked_queue */
+    long items;                 /* Pushed by each producer */
+    pthread_barrier_t start;    /* Everybody starts together */
+};
+
+/* Helper functions */
+static void *ring_producer(void *arg);
+static void *ring_pop(void *queue);
+static void *locked_producer(void *arg);
+static void *locked_pop(void *queue);
+static double bench(const char *, void *, void *(*)(void *), void *(*)(void *),
+    int, long);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+    int producers = (argc > 1) ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+    long items = (argc > 2) ? atol(argv[2]) : DEFAULT_ITEMS;
+
+    if (producers <= 0 || items <= 0) {
+        fprintf(stderr, "Usage: %s [producers] [items per producer]\n",
+            argv[0]);
+        return 1;
+    }
+
+    struct queue *ring = queue_init(REACTOR_MAILBOX);
+    struct locked_queue *locked = locked_queue_init();
+    if (ring == NULL || locked == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%d producers, %ld items each, 1 consumer\n", producers, items);
+
+    double old = bench("locked list", locked, locked_producer, locked_pop,
+        producers, items);
+    double new = bench("mpsc ring", ring, ring_producer, ring_pop,
+        producers, items);
+
+    printf("%-12s %.2fx\n", "speed up", new / old);
+
+    queue_free(ring, NULL);
+    locked_queue_free(locked);
+    return 0;
+}
+
+/* Push the items onto the ring, waiting for room whenever it's full */
+static void *ring_producer(void *arg)
+{
+    struct run *run = arg;
+    pthread_barrier_wait(&run->start);
+
+    for (long i = 1; i <= run->items; i++) {
+        while (queue_push(run->queue, (void *) (uintptr_t) i) < 0)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static void *ring_pop(void *queue)
+{
+    return queue_pop(queue);
+}
+
+/* Push the items onto the locked queue */
+static void *locked_producer(void *arg)
+{
+    struct run *run = arg;
+    pthread_barrier_wait(&run->start);
+
+    for (long i = 1; i <= run->items; i++) {
+        if (locked_queue_push(run->queue, (void *) (uintptr_t) i) < 0)
+            abort();
+    }
+
+    return NULL;
+}
+
+static void *locked_pop(void *queue)
+{
+    return locked_queue_pop(queue);
+}
+
+/* Start the producers and pop everything they push on this thread. Print
+ * and return the number of items through the queue per second */
+static double bench
+(
+    const char *name,
+    void *queue,
+    void *(*producer)(void *),
+    void *(*pop)(void *),
+    int producers,
+    long items
+)
+{
+    struct run run = {
+        .queue = queue,
+        .items = items,
+    };
+    pthread_barrier_init(&run.start, NULL, producers + 1);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * producers);
+    if (threads == NULL)
+        abort();
+
+    for (int i = 0; i < producers; i++) {
+        if (pthread_create(&threads[i], NULL, producer, &run) != 0)
+            abort();
+    }
+
+    pthread_barrier_wait(&run.start);
+    double start = now();
+
+    long total = items * producers;
+    // Nothing to do is where a reactor would sleep in epoll_wait(), give the
+    // producers the cpu rather than spin
+    for (long popped = 0; popped < total; ) {
+        if (pop(queue) != NULL)
+            popped += 1;
+        else
+            sched_yield();
+    }
+
+    double secs = now() - start;
+
+    for (int i = 0; i < producers; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_barrier_destroy(&run.start);
+    free(threads);
+
+    double rate = total / secs;
+    printf("%-12s %8.3fs %12.0f items/s\n", name, secs, rate);
+    return rate;
+}
+
+/* Seconds since some point in the past */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -2,11 +2,18 @@
 #define CLIENT_H
 
 #include "config.h"
+#include "header.h"
 #include "list.h"
 
 /* Return the list of peer to peer connections */
 struct list *client_get_ptops(void);
 
+/* Send the command to the server and wait for the reply, whatever else the
+ * server sends in the meantime is handled as usual. The reply's scmd is
+ * returned by reference, the payloads after it are left on the server's
+ * socket for the caller. Return -1 on error */
+int client_call(const char cmd[MAX_COMMAND], struct scmd_payload *scmd);
+
 /* Return the socket that the client uses to communicate to the server */
 int client_get_server_sock(void);
 
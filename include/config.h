@@ -9,12 +9,97 @@
 
 /* Size of the backlog for the server, i.e. can only queue this many
  * connections. If the server is too slow increase this number */
-#define SERVER_BACKLOG (20)
+#define SERVER_BACKLOG (1024)
+
+/* Number of seconds a new connection has to send the client_init_conn
+ * before it is dropped */
+#define HANDSHAKE_TIMEOUT (10)
+
+/* Number of reactor threads (event loops) the server runs. Connections are
+ * shared between them round robin, one or two per core is plenty */
+#define SERVER_REACTORS (4)
+
+/* How the reactors wait on their sockets, reactor_epoll or reactor_uring
+ * (io_uring, Linux 6.1 or later). The server's optional last argument
+ * picks one at startup, and a reactor falls back on epoll if io_uring
+ * can't be used */
+#define SERVER_BACKEND reactor_epoll
+
+/* Number of worker threads that run the slow commands (e.g. whoelsesince)
+ * for the reactors, and how many commands each can have waiting. Once every
+ * worker is that far behind the reactors run the commands themselves */
+#define SERVER_WORKERS (4)
+#define WORKER_DEPTH (256)
+
+/* The most events a reactor will handle per call to epoll_wait() */
+#define REACTOR_MAX_EVENTS (64)
+
+/* Requests an io_uring reactor can queue between waits, and the buffers
+ * (and their size in bytes) it lends the kernel to read the clients into */
+#define REACTOR_URING_ENTRIES (256)
+#define REACTOR_URING_BUFS (256)
+#define REACTOR_URING_BUF_LEN (4096)
+
+/* The most tasks that can be waiting for a reactor, other threads fail to
+ * post to a reactor that's this far behind */
+#define REACTOR_MAILBOX (4096)
+
+/* Bytes the server tries to read from a client's socket at a time */
+#define DECODER_CHUNK (16 * 1024)
+
+/* The most queued frames written to a client with one sendmsg() */
+#define FLUSH_IOVECS (64)
+
+/* Bytes that can be queued for a single client before it counts as slow.
+ * A slow client stays slow until it's read enough to get under the low
+ * water mark */
+#define CONN_HIGH_WATER (1024 * 1024)
+#define CONN_LOW_WATER (256 * 1024)
+
+/* What to do with a slow client, see enum slow_policy in connection.h:
+ *   slow_drop_old   -> Drop the oldest broadcasts queued for the client
+ *   slow_drop_new   -> Don't queue anything new until it catches up
+ *   slow_disconnect -> Kick the client */
+#define CONN_SLOW_POLICY slow_drop_old
+
+/* Seconds a kicked client has to read the "slow_consumer" before the
+ * connection is dropped anyway */
+#define SLOW_GRACE (5)
+
+/* Seconds between printing the slow client counters (if they changed) */
+#define STATS_INTERVAL (60)
+
+/* The most messages kept for a user while they're offline, anything past
+ * this is dropped (the sender is told) */
+#define BACKLOG_MAX (1024)
+
+/* Free objects a thread's pool cache takes from (or gives back to) the
+ * shared free list at a time, and how many objects a pool grows by */
+#define POOL_BATCH (32)
+#define POOL_SLAB (64)
+
+/* Times a lock_spin lock is tried again before the thread goes to sleep */
+#define LOCK_SPINS (100)
+
+/* Uncomment the following line to count, for every place a lock is taken,
+ * how often it had to wait and how long it waited for and held the lock.
+ * They're printed with the other stats */
+//#define LOCK_STATS
+
+/* The most names sent in one page of a list (e.g. the reply to whoelse) */
+#define LIST_PAGE (1024)
+
+/* Ids a block list holds in a sorted array before it becomes a bitmap */
+#define IDSET_ARRAY_MAX (64)
 
 /* Size of the backlog for the client. This is how many peers can be in
  * the backlog for peer to peer connections */
 #define CLIENT_BACKLOG (20)
 
+/* Most commands the client has sent that are still waiting on a reply. Any
+ * more and the client handles replies until one is answered */
+#define CLIENT_PENDING (64)
+
 /* Where to store the list of credentials */
 #define CRED_LIST "credentials.txt"
 
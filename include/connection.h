@@ -1,20 +1,67 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
-#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/types.h>
 
 #include "header.h"
+#include "list.h"
+#include "reactor.h"
+#include "slogin.h"
 #include "user.h"
 
 /* Defined in connection.c */
 struct connection;
+struct registry;
+
+/* Where frames queued on a connection came from. Replies are always queued,
+ * the client is waiting on them. Pushes are what the client didn't ask for
+ * and are subject to the slow_policy */
+enum push_type {
+    push_reply,                 /* Reply to the client's own request */
+    push_message,               /* Direct message from another user */
+    push_broadcast,             /* Broadcast, log on and log off notices */
+};
+
+/* What to do with pushes once a client has more than the high water mark
+ * queued. The client stays "slow" until it's back under the low water mark */
+enum slow_policy {
+    slow_drop_old,              /* Drop the oldest broadcasts to make room */
+    slow_drop_new,              /* Turn away new pushes */
+    slow_disconnect,            /* Kick the client with "slow_consumer" */
+};
+
+/* How often the slow_policy has kicked in, shared by all connections */
+struct conn_stats {
+    unsigned long slow;         /* Times a client went past high water */
+    unsigned long dropped_old;  /* Broadcasts dropped to make room */
+    unsigned long dropped_new;  /* Pushes turned away */
+    unsigned long kicked;       /* Clients disconnected for being slow */
+};
+
+/* Called on the connection's reactor once "len" more bytes the client sent
+ * are in the connection's decoder (see conn_get_decoder()). The "len" is 0
+ * if the client has closed the connection and -1 if reading failed. Return
+ * -1 if the connection has been dropped (see conn_unwatch()), nothing more
+ * is read for it */
+typedef int (*conn_func)(struct connection *, ssize_t len);
 
 /* Initialise the connection */
 struct connection *conn_init(void);
 
-/* Free the connection from memory, close socket if open */
+/* Close the connection, close socket if open. Anything still queued is
+ * thrown away. The memory is free()'d once every reference is dropped */
 void conn_free(struct connection *);
 
+/* Take a reference to the connection so it isn't free()'d while in use by
+ * another thread, see conn_unref() */
+void conn_ref(struct connection *);
+
+/* Drop a reference taken by conn_ref() or conn_get_by_user() */
+void conn_unref(struct connection *);
+
 /* Return the socket for the connection, iff already set */
 int conn_get_sock(struct connection *);
 
@@ -36,32 +83,175 @@ unsigned short conn_get_port(struct connection *);
 /* Set the port number for this connection */
 void conn_set_port(struct connection *, unsigned short port);
 
-/* Return a reference to the thread for this connection */
-pthread_t *conn_get_thread(struct connection *);
+/* Return the user for this connection, NULL if not logged in yet */
+struct user *conn_get_user(struct connection *);
+
+/* Return the decoder for what the client has sent. Only the connection's
+ * reactor reads from the socket, so only it may use the decoder */
+struct decoder *conn_get_decoder(struct connection *);
+
+/* Mark the connection as waiting on its last command (e.g. it's being run
+ * by a worker), the owner leaves what else the client sent in the decoder
+ * until it's done. Nothing more is read from the socket in the meantime.
+ * Only for the connection's reactor */
+void conn_set_busy(struct connection *, bool busy);
+
+/* Return true if the connection is waiting on its last command */
+bool conn_is_busy(struct connection *);
+
+/* Have every group of frames queued on the connection from now on go out
+ * after a server_tagged saying what it's for (see CIC_TAGGED) */
+void conn_set_tagged(struct connection *, bool tagged);
+
+/* Replies queued by the calling thread for the connection are answering its
+ * request "id" until this is called again. Once done, call it with no
+ * connection and an id of 0, the id the client keeps for pushes */
+void conn_reply_to(struct connection *, uint32_t id);
+
+/* Return true once the connection has been closed with conn_free() */
+bool conn_is_closed(struct connection *);
+
+/* Return the connection's timer, which the owner sets up with timer_init()
+ * and arms on the connection's reactor (see reactor_arm()). It's stopped by
+ * conn_unwatch(), and moved to go off SLOW_GRACE seconds later if the client
+ * is kicked for being slow */
+struct timer *conn_get_timer(struct connection *);
+
+/* Return the login progress of the connection, NULL once logged in */
+struct login *conn_get_login(struct connection *);
+
+/* Set the login progress of the connection, any previous login is free()'d.
+ * Set to NULL once the user has logged in */
+void conn_set_login(struct connection *, struct login *);
+
+/* Return the reactor that handles this connection */
+struct reactor *conn_get_reactor(struct connection *);
+
+/* Set the reactor that will handle this connection, can only be done once */
+void conn_set_reactor(struct connection *, struct reactor *);
 
-/* Set the tid for the connection, can only be done once */
-void conn_set_thread(struct connection *, pthread_t *);
+/* Start reading the socket with the connection's reactor, "func" is called
+ * on the reactor's thread with whatever the client sends. With epoll the
+ * socket is read when it's ready, with io_uring the reactor reads it into
+ * its own buffers. Return -1 on error, otherwise 0 */
+int conn_watch(struct connection *, conn_func func);
+
+/* Stop the reactor watching the socket (and the connection's timer), must
+ * be called on the reactor's thread before the connection is free()'d */
+void conn_unwatch(struct connection *);
+
+/* Record that the client has just sent something */
+void conn_touch(struct connection *);
+
+/* Return the number of seconds since the client last sent something */
+time_t conn_idle_time(struct connection *);
 
 /* Set the cic_payload for the connection */
 void conn_set_cic(struct connection *, struct cic_payload);
 
+/* Return the cic_payload the client sent */
+struct cic_payload conn_get_cic(struct connection *);
+
+/* Queue the frame to be sent to the client, the frame belongs to the
+ * connection after this call (even on error). This is safe to call from any
+ * thread and never waits on the client, only the connection's reactor
+ * writes to the socket. Return -1 if the frame is NULL or the connection is
+ * closed, otherwise 0 */
+int conn_send(struct connection *, struct frame *frame);
+
+/* The same as conn_send() but for several frames at once. Either all of the
+ * frames are queued back to back or none of them are */
+int conn_send_many(struct connection *, struct frame **frames, int nframes);
+
+/* The same as conn_send_many() but for frames the client didn't ask for.
+ * These are turned away (return -1) or dropped later on if the client isn't
+ * keeping up, depending on the connection's slow_policy */
+int conn_push(
+    struct connection *,
+    enum push_type type,
+    struct frame **frames,
+    int nframes
+);
+
+/* Set what happens to the connection when the client stops reading. The
+ * "high_water" and "low_water" marks are in bytes queued */
+void conn_set_slow_policy(
+    struct connection *,
+    enum slow_policy policy,
+    size_t high_water,
+    size_t low_water
+);
+
+/* Return the number of seconds since the client was kicked for being slow
+ * (see slow_disconnect), -1 if it hasn't been */
+time_t conn_kicked_time(struct connection *);
+
+/* Return (by reference) how often the slow_policy has kicked in */
+void conn_get_stats(struct conn_stats *ret);
+
+/* Write as much of the queue to the socket as it will take, up to
+ * FLUSH_IOVECS frames at a time with a single sendmsg(). With io_uring the
+ * sendmsg() is queued on the reactor and the next one goes once it's done.
+ * Must be called on the connection's reactor thread. On a broken socket the
+ * socket is shut down so the reactor drops the connection. Return -1 on
+ * error */
+int conn_flush(struct connection *);
+
 /* Broad case that the "user" has logged on, return -1 on error, otherwise
  * return 0 */
-int conn_broad_log_on(struct list *conns, struct user *);
+int conn_broad_log_on(struct registry *reg, struct user *);
 
 /* Broadcast that the "user" has logged off, return -1 on error, otherwise
  * return 0 */
-int conn_broad_log_off(struct list *conns, struct user *);
+int conn_broad_log_off(struct registry *reg, struct user *);
 
 /* Broadcast "msg" to all active connections, except for the "user" (since
  * it is pointless to send the same message to them self) */
-int conn_broad_msg(struct list *conns, struct user *, char msg[MAX_MSG_LENGTH]);
+int conn_broad_msg(struct registry *reg, struct user *, char msg[MAX_MSG_LENGTH]);
+
+/* Initialise an empty registry for users with ids up to max_id. The
+ * registry maps each logged in user to their connection. Return NULL on
+ * error */
+struct registry *registry_init(uint32_t max_id);
+
+/* Free the registry, the connections are untouched */
+void registry_free(struct registry *reg);
+
+/* Add a reactor that connections are registered from. The registry keeps
+ * a shard of the connections for each reactor, which only that reactor
+ * touches, and broadcasts go through each reactor's mailbox. Must be done
+ * for every reactor before anything is registered. Return -1 on error */
+int registry_add_shard(struct registry *reg, struct reactor *reactor);
+
+/* Register the connection for its (logged in) user. Must be called on the
+ * connection's reactor. Return -1 on error, including if the user already
+ * has a connection */
+int registry_add(struct registry *reg, struct connection *conn);
+
+/* Take the connection out of the registry, if it's in there. Must be called
+ * on the connection's reactor */
+void registry_rm(struct registry *reg, struct connection *conn);
+
+/* Apply func(conn, arg) to every registered connection. This walks a
+ * snapshot without taking any locks, so the func must not block. A
+ * connection that is being dropped may still be passed to func, but it won't
+ * be free()'d until the traverse is done */
+void registry_traverse(
+    struct registry *reg,
+    void (*func)(void *conn, void *arg),
+    void *arg
+);
 
-/* Return the connection for the respective user. Return -1 on error, otherwise
- * return 0. */
-int conn_get_by_user(struct list *conns, struct user *user, struct connection **ret);
+/* Return the connection for the respective user, NULL if they don't have
+ * one. The connection is returned with a reference which must be dropped
+ * via conn_unref(). Return -1 on error, otherwise return 0. */
+int conn_get_by_user(
+    struct registry *reg,
+    struct user *user,
+    struct connection **ret
+);
 
 /* Return the number of users in the list of connections that block the user */
-int conn_get_num_blocked(struct list *conns, struct user *user);
+int conn_get_num_blocked(struct registry *reg, struct user *user);
 
 #endif /* CONNECTION_H */
@@ -0,0 +1,37 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+/* A bounded work-stealing deque (Chase and Lev). One thread owns the deque
+ * and pushes and pops at the bottom, which never takes a lock and only
+ * fights the thieves over the last item. Any other thread may steal from
+ * the top, so the oldest work is what gets taken away. The items are kept
+ * in a ring, nothing is malloc'd after deque_init() */
+
+#include <stddef.h>
+
+/* Defined in deque.c */
+struct deque;
+
+/* Initialise the deque with room for at least "size" items, return NULL on
+ * error */
+struct deque *deque_init(size_t size);
+
+/* Free the deque from memory, the items still in it are left alone */
+void deque_free(struct deque *deque);
+
+/* Add the item to the bottom. Owner only. Return -1 if the deque is full */
+int deque_push(struct deque *deque, void *item);
+
+/* Take the item most recently pushed, NULL if the deque is empty. Owner
+ * only */
+void *deque_pop(struct deque *deque);
+
+/* Take the item at the top, safe to call from any thread. Return NULL if the
+ * deque is empty or another thread took the item first */
+void *deque_steal(struct deque *deque);
+
+/* Return the number of items in the deque, which may be out of date by the
+ * time it's looked at */
+size_t deque_len(struct deque *deque);
+
+#endif /* DEQUE_H */
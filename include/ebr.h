@@ -0,0 +1,28 @@
+#ifndef EBR_H
+#define EBR_H
+
+/* Epoch based reclamation. Readers of a shared structure (e.g. a snapshot of
+ * the connections) wrap their reads in ebr_enter() and ebr_exit() and never
+ * take a lock. A writer replaces the structure and hands the old one to
+ * ebr_retire(), which only free()'s it once every reader that could have
+ * seen it has called ebr_exit().
+ *
+ * Readers must not block (or do anything slow) between ebr_enter() and
+ * ebr_exit(), nothing retired can be free()'d until they're done.
+ */
+
+/* Start reading, ebr_enter() may be nested */
+void ebr_enter(void);
+
+/* Finished reading, nothing read since ebr_enter() may be used after this */
+void ebr_exit(void);
+
+/* Call func(ptr) (e.g. free()) once no reader can be using the ptr. This is
+ * safe to call from any thread, but not between ebr_enter() and ebr_exit() */
+void ebr_retire(void *ptr, void (*func)(void *));
+
+/* Call the func for everything retired that is now safe. This happens in
+ * ebr_retire() anyway, this is for when nothing has been retired in a while */
+void ebr_collect(void);
+
+#endif /* EBR_H */
@@ -0,0 +1,46 @@
+#ifndef HASH_H
+#define HASH_H
+
+/* A hash table for finding items by a key in O(1). It's built for tables
+ * that are read far more often than they're written (e.g. the users).
+ *
+ * Lookups never take a lock, so any number of threads can search the table
+ * at the same time as one is adding to it. Adding takes the table's lock.
+ * Items can't be removed, which is what makes the lock free lookups safe.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Defined in hash.c */
+struct hash;
+
+/* Return the hash of the key */
+typedef uint32_t (*hash_func)(const void *key);
+
+/* Return 0 if the item has the key (like the "cmp" for list_get()) */
+typedef int (*hash_cmp)(void *item, const void *key);
+
+/* Initialise an empty table. The "size" is a guess of how many items it will
+ * hold, the table grows if it's wrong. Return NULL on error */
+struct hash *hash_init(size_t size, hash_func func, hash_cmp cmp);
+
+/* Free the table from memory, use `f' to free each item in the table */
+void hash_free(struct hash *hash, void (*f)(void *));
+
+/* Add the item to the table under the key. If an item with the same key is
+ * already in the table it's kept and the new item isn't added.
+ * Return -1 on error, 1 if the key was taken, otherwise 0 */
+int hash_add(struct hash *hash, const void *key, void *item);
+
+/* Return the item with the key, NULL if there isn't one. This never blocks */
+void *hash_get(struct hash *hash, const void *key);
+
+/* Return the number of items in the table */
+size_t hash_len(struct hash *hash);
+
+/* Hash functions for common keys */
+uint32_t hash_str(const char *str, size_t max);
+uint32_t hash_u32(uint32_t n);
+
+#endif /* HASH_H */
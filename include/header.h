@@ -4,6 +4,8 @@
 /* This describes the header of the packets that will be sent.
  */
 
+#include <stdbool.h>
+
 #include <netdb.h>
 
 #include "config.h"
@@ -62,11 +64,32 @@ enum task_id {
     ptop_command         = 29,  /* Peer to peer command is coming up */
     ptop_init_conn       = 30,  /* Contains information about peer's conn */
     ptop_handshake       = 31,  /* Used to synch (mainly the usernames) */
+
+    server_name_list     = 32,  /* A page of names (whoelse/whoelsesince) */
+
+    client_request       = 33,  /* A client_command with a request id */
+    server_tagged        = 34,  /* Says what the frames after it are for */
 };
 
 /* Return the task_id as a string */
 const char *id_to_str(enum task_id id);
 
+/* The revision of the wire format, sent by the client in the cic_payload.
+ * The server turns away clients that don't speak the same revision.
+ *   1 -> The payload structs were sent as is
+ *   2 -> Integers in network byte order, strings are length prefixed
+ *   3 -> Lists of names are sent a page at a time (server_name_list)
+ *   4 -> The client_init_conn asks for optional modes (CIC_TAGGED) */
+#define PROTOCOL_VERSION (4)
+
+/* Flags for the cic_payload, the modes the client wants.
+ *   CIC_TAGGED -> Once logged in (and the backlog has been sent) every reply
+ *                 and push comes after a server_tagged saying what it's
+ *                 for. Commands are sent as client_request's, each with an
+ *                 id the client picks, so any number can be in flight at
+ *                 once and they may be answered out of order */
+#define CIC_TAGGED (1u << 0)
+
 struct header {
     enum task_id task_id;   /* The task to be undertaken by the receiver */
     uint32_t data_len;      /* How many bytes are being transmitted */
@@ -74,12 +97,16 @@ struct header {
 
 /****************************************************************************
  * Everything below this line is predefined payloads for when the server or *
- * client communicate to this each other. These data structures need to be  *
- * shared to preserve the order of the bytes when being sent/received       *
+ * client communicate to this each other. On the wire only the bytes used   *
+ * are sent: each field in order, integers in network byte order, strings   *
+ * as a two byte length followed by the characters (no nul). The "dummy_"   *
+ * payloads are empty. See the codecs in header.c                           *
  ****************************************************************************/
 
 struct cic_payload {            /* task = client_init_conn */
     enum status_code code;      /* First code, should be init_success */
+    uint32_t version;           /* PROTOCOL_VERSION of the client */
+    uint32_t flags;             /* The CIC_* modes the client wants */
 };
 
 struct sic_payload {            /* task = server_init_conn */
@@ -207,14 +234,64 @@ struct phs_payload {            /* task = ptop_handshake */
     char name[MAX_UNAME];       /* The name of the user doing to synch'ing */
 };
 
+struct snl_payload {            /* task = server_name_list */
+    uint32_t more;              /* Non zero if another page follows */
+    uint32_t len;               /* Number of names in this page */
+    char names[LIST_PAGE][MAX_UNAME]; /* Only the first len are sent */
+};
+
+struct creq_payload {           /* task = client_request */
+    uint32_t id;                /* Picked by the client, never 0 */
+    char cmd[MAX_MSG_LENGTH];   /* The same as a ccmd_payload's */
+};
+
+struct stag_payload {           /* task = server_tagged */
+    uint32_t reply_to;          /* The request the frames answer, 0 if
+                                 * they're a push */
+    uint32_t len;               /* Bytes of frames that follow */
+};
+
 /* Read the payload and header from the sender, return them by reference.
- * The header and payload will be malloc'd and must be free'd by the caller.
- * Return 0 on success, -errno is returned on error */
+ * The payload is decoded into its struct, head->data_len is then the size of
+ * the struct. The payload will be malloc'd and must be free'd by the caller.
+ * Return 0 on success, -errno is returned on error (-EPROTO if the sender
+ * sent something that isn't a valid payload) */
 int get_payload(int sock, struct header *head, void **payload);
 
+/* Defined in header.c */
+struct decoder;
+
+/* A decoder buffers what has been read from a non-blocking socket and cuts it
+ * up into payloads. A frame split across several reads is held on to until
+ * the rest of it arrives, and one read can give any number of payloads.
+ * Return NULL on error */
+struct decoder *decoder_init(void);
+
+/* Free the decoder and anything it has buffered */
+void decoder_free(struct decoder *decoder);
+
+/* Read as much as is waiting on the socket (up to a limit) without blocking.
+ * The return value is the same as for recv(2), -1 with errno set to EAGAIN
+ * once there is nothing left to read */
+ssize_t decoder_recv(struct decoder *decoder, int sock);
+
+/* Add "len" bytes that have already been read from the socket (e.g. by an
+ * io_uring reactor), return -1 on error */
+int decoder_feed(struct decoder *decoder, const void *data, size_t len);
+
+/* Take the next complete payload out of the decoder, the same as
+ * get_payload() does from a socket.
+ * Return:
+ *   1  -> The payload and header are returned by reference.
+ *   0  -> The next frame hasn't (fully) arrived yet.
+ *   -1 -> The sender sent something that isn't a valid payload.
+ */
+int decoder_next(struct decoder *decoder, struct header *head, void **payload);
+
 /* Send the payload via the socket. This simplifies the process of constructing
  * the header, sending the header, checking return type, sending payload, and
- * checking return value. Return -1 on error */
+ * checking return value. The "len" must be the size of the payload struct for
+ * the task_id. Return -1 on error */
 int send_payload(
     int sock,
     enum task_id task_id,
@@ -222,13 +299,49 @@ int send_payload(
     void *payload
 );
 
+/* A header and payload packed into one buffer, ready to be written to a
+ * socket as is. This lets a payload be built by one thread and sent later by
+ * another (see conn_send()). A frame is never changed once packed, so the
+ * same frame can be queued for any number of clients, each holding a
+ * reference */
+struct frame {
+    int refs;                   /* References held, free()'d at zero */
+    uint32_t len;               /* Number of bytes in data */
+    char data[];                /* The header followed by the payload */
+};
+
+/* Encode the header and payload into a malloc'd frame, the caller holds the
+ * only reference. Return NULL on error */
+struct frame *pack_payload(enum task_id task_id, uint32_t len, void *payload);
+
+/* Return a frame of "len" bytes for the caller to fill in, the caller holds
+ * the only reference. Return NULL on error */
+struct frame *frame_alloc(uint32_t len);
+
+/* Pack several frames back to back into one new frame, so they can be sent
+ * as a single unit. The reference to each of the frames is dropped (even on
+ * error). Return NULL on error */
+struct frame *frame_join(struct frame **frames, int nframes);
+
+/* Take another reference to the frame, it's returned for convenience. This
+ * is safe to call from any thread */
+struct frame *frame_ref(struct frame *frame);
+
+/* Drop a reference to the frame, the last one free()'s it from memory */
+void frame_free(struct frame *frame);
+
+/* Send the whole frame via the socket then drop the reference. A NULL frame is treated
+ * as an error so the result of pack_payload_*() can be passed straight in.
+ * Return -1 on error */
+int send_frame(int sock, struct frame *frame);
+
 /****************************************************************************
  * Everything below this line is for sending/receiving specific payloads.   *
  * Return 0 on success, -1 on error. This makes life easier for sending and *
  * receiving specific payloads.                                             *
  ****************************************************************************/
 
-int send_payload_cic(int sock, enum status_code code);
+int send_payload_cic(int sock, enum status_code code, uint32_t flags);
 int recv_payload_cic(int sock, struct cic_payload *cic);
 
 int send_payload_sic(int sock, enum status_code code);
@@ -321,4 +434,63 @@ int recv_payload_pic(int sock, struct pic_payload *pic);
 int send_payload_phs(int sock, const char name[MAX_UNAME]);
 int recv_payload_phs(int sock, struct phs_payload *phs);
 
+int recv_payload_snl(int sock, struct snl_payload *snl);
+
+int send_payload_creq(int sock, uint32_t id, const char cmd[MAX_MSG_LENGTH]);
+
+int recv_payload_stag(int sock, struct stag_payload *stag);
+
+/****************************************************************************
+ * The same as above, but the payload is packed into a frame instead of     *
+ * being sent. Only the payloads sent by the server are listed. Return NULL *
+ * on error.                                                                *
+ ****************************************************************************/
+
+struct frame *pack_payload_sic(enum status_code code);
+struct frame *pack_payload_sua(enum status_code code);
+struct frame *pack_payload_spa(enum status_code code);
+struct frame *pack_payload_scmd(enum status_code code, uint64_t extra);
+struct frame *pack_payload_sw(const char name[MAX_UNAME]);
+struct frame *pack_payload_sws(const char name[MAX_UNAME]);
+struct frame *pack_payload_sbon(const char username[MAX_UNAME]);
+struct frame *pack_payload_sbm(const char msg[MAX_MSG_LENGTH]);
+struct frame *pack_payload_sbu(enum status_code code);
+struct frame *pack_payload_sdmr(enum status_code code);
+struct frame *pack_payload_sdmm(const char sen[MAX_UNAME], const char msg[MAX_MSG_LENGTH]);
+struct frame *pack_payload_suu(enum status_code code);
+struct frame *pack_payload_sbof(const char name[MAX_UNAME]);
+struct frame *pack_payload_ssp(enum status_code, unsigned short port, struct in_addr);
+struct frame *pack_payload_snl(const char *const names[], uint32_t len, bool more);
+struct frame *pack_payload_stag(uint32_t reply_to, uint32_t len);
+
+/* The number of server_name_list pages it takes to send "len" names. There's
+ * always at least one page, even if it's empty */
+#define LIST_PAGES(len) ((len) == 0 ? 1 : ((len) + LIST_PAGE - 1) / LIST_PAGE)
+
+/* Pack the names into LIST_PAGES(len) server_name_list payloads, a frame for
+ * each page. Every page but the last says that another follows. Return -1
+ * on error (and nothing is in pages), otherwise 0 */
+int pack_name_list(const char *const names[], uint32_t len, struct frame **pages);
+
+/* Defined in header.c */
+struct name_list;
+
+/* Start an empty list of names to be sent as server_name_list pages. Each
+ * name is written straight into the frame of its page as it's added, so
+ * there's no copy of the list to pack later on. Return NULL on error */
+struct name_list *name_list_init(void);
+
+/* Add the name to the end of the list, return -1 on error */
+int name_list_add(struct name_list *list, const char *name);
+
+/* Return the number of names in the list */
+uint32_t name_list_len(struct name_list *list);
+
+/* Hand the LIST_PAGES(len) frames over to "pages", every page but the last
+ * says that another follows. The list is free()'d */
+void name_list_finish(struct name_list *list, struct frame **pages);
+
+/* Free the list along with its pages, for a list that won't be sent */
+void name_list_free(struct name_list *list);
+
 #endif /* HEADER_H */
@@ -0,0 +1,34 @@
+#ifndef IDSET_H
+#define IDSET_H
+
+/* A set of user ids (e.g. a block list). Small sets are a sorted array, once
+ * a set has IDSET_ARRAY_MAX ids it becomes a bitmap.
+ *
+ * idset_has() never takes a lock, it's safe to call from any thread while
+ * another thread is changing the set. Changes take the set's lock.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Defined in idset.c */
+struct idset;
+
+/* Initialise an empty set, return NULL on error */
+struct idset *idset_init(void);
+
+/* Free the set from memory */
+void idset_free(struct idset *set);
+
+/* Add the id to the set. Return -1 on error, 1 if the id was already in the
+ * set, otherwise 0 */
+int idset_add(struct idset *set, uint32_t id);
+
+/* Remove the id from the set. Return 1 if the id wasn't in the set,
+ * otherwise 0 */
+int idset_rm(struct idset *set, uint32_t id);
+
+/* Return true if the id is in the set. This never blocks */
+bool idset_has(struct idset *set, uint32_t id);
+
+#endif /* IDSET_H */
@@ -8,6 +8,8 @@
  * The iter_next, iter_prev, ... functions all assert that the appropriate
  * iter functions were passed via the constructor. If an assert is raised
  * then check the "iter_funcs" input in the "iter_init" function.
+ *
+ * An iterator has no lock, only the thread that made it may use it.
  */
 
 #include <stdbool.h>
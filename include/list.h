@@ -1,14 +1,23 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+
 #include "iter.h"
 
 /* Defined in list.c */
 struct list;
+struct list_node;
 
 /* Initialise the list, return NULL on error */
 struct list *list_init (void);
 
+/* Initialise a list that other threads may remove from while it's being
+ * walked with a cursor (see list_cursor_init()). Removed nodes are free()'d
+ * once no cursor can be on them, so removing costs a little more. Return
+ * NULL on error */
+struct list *list_init_shared (void);
+
 /* Add an item to the list */
 int list_add (struct list *list, void *item);
 
@@ -25,7 +34,8 @@ void *list_rm (struct list *list, void *item, int (*cmp)(void*, void*));
 
 /* Iterate over all items in the list applying func(item, arg)
  * "item" is the item passed via list_add
- * "arg" is passed to func() for each node */
+ * "arg" is passed to func() for each node. Other readers may traverse at the
+ * same time, so func() must not change the list */
 void list_traverse (
     struct list *list,
     void(*func)(void *item, void *arg),
@@ -44,7 +54,7 @@ void *list_get (
 int list_len(struct list *list);
 
 /* Pop a random item of the list, most likely the first or the last,
- * which item that is popped of is undefined */
+ * which item that is popped of is undefined. NULL if the list is empty */
 void *list_pop(struct list *list);
 
 /* Return true if the list is empty, otherwise return false */
@@ -53,4 +63,94 @@ bool list_is_empty(struct list *list);
 /* Create an iterator to traverse the list */
 struct iter *list_iter_init(struct list *list);
 
+/* A cursor walks the list without taking the list's lock or allocating
+ * anything, it lives on the caller's stack. e.g.
+ *
+ *     struct list_cursor cursor;
+ *     list_cursor_init(&cursor, list);
+ *     while (list_cursor_has_next(&cursor) == true) {
+ *         struct thing *thing = list_cursor_get(&cursor);
+ *         ...
+ *         list_cursor_next(&cursor);
+ *     }
+ *     list_cursor_end(&cursor);
+ *
+ * Items added while walking may or may not be seen. Items may only be
+ * removed by other threads while walking if the list is from
+ * list_init_shared(), and a removed item may still be seen (so it must not
+ * be free()'d until the cursors are done, see ebr.h). The walk must not
+ * block, and the thread walking must not remove from a shared list until it
+ * calls list_cursor_end() */
+struct list_cursor {
+    struct list_node *node;     /* The current node, NULL at the end */
+};
+
+/* Start the cursor at the first item of the list */
+void list_cursor_init(struct list_cursor *cursor, struct list *list);
+
+/* Return true if the cursor is on an item, false once it's past the end */
+bool list_cursor_has_next(struct list_cursor *cursor);
+
+/* Return the item the cursor is on */
+void *list_cursor_get(struct list_cursor *cursor);
+
+/* Move the cursor on to the next item */
+void list_cursor_next(struct list_cursor *cursor);
+
+/* Finished with the cursor, it must be called even if the walk stops early */
+void list_cursor_end(struct list_cursor *cursor);
+
+/* An intrusive list, the items embed a struct list_link so adding and
+ * removing never allocates and removing is O(1). There's no lock, the caller
+ * decides how the list is protected. e.g.
+ *
+ *     struct thing {
+ *         struct list_link link;
+ *         ...
+ *     };
+ *
+ *     ilist_add(&things, &thing->link);
+ *     ...
+ *     struct thing *t = ilist_item(ilist_pop(&things), struct thing, link);
+ */
+
+/* Embedded in each item, zero it before the item's first ilist_add() */
+struct list_link {
+    struct list_link *next;     /* NULL while not on a list */
+    struct list_link *prev;
+};
+
+struct ilist {
+    struct list_link head;      /* The first and last links */
+    int len;                    /* Number of links */
+};
+
+/* For a static ilist, the same as ilist_init() */
+#define ILIST_INITIALIZER(ilist) \
+    { .head = { .next = &(ilist).head, .prev = &(ilist).head }, .len = 0 }
+
+/* Return the item that the link is embedded in as "member" of "type" */
+#define ilist_item(link, type, member) \
+    ((type *) ((char *) (link) - offsetof(type, member)))
+
+/* Loop over each link of the ilist, the current link can't be removed */
+#define ilist_for_each(ilist, link) \
+    for (link = (ilist)->head.next; link != &(ilist)->head; link = link->next)
+
+/* The same as ilist_for_each() but from the last link to the first */
+#define ilist_for_each_reverse(ilist, link) \
+    for (link = (ilist)->head.prev; link != &(ilist)->head; link = link->prev)
+
+/* Initialise an empty intrusive list */
+void ilist_init(struct ilist *ilist);
+
+/* Add the link to the end of the list, it must not be on a list */
+void ilist_add(struct ilist *ilist, struct list_link *link);
+
+/* Remove the link from the list, nothing happens if it isn't on a list */
+void ilist_rm(struct ilist *ilist, struct list_link *link);
+
+/* Remove and return the first link of the list, NULL if it's empty */
+struct list_link *ilist_pop(struct ilist *ilist);
+
 #endif /* LIST_H */
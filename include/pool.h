@@ -0,0 +1,79 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Pools of fixed size objects, for the small things that are malloc'd and
+ * free()'d all the time (list nodes, connections, ...).
+ *
+ * Every thread keeps its own cache of free objects for each pool, so most
+ * pool_get()/pool_put() calls never take a lock or go near malloc. A cache
+ * that runs dry is refilled from the pool's shared free list POOL_BATCH
+ * objects at a time (and spills back the same way), and the shared list
+ * grows a slab of POOL_SLAB objects at a time. Slabs are never given back,
+ * a pool stays as big as it has ever been.
+ *
+ * Pools are defined statically by the module that uses them, e.g.
+ *
+ *     static struct pool node_pool = POOL_INIT("list nodes", struct node);
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+#include "config.h"
+
+/* The most pools there can be */
+#define POOL_MAX (16)
+
+/* Strings shorter than this (counting the null byte) come from a pool, see
+ * pool_strdup(). Enough for any user name */
+#define POOL_STR_MAX (MAX_UNAME)
+
+/* Only touched by pool.c, it's here so pools can be defined statically */
+struct pool {
+    const char *name;           /* For the stats */
+    size_t size;                /* Bytes in each object */
+    int id;                     /* Which thread cache is ours, 0 until used */
+    pthread_mutex_t mutex;      /* Protects the rest */
+    void *free;                 /* The shared free objects */
+    size_t nfree;               /* Number of shared free objects */
+    size_t nobjs;               /* Number of objects in the slabs */
+    struct cache *caches;       /* Every thread's cache of this pool */
+    struct pool *next;          /* The next pool that's been used */
+};
+
+#define POOL_INIT(NAME, TYPE)                                               \
+    {                                                                       \
+        .name = (NAME),                                                     \
+        .size = sizeof(TYPE),                                               \
+        .mutex = PTHREAD_MUTEX_INITIALIZER,                                 \
+    }
+
+/* Counters for a pool, summed over every thread */
+struct pool_stats {
+    const char *name;           /* The pool's name */
+    unsigned long hits;         /* Gets served by the thread's cache */
+    unsigned long misses;       /* Gets that went to the shared list */
+    size_t nobjs;               /* Objects made so far (used or not) */
+    size_t size;                /* Bytes in each object */
+};
+
+/* Return an object from the pool, NULL on error. The object isn't zero'd */
+void *pool_get(struct pool *pool);
+
+/* Give the object (from pool_get()) back to the pool, NULL is ignored */
+void pool_put(struct pool *pool, void *obj);
+
+/* Apply func(stats, arg) to the stats of every pool that has been used */
+void pool_traverse(void (*func)(struct pool_stats *, void *), void *arg);
+
+/* Return a copy of the string, short ones come from a pool and are padded
+ * with null bytes to POOL_STR_MAX. The copy must be given to pool_strfree(),
+ * not free(). Return NULL on error */
+char *pool_strdup(const char *str);
+
+/* Free a string from pool_strdup(), NULL is ignored */
+void pool_strfree(char *str);
+
+#endif /* POOL_H */
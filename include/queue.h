@@ -1,28 +1,43 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+/* A bounded multi-producer single-consumer queue. Any number of threads may
+ * push at the same time without taking a lock, but only one thread may pop
+ * (or peek) at a time. The items are kept in a ring, nothing is malloc'd
+ * after queue_init() */
+
 #include <stdbool.h>
+#include <stddef.h>
 
 /* Defined in queue.c */
 struct queue;
 
-/* Initialise the list, return NULL on error */
-struct queue *queue_init(void);
+/* Initialise the queue with room for at least "size" items, return NULL on
+ * error */
+struct queue *queue_init(size_t size);
 
-/* Add item to the back of the queue, also known as "enqueue" */
+/* Add item to the back of the queue, also known as "enqueue". Return -1 if
+ * the queue is full */
 int queue_push (struct queue *queue, void *item);
 
-/* Pop item off the front of the queue, also known as "dequeue" */
+/* Pop item off the front of the queue, also known as "dequeue". Return NULL
+ * if the queue is empty. Consumer only */
 void *queue_pop (struct queue *queue);
 
+/* Return the item at the front of the queue without removing it, NULL if
+ * the queue is empty. Consumer only */
+void *queue_peek (struct queue *queue);
+
 /* Free the queue from memory, apply "f(item)" to each of the items that
  * have been pushed to the list */
 void queue_free(struct queue *queue, void (*f)(void*));
 
-/* Return true if the queue contains zero items, otherwise return false */
+/* Return true if the queue contains zero items, otherwise return false.
+ * Consumer only */
 bool queue_is_empty(struct queue *queue);
 
-/* Return the length of the queue */
+/* Return the length of the queue. This may count items that are still being
+ * pushed, queue_pop() can return NULL before the length runs out */
 int queue_len(struct queue *);
 
 #endif /* QUEUE_H */
@@ -0,0 +1,177 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/* A reactor is a single thread driving an epoll(7) instance, or an
+ * io_uring(7) instance on kernels that have one (see reactor_init()).
+ *
+ * With epoll, file descriptors are registered edge-triggered, so the
+ * callback has to drain the fd (read until EAGAIN) before returning or it
+ * won't be told about the data again.
+ *
+ * With io_uring the reactor does the reading and writing itself. Sockets
+ * are read with multishot receives into buffers the reactor has lent the
+ * kernel (see reactor_stream()), and writes are queued (see reactor_send()).
+ * Everything queued while handling a batch of completions goes to the
+ * kernel along with the wait for the next batch, in one system call.
+ *
+ * Every callback for a watch runs on the reactor's own thread, so anything
+ * only touched from those callbacks needs no locking. Other threads that
+ * need something done by the reactor post it a task, see reactor_post().
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "wheel.h"
+
+/* Defined in reactor.c */
+struct reactor;
+struct watch;
+
+/* How a reactor waits on its fds */
+enum reactor_backend {
+    reactor_epoll,              /* Readiness, with epoll(7) */
+    reactor_uring,              /* Completions, with io_uring(7) */
+};
+
+/* Called by the reactor thread when "events" (EPOLLIN, EPOLLOUT, ...) are
+ * ready for the watched fd. The "arg" is the one given to reactor_add() */
+typedef void (*reactor_func)(void *arg, uint32_t events);
+
+/* Called by the reactor thread with each client accepted on a
+ * reactor_accept() socket, the (non-blocking) fd is the callee's. The fd is
+ * -1 if accepting failed (errno is set), the next client is tried anyway */
+typedef void (*reactor_accept_func)(void *arg, int fd);
+
+/* Called by the reactor thread with what a reactor_stream() has read, the
+ * data is only valid until the func returns. The "len" is 0 at the end of
+ * the stream and -1 on error (errno is set), nothing more is read after
+ * that */
+typedef void (*reactor_recv_func)(void *arg, const char *data, ssize_t len);
+
+/* Called by the reactor thread once a reactor_send() is done, with what
+ * sendmsg(2) returned (errno is set on error) */
+typedef void (*reactor_sent_func)(void *arg, ssize_t ret);
+
+/* Called by the reactor thread for tasks given to reactor_post() */
+typedef void (*reactor_task)(void *arg);
+
+/* A task whose memory is the caller's, embedded in whatever it's for. Only
+ * the reactor touches it from reactor_handoff() until its func is called */
+struct handoff {
+    struct handoff *next;       /* Next one handed to the reactor */
+    reactor_task func;          /* Called on the reactor's thread */
+    void *arg;                  /* Passed to func */
+};
+
+/* Called by the reactor thread roughly once a second, after the timers that
+ * are due */
+typedef void (*reactor_tick)(struct reactor *reactor, void *arg);
+
+/* Initialise a reactor using the backend, the thread isn't started until
+ * reactor_start(). If the kernel is too old for io_uring (or it's been
+ * turned off) the reactor uses epoll instead. Return NULL on error */
+struct reactor *reactor_init(enum reactor_backend backend);
+
+/* Return the backend the reactor ended up with */
+enum reactor_backend reactor_get_backend(struct reactor *reactor);
+
+/* Spawn the thread for the reactor, return -1 on error, otherwise 0 */
+int reactor_start(struct reactor *reactor);
+
+/* Pin the reactor's thread to the "cpu" (numbered from zero), so its
+ * connections stay in that core's caches. Must be set before
+ * reactor_start() */
+void reactor_set_cpu(struct reactor *reactor, int cpu);
+
+/* Set the function called once a second on the reactor's thread. Must be set
+ * before reactor_start() */
+void reactor_set_tick(struct reactor *reactor, reactor_tick tick, void *arg);
+
+/* Watch the "fd" for "events" (EPOLLET is always added). With epoll this is
+ * safe to call from any thread, with io_uring it must be called from the
+ * reactor's thread (or before reactor_start()). Return NULL on error */
+struct watch *reactor_add(
+    struct reactor *reactor,
+    int fd,
+    uint32_t events,
+    reactor_func func,
+    void *arg
+);
+
+/* Change the events a reactor_add() watch is interested in, the same thread
+ * rules as reactor_add(). Return -1 on error */
+int reactor_mod(struct reactor *reactor, struct watch *watch, uint32_t events);
+
+/* Stop (or start again) handing what's ready to read on a reactor_add() or
+ * reactor_stream() watch over. While paused anything new is left in the
+ * socket, so the other end is held back by its window. With io_uring some
+ * of what the kernel had already read may still be handed over. Must be
+ * called from the reactor's thread. Return -1 on error */
+int reactor_pause(struct reactor *reactor, struct watch *watch, bool paused);
+
+/* Accept the clients connecting to the listening socket "fd", handing each
+ * of them to func. The same thread rules as reactor_add(). With io_uring
+ * one multishot accept takes every client. Return NULL on error */
+struct watch *reactor_accept(
+    struct reactor *reactor,
+    int fd,
+    reactor_accept_func func,
+    void *arg
+);
+
+/* Read everything that arrives on the stream socket "fd" and hand it to
+ * "recv". The reactor_send()s for the socket go through the same watch and
+ * finish with "sent". Only for io_uring reactors, the same thread rules as
+ * reactor_add(). Return NULL on error */
+struct watch *reactor_stream(
+    struct reactor *reactor,
+    int fd,
+    reactor_recv_func recv,
+    reactor_sent_func sent,
+    void *arg
+);
+
+/* Queue the "msg" to be sent on a reactor_stream() socket, the watch's sent
+ * func is called once it's done. The msg (and what it points to) must be
+ * left alone until then. The sent func is called even if the watch is
+ * removed in the meantime, the send then has until the next tick to finish
+ * before it's cancelled. Must be called from the reactor's thread. Return
+ * -1 on error */
+int reactor_send(struct reactor *reactor, struct watch *watch, struct msghdr *msg);
+
+/* Stop watching the fd, the fd is NOT closed. With io_uring the watch's
+ * reads are cancelled (see reactor_send() for its sends). Must be called
+ * from the reactor's thread, the watch is free()'d once the current batch
+ * of events has been handled (and the kernel is done with it) */
+void reactor_del(struct reactor *reactor, struct watch *watch);
+
+/* Have the reactor thread call func(arg) soon. This is safe to call from any
+ * thread and never blocks, tasks are run in the order they are posted.
+ * Return -1 on error, including if REACTOR_MAILBOX tasks are already
+ * waiting */
+int reactor_post(struct reactor *reactor, reactor_task func, void *arg);
+
+/* Have the reactor thread call handoff->func(handoff->arg) soon. Nothing is
+ * allocated, so unlike reactor_post() this can't fail (for a task that has
+ * to get there). This is safe to call from any thread and never blocks, the
+ * handoffs run in the order they're given but not in order with the posted
+ * tasks */
+void reactor_handoff(struct reactor *reactor, struct handoff *handoff);
+
+/* Have the reactor thread call the timer's func at "when" (a time(2)), at
+ * most a second late. An armed timer is moved. Must be called from the
+ * reactor's thread, and the timer must be stopped before it's free()'d */
+void reactor_arm(struct reactor *reactor, struct timer *timer, time_t when);
+
+/* Stop the timer, nothing happens if it isn't armed. Must be called from the
+ * reactor's thread */
+void reactor_disarm(struct reactor *reactor, struct timer *timer);
+
+/* Return true if the calling thread is the reactor's thread */
+bool reactor_is_current(struct reactor *reactor);
+
+#endif /* REACTOR_H */
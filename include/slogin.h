@@ -4,13 +4,53 @@
 /* slogin.h and slogin.c contains all of the logic for the logic for the
  * server to login in and handle login requests.
  *
+ * The login is a state machine, every payload the client sends during the
+ * login is fed to login_step() as it arrives. This way no thread ever has to
+ * wait on a client that is slow to type their password (or never sends
+ * anything at all).
+ *
  * All logic for the client to login is stored in clogin.h and clogin.c
  */
 
-/* This function initialises the connection to the client from the server's
- * perspective. Return the logged in user on success, return NULL if the user
- * can not be authenticated. The calling thread will quit when NULL is
- * returned. The list is needed to query existing users in the database */
-struct user *auth_user(int sock, struct list *users);
+#include <stdbool.h>
+
+#include "hash.h"
+#include "header.h"
+
+/* Defined in slogin.c */
+struct login;
+
+/* Defined in connection.c */
+struct connection;
+
+/* Initialise the login for a new connection, the first thing expected is
+ * the client_init_conn payload. Return NULL on error */
+struct login *login_init(void);
+
+/* Free the login from memory, the user (if any) is untouched */
+void login_free(struct login *login);
+
+/* Return true if the client hasn't sent the client_init_conn yet */
+bool login_waiting_init(struct login *login);
+
+/* Return the user trying to log in, NULL if the client hasn't given a valid
+ * username yet */
+struct user *login_get_user(struct login *login);
+
+/* Handle the next payload sent by the client during the login, replies are
+ * queued on the conn. The names are needed to query existing users in the
+ * database.
+ * Return:
+ *   1  -> The user is logged in, see login_get_user().
+ *   0  -> Waiting on the next payload from the client.
+ *   -1 -> The user can't be logged in, the connection should be closed.
+ */
+int login_step(
+    struct login *login,
+    struct connection *conn,
+    struct hash *names,
+    struct header head,
+    void *payload
+);
 
 #endif /* SLOGIN_H */
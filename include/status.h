@@ -27,6 +27,8 @@ enum status_code {
     backlog_msg    = 21,  /* These are messages for the backlog */
     user_unblocked = 22,  /* The user is unblocked */
     user_offline   = 23,  /* The user is offline */
+    slow_consumer  = 24,  /* The client wasn't reading, it's being kicked */
+    backlog_full   = 25,  /* The user is offline and can't take any more */
 };
 
 /* Return the value of the status_code as a human readable string */
@@ -3,21 +3,127 @@
 
 /* This is a wrapper around the GNU pthreads library using the same functions
  * as seen in the OS course. It also provides easier to remember function
- * names */
+ * names
+ *
+ * Locks can be malloc'd (lock_init()) or embedded in the struct they protect
+ * (lock_setup(), or LOCK_INITIALIZER for static ones), which saves chasing a
+ * pointer every time they're taken.
+ *
+ * With LOCK_STATS defined (see config.h) every place a lock is taken keeps
+ * count of how often it was taken, how often it had to wait, and for how
+ * long it waited and held the lock. See lock_stats_traverse() */
 
-/* Defined in synch.c */
-struct lock;
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "config.h"
+
+/* How a lock waits while somebody else holds it */
+enum lock_wait {
+    lock_park = 0,      /* Sleep straight away */
+    lock_spin = 1,      /* Try LOCK_SPINS more times before sleeping, for
+                         * locks that are only held for a moment */
+};
+
+/* A place in the code where a lock is taken, only used with LOCK_STATS */
+struct lock_site {
+    const char *file;           /* Where the lock is taken */
+    int line;
+    unsigned long acquires;     /* Times the lock was taken here */
+    unsigned long contended;    /* Times it was already held by somebody */
+    unsigned long wait_ns;      /* Time spent waiting for it */
+    unsigned long hold_ns;      /* Time it was held for, not for readers */
+    bool listed;                /* On the list of sites */
+    struct lock_site *next;     /* The next site on the list */
+};
+
+/* Only touched by synch.c, it's here so locks can be embedded */
+struct lock {
+    pthread_mutex_t mutex;
+    enum lock_wait wait;        /* How to wait for the lock */
+    struct lock_site *site;     /* Where the holder took it (LOCK_STATS) */
+    unsigned long since;        /* When the holder took it (LOCK_STATS) */
+};
+
+/* Any number of readers or one writer at a time */
+struct rwlock {
+    pthread_rwlock_t rwlock;
+    struct lock_site *site;     /* Where the writer took it (LOCK_STATS) */
+    unsigned long since;        /* When the writer took it (LOCK_STATS) */
+};
+
+#define LOCK_INITIALIZER                                                    \
+    {                                                                       \
+        .mutex = PTHREAD_MUTEX_INITIALIZER,                                 \
+        .wait = lock_park,                                                  \
+    }
+
+#define RWLOCK_INITIALIZER                                                  \
+    {                                                                       \
+        .rwlock = PTHREAD_RWLOCK_INITIALIZER,                               \
+    }
 
 /* Create a lock, currently unlocked */
 struct lock *lock_init(void);
 
+/* Set up a lock that's embedded in something else, currently unlocked.
+ * Return -1 on error */
+int lock_setup(struct lock *lock, enum lock_wait wait);
+
 /* Acquire the lock, block until the lock is released */
 void lock_acquire(struct lock *lock);
 
 /* Release the lock, unblocked other waiting locks */
 void lock_release(struct lock *lock);
 
-/* Free the lock from memory */
+/* Free the lock from memory, nobody may be holding it */
 void lock_free(struct lock *lock);
 
+/* Undo lock_setup(), nobody may be holding the lock */
+void lock_teardown(struct lock *lock);
+
+/* Set up a reader/writer lock that's embedded in something else. Return -1
+ * on error */
+int rwlock_setup(struct rwlock *rwlock);
+
+/* Acquire the lock for reading, other readers may hold it at the same time */
+void rwlock_read(struct rwlock *rwlock);
+
+/* Acquire the lock for writing, nobody else may hold it at the same time */
+void rwlock_write(struct rwlock *rwlock);
+
+/* Release the lock from rwlock_read() or rwlock_write() */
+void rwlock_release(struct rwlock *rwlock);
+
+/* Undo rwlock_setup(), nobody may be holding the lock */
+void rwlock_teardown(struct rwlock *rwlock);
+
+/* Apply func(site, arg) to every place a lock has been taken. Nothing
+ * happens without LOCK_STATS */
+void lock_stats_traverse(void (*func)(struct lock_site *, void *), void *arg);
+
+#ifdef LOCK_STATS
+
+/* The same as the functions above, but the time is put down to the site */
+void lock_acquire_at(struct lock *lock, struct lock_site *site);
+void rwlock_read_at(struct rwlock *rwlock, struct lock_site *site);
+void rwlock_write_at(struct rwlock *rwlock, struct lock_site *site);
+
+/* Every call gets its own site */
+#define LOCK_AT(FUNC, LOCK)                                                 \
+    do {                                                                    \
+        static struct lock_site site_ = {                                   \
+            .file = __FILE__,                                               \
+            .line = __LINE__,                                               \
+        };                                                                  \
+        FUNC((LOCK), &site_);                                               \
+    } while (0)
+
+#define lock_acquire(LOCK) LOCK_AT(lock_acquire_at, LOCK)
+#define rwlock_read(LOCK) LOCK_AT(rwlock_read_at, LOCK)
+#define rwlock_write(LOCK) LOCK_AT(rwlock_write_at, LOCK)
+
+#endif /* LOCK_STATS */
+
 #endif /* SYNCH_H */
@@ -0,0 +1,72 @@
+#ifndef URING_H
+#define URING_H
+
+/* Just enough of io_uring(7) for a reactor, straight on top of the system
+ * calls. Requests are queued in the submission ring and all go to the
+ * kernel with the next uring_wait(), which also waits for the first
+ * completion. A busy reactor then makes one system call per batch of
+ * events, however many sockets they're for.
+ *
+ * Every ring also has a ring of provided buffers (URING_BUF_GROUP) for
+ * multishot receives to fill, the kernel picks a buffer as the data
+ * arrives and it's handed back with uring_put_buf() once it's been used.
+ *
+ * A ring belongs to one thread, the first to call uring_enable(). Nothing
+ * is locked.
+ */
+
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+/* The provided buffers are picked from this group, see IOSQE_BUFFER_SELECT */
+#define URING_BUF_GROUP (0)
+
+/* Defined in uring.c */
+struct uring;
+
+/* Set up a ring with room for "entries" requests (a power of two) and
+ * "nbufs" provided buffers (a power of two) of "buf_len" bytes each. The
+ * ring starts disabled, see uring_enable(). Return NULL if the kernel is
+ * too old for (or doesn't allow) anything the ring uses */
+struct uring *uring_init(
+    unsigned int entries,
+    unsigned int nbufs,
+    unsigned int buf_len
+);
+
+/* Free the ring, anything still in flight is cancelled */
+void uring_free(struct uring *ring);
+
+/* Let the calling thread start submitting, it's the only one that may from
+ * now on. Requests can be queued before this but not sent. Return -1 on
+ * error */
+int uring_enable(struct uring *ring);
+
+/* Return a zero'd request to fill in, it's sent with the next uring_wait().
+ * If the ring is full what's in it is sent first. Return NULL on error */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Send every queued request without waiting, return -1 on error */
+int uring_submit(struct uring *ring);
+
+/* Send every queued request and wait up to "timeout" milliseconds for at
+ * least one completion. Return -1 on error, running out of time (or being
+ * interrupted) isn't an error */
+int uring_wait(struct uring *ring, int timeout);
+
+/* Return the next completion, NULL if there isn't one. It's only valid
+ * until uring_seen() */
+struct io_uring_cqe *uring_peek(struct uring *ring);
+
+/* Done with the completion from uring_peek() */
+void uring_seen(struct uring *ring);
+
+/* Return the provided buffer "bid" (IORING_CQE_BUFFER_SHIFT of the flags of
+ * the completion it came with) */
+char *uring_buf(struct uring *ring, uint16_t bid);
+
+/* Hand the buffer back for the kernel to fill again */
+void uring_put_buf(struct uring *ring, uint16_t bid);
+
+#endif /* URING_H */
@@ -1,12 +1,16 @@
 #ifndef USER_H
 #define USER_H
 
+#include "hash.h"
 #include "list.h"
 #include "config.h"
 
 /* Defined in user.c */
 struct user;
 
+/* Defined in reactor.c */
+struct reactor;
+
 /* Given the username and password, create and return a user. */
 struct user *user_init (const char uname[MAX_UNAME], const char pword[MAX_PWORD]);
 
@@ -22,17 +26,35 @@ int user_pword_cmp (struct user *user, const char pword[MAX_PWORD]);
 /* Return the id of the user */
 uint32_t user_getid (struct user *user);
 
-/* Return the user with this username, NULL if doesn't exist */
-struct user *user_get_by_name (struct list *users, const char uname[MAX_UNAME]);
+/* Return an empty index of users by username (or by id), "size" is roughly
+ * how many users there will be. Return NULL on error */
+struct hash *user_name_index(size_t size);
+struct hash *user_id_index(size_t size);
+
+/* Add the user to the indexes. Return -1 on error, 1 if there is already a
+ * user with the same name, otherwise 0 */
+int user_index(struct hash *names, struct hash *ids, struct user *user);
+
+/* Return the largest id given to a user so far */
+uint32_t user_max_id(void);
+
+/* Return the user with this username, NULL if doesn't exist. This never
+ * blocks, so it's cheap no matter how many users there are */
+struct user *user_get_by_name (struct hash *names, const char uname[MAX_UNAME]);
+
+/* Return the user with this id, NULL if doesn't exist */
+struct user *user_get_by_id (struct hash *ids, uint32_t id);
 
 /* This function is invoked when the user enters an invalid password too many
- * times, and is therefore blocked */
-void user_set_blocked(struct user *user);
+ * times, and is therefore blocked for block_duration. Must be called on the
+ * reactor's thread, whose timer ends the block */
+void user_set_blocked(struct user *user, struct reactor *reactor);
 
-/* Return true/false if this user is blocked */
+/* Return true/false if this user is blocked. This is a single load */
 bool user_is_blocked(struct user *user);
 
-/* Return the name of user, return value must be free()'d, NULL on error. */
+/* Return the name of user as a char[MAX_UNAME], return value must be given to
+ * pool_strfree(), NULL on error. */
 char *user_get_uname(struct user *user);
 
 /* Set's the users' logged in status to logged in. Zero is returned on success,
@@ -42,23 +64,32 @@ enum status_code user_log_on(struct user *user);
 /* Log of the user. If the user is already logged off then do nothing */
 void user_log_off(struct user *user);
 
-/* Return true if the user is logged on, false if the user is not logged on */
+/* Return true if the user is logged on, false if the user is not logged on.
+ * This never blocks, it's safe to ask from any thread */
 bool user_is_logged_on(struct user *user);
 
-/* Return a list of users for the whoelse command, the exception is the user
- * to ignore in the list. The list returned contains (char *)'s */
-struct list *user_whoelse(struct list *users, struct user *exception);
-
-/* Return a list of users for the whoelsesince command, the execption is the
- * user to ignore in the list. The list returned contains (char *)'s */
-struct list *user_whoelsesince(
-    struct list *users, struct user *exception, time_t off_time
+/* Return the whole reply to the whoelse command (a task_ready with the number
+ * of users followed by the server_name_list pages) as a single frame. The
+ * exception is the user to leave out. The names are only packed again after
+ * somebody logs on or off. Return NULL on error */
+struct frame *user_whoelse(struct user *exception);
+
+/* Apply func(name, arg) to the name of every user that has logged on in the
+ * last "off_time" seconds (the whoelsesince command), newest first. The
+ * exception is the user to leave out. A user's name never changes, so it may
+ * be held on to for as long as the user exists. If func() returns -1 the
+ * walk stops and -1 is returned, otherwise 0 is returned */
+int user_whoelsesince(
+    struct user *exception,
+    time_t off_time,
+    int (*func)(const char *name, void *arg),
+    void *arg
 );
 
 /* This is used when the user "blocker" wants to block the "victim" */
 enum status_code user_block
 (
-    struct list *users,
+    struct hash *names,
     struct user *blocker,
     const char *victim
 );
@@ -66,16 +97,18 @@ enum status_code user_block
 /* The is used when the user "unblocker" wants to unblock the "victim" */
 enum status_code user_unblock
 (
-    struct list *users,
+    struct hash *names,
     struct user *unblocker,
     const char *victim
 );
 
 /* Return true if the sender is on the receiver's block list, otherwise
- * false is returned */
+ * false is returned. This is O(1) and never blocks */
 bool user_on_blocklist (struct user *reciver, struct user *sender);
 
-/* Add the message to the users backlog of messages */
+/* Add the message to the users backlog of messages. This never blocks and
+ * may be called by any thread. Return -1 on error, 1 if the backlog already
+ * has BACKLOG_MAX messages (the message is dropped), otherwise 0 */
 int user_add_to_backlog(struct user *user, const char *name, const char *msg);
 
 /* Return true/false if the two users are equals */
@@ -85,7 +118,7 @@ bool user_equal(struct user *user1, struct user *user2);
 int user_get_backlog_len(struct user *);
 
 /* Pop a backlogged item of the users backlog, if there are no items left then
- * NULL is returned */
+ * NULL is returned. Only the user's own connection may pop */
 struct sdmm_payload *user_pop_backlog(struct user *);
 
 #endif /* USER_H */
@@ -10,6 +10,10 @@
 #define STR_(X) #X
 #define STR(X) STR_(X)
 
+/* Bytes in a cache line, things written by different threads are kept this
+ * far apart */
+#define CACHE_LINE (64)
+
 /* Number of elements in array */
 #define ARRSIZE(A) (sizeof(A)/sizeof(A[0]))
 
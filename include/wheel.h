@@ -0,0 +1,59 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+/* A hierarchical timer wheel with a resolution of one second. Each level is a
+ * ring of 64 lists, and each slot of a level covers a whole turn of the level
+ * below. A timer goes in the lowest level that reaches its deadline and falls
+ * down a level when the level below comes round to it. Arming, moving and
+ * stopping a timer is O(1), and so is each second the wheel is moved on
+ * (besides the timers that go off).
+ *
+ * The timers are embedded in whatever they're for, so the wheel never
+ * allocates. There's no lock, a wheel and its timers belong to one thread
+ * (see reactor_arm()).
+ */
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "list.h"
+
+/* Defined in wheel.c */
+struct wheel;
+
+/* Called when the timer goes off, the "arg" is the one given to timer_init().
+ * The timer is no longer armed, so it may be armed again or free()'d */
+typedef void (*timer_func)(void *arg);
+
+/* Embedded in each item, see timer_init() */
+struct timer {
+    struct list_link link;      /* In one of the wheel's slots */
+    struct ilist *slot;         /* The slot it's in, NULL if not armed */
+    time_t when;                /* When it goes off */
+    timer_func func;            /* Called when it goes off */
+    void *arg;                  /* Passed to func */
+};
+
+/* Initialise a wheel starting at "now", return NULL on error */
+struct wheel *wheel_init(time_t now);
+
+/* Free the wheel from memory, the timers still armed are left alone */
+void wheel_free(struct wheel *wheel);
+
+/* Set up the timer before it is first armed, it isn't armed yet */
+void timer_init(struct timer *timer, timer_func func, void *arg);
+
+/* Arm the timer to go off at "when" (which may already have passed, it then
+ * goes off on the next second). An armed timer is moved */
+void wheel_add(struct wheel *wheel, struct timer *timer, time_t when);
+
+/* Stop the timer, nothing happens if it isn't armed */
+void wheel_rm(struct wheel *wheel, struct timer *timer);
+
+/* Return true if the timer is armed */
+bool timer_armed(struct timer *timer);
+
+/* Move the wheel on to "now", setting off every timer that is due */
+void wheel_advance(struct wheel *wheel, time_t now);
+
+#endif /* WHEEL_H */
@@ -0,0 +1,46 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/* A fixed pool of worker threads for jobs that would hold up a reactor if it
+ * ran them itself (long scans, anything that might block).
+ *
+ * Every worker has a mailbox that any thread may hand it jobs through (see
+ * workers_submit()) and its own deque that it moves them onto. A worker
+ * runs the newest job on its own deque, and once that's empty it steals the
+ * oldest job from another worker's. A worker stuck on a long job only holds
+ * up itself, the jobs queued behind it are taken by whoever is idle.
+ */
+
+#include <stddef.h>
+
+/* Defined in workers.c */
+struct workers;
+
+/* Called on a worker thread with the "arg" given to workers_submit() */
+typedef void (*work_func)(void *arg);
+
+/* Counters for the pool, summed over every worker */
+struct work_stats {
+    int nworkers;               /* Threads in the pool */
+    size_t depth;               /* Jobs each worker can have queued */
+    size_t queued;              /* Jobs waiting to be run */
+    unsigned long done;         /* Jobs run */
+    unsigned long stolen;       /* Jobs run by a worker they weren't
+                                 * handed to */
+    unsigned long refused;      /* Jobs turned away, every queue was full */
+};
+
+/* Start "nworkers" threads, each with room for "depth" jobs waiting. Return
+ * NULL on error */
+struct workers *workers_init(int nworkers, size_t depth);
+
+/* Have a worker call func(arg) soon. This is safe to call from any thread
+ * and never blocks, the jobs are handed out round robin. Return -1 if every
+ * worker already has "depth" jobs waiting (the caller should run it
+ * itself) */
+int workers_submit(struct workers *workers, work_func func, void *arg);
+
+/* Return (by reference) the pool's counters */
+void workers_get_stats(struct workers *workers, struct work_stats *ret);
+
+#endif /* WORKERS_H */
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "client.h"
 #include "clogin.h"
 #include "header.h"
 #include "ptop.h"
@@ -24,6 +25,12 @@
     .ai_flags    = AI_PASSIVE,  /* Fill in sin_addr */  \
 }
 
+/* A command sent to the server that hasn't been answered yet */
+struct request {
+    uint32_t id;                /* The request id, 0 if the slot is free */
+    char cmd[MAX_COMMAND];      /* What was sent */
+};
+
 struct {
     struct sockaddr_in sockaddr;
     int sock;   /* For the server */
@@ -36,6 +43,15 @@ struct {
     int ptop_sock;  /* Peer to peer socket */
 
     char my_name[MAX_UNAME];
+
+    /* Requests waiting on a reply, the one with id "n" is in slot
+     * n % CLIENT_PENDING */
+    struct request pending[CLIENT_PENDING];
+    uint32_t last_id;           /* Id of the last request sent */
+
+    uint32_t waiting;           /* Id client_call() is waiting on, 0 if none */
+    bool answered;              /* The reply to "waiting" has arrived */
+    struct scmd_payload answer; /* ... and this is it */
 } client = {0};
 
 /* Helper functions */
@@ -46,8 +62,10 @@ static int init_args (const char *ip_addr, const char *port);
 static int conn_to_server (int sock);
 static int init_connection (void);
 static NORETURN int handle_client_timeout(void);
+static NORETURN int handle_slow_consumer(void);
 static int handle_broad_logon(void);
 static int handle_scmd(struct scmd_payload *scmd);
+static int handle_tagged(struct stag_payload *stag);
 static int socket_read_handle(void);
 static int stdin_read_handle(void);
 static bool is_help_cmd(char *cmd);
@@ -57,10 +75,13 @@ static void cmd_help(void);
 static int cmd_whoelse(struct scmd_payload *scmd);
 static int set_ptop_sock(int server_sock);
 static int cmd_whoelsesince(struct scmd_payload *scmd);
+static int print_name_list(void);
 static int cmd_broadcast(UNUSED struct scmd_payload *scmd);
 static int cmd_block(struct scmd_payload *scmd);
 static const char *get_first_non_space(const char *line);
 static int deploy_command(char cmd[MAX_COMMAND]);
+static uint32_t send_request(const char cmd[MAX_COMMAND]);
+static int handle_reply(const char cmd[MAX_COMMAND], struct scmd_payload *);
 static void run_client (void);
 static int cmd_logout(struct scmd_payload *scmd);
 static int host_to_sockaddr(const char *hostname, struct sockaddr_in *addr);
@@ -138,7 +159,7 @@ static int conn_to_server (int sock)
 {
     struct sic_payload sic = {0};
 
-    if (send_payload_cic(sock, init_success) < 0)
+    if (send_payload_cic(sock, init_success, CIC_TAGGED) < 0)
         return -1;
 
     if (recv_payload_sic(sock, &sic) < 0)
@@ -194,6 +215,14 @@ static NORETURN int handle_client_timeout(void)
     exit(1);
 }
 
+/* The client wasn't reading what the server sent and has been kicked */
+static NORETURN int handle_slow_consumer(void)
+{
+    printf("You weren't keeping up with the server!\n");
+    printf("Logging off now.\n");
+    exit(1);
+}
+
 int client_get_server_sock(void)
 {
     return client.sock;
@@ -300,6 +329,9 @@ static int handle_scmd(struct scmd_payload *scmd)
         case time_out:
             return handle_client_timeout();
 
+        case slow_consumer:
+            return handle_slow_consumer();
+
         case bad_command:
             printf("You entered an invalid command! <\n");
             return 0;
@@ -352,6 +384,10 @@ static int socket_read_handle(void)
             ret = handle_scmd(payload);
             break;
 
+        case server_tagged:
+            ret = handle_tagged(payload);
+            break;
+
         default:
             panic("Received bad header: \"%s\"(%d)\n",
                 id_to_str(head.task_id),
@@ -363,32 +399,67 @@ static int socket_read_handle(void)
     return ret;
 }
 
+/* The server has said what the group of payloads that follows is for. The
+ * group starts with a scmd_payload, the rest is read by whoever handles it.
+ * Return -1 on error */
+static int handle_tagged(struct stag_payload *stag)
+{
+    struct scmd_payload scmd = {0};
+    if (recv_payload_scmd(client.sock, &scmd) < 0)
+        return -1;
+
+    if (stag->reply_to == 0)
+        return handle_scmd(&scmd);
+
+    struct request *req = &client.pending[stag->reply_to % CLIENT_PENDING];
+    if (req->id != stag->reply_to)
+        panic("Received a reply to an unknown request: %u\n", stag->reply_to);
+
+    req->id = 0;
+
+    // The rest of the reply is left for client_call()'s caller
+    if (stag->reply_to == client.waiting) {
+        client.answer = scmd;
+        client.answered = true;
+        return 0;
+    }
+
+    return handle_reply(req->cmd, &scmd);
+}
+
 /* This is called when the main loop receives a message from standard input
- * and needs to be handled */
+ * and needs to be handled. Every line is sent straight away, the replies are
+ * handled as they arrive */
 static int stdin_read_handle(void)
 {
-    bool is_error = false;
-    char cmd[MAX_COMMAND] = {0};
+    char buf[MAX_COMMAND] = {0};
 
-    int ret = read(0, cmd, MAX_COMMAND-1);
+    int ret = read(0, buf, MAX_COMMAND-1);
 
     if (ret <= 1)
         return 0;
 
-    if (cmd[ret-1] == '\n' || cmd[ret-1] == '\r')
-        cmd[ret-1] = '\0';
+    char *save = NULL;
+    for (char *line = strtok_r(buf, "\r\n", &save); line != NULL;
+            line = strtok_r(NULL, "\r\n", &save)) {
 
+        // The payloads are MAX_COMMAND bytes, so each line gets its own
+        char cmd[MAX_COMMAND] = {0};
+        strncpy(cmd, line, MAX_COMMAND-1);
 
-    if (ptop_is_cmd(cmd) == true) {
-        if (ptop_handle_cmd(cmd) < 0)
+        bool is_error = false;
+        if (ptop_is_cmd(cmd) == true) {
+            if (ptop_handle_cmd(cmd) < 0)
+                is_error = true;
+        } else if (deploy_command(cmd) < 0)
             is_error = true;
-    } else if (deploy_command(cmd) < 0)
-        is_error = true;
 
-    if (is_error == true) {
-        printf("Failed to send command: \"%s\"\n", cmd);
-        return -1;
+        if (is_error == true) {
+            printf("Failed to send command: \"%s\"\n", cmd);
+            return -1;
+        }
     }
+
     return 0;
 }
 
@@ -535,9 +606,6 @@ static int cmd_logout(UNUSED struct scmd_payload *scmd)
 /* Used for when the client sends to whoelse command to the server */
 static int cmd_whoelse(struct scmd_payload *scmd)
 {
-    struct sw_payload sw = {0};
-    int ret;
-
     uint64_t num_users = scmd->extra;
 
     if (num_users == 1)
@@ -545,24 +613,12 @@ static int cmd_whoelse(struct scmd_payload *scmd)
     else
         printf("There are %ld users online\n", num_users);
 
-    uint64_t i;
-    for (i = 0; i < num_users; i++) {
-        ret = recv_payload_sw(client.sock, &sw);
-        if (ret < 0)
-            return -1;
-
-        printf("%ld. \"%s\"\n", i+1, sw.username);
-    }
-
-    return 0;
+    return print_name_list();
 }
 
 /* Used for when the client sends to whoelsesince command to the server */
 static int cmd_whoelsesince(struct scmd_payload *scmd)
 {
-    struct sws_payload sws = {0};
-    int ret;
-
     uint64_t num_users = scmd->extra;
 
     if (num_users == 1)
@@ -570,15 +626,30 @@ static int cmd_whoelsesince(struct scmd_payload *scmd)
     else
         printf("There are %ld recently logged in users\n", num_users);
 
-    uint64_t i;
-    for (i = 0; i < num_users; i++) {
-        ret = recv_payload_sws(client.sock, &sws);
-        if (ret < 0)
+    return print_name_list();
+}
+
+/* Receive the pages of names that follow the reply to whoelse (or
+ * whoelsesince) and print them in order. Return -1 on error */
+static int print_name_list(void)
+{
+    // Far too big for the stack
+    struct snl_payload *snl = malloc(sizeof(struct snl_payload));
+    if (snl == NULL)
+        return -1;
+
+    uint64_t n = 0;
+    do {
+        if (recv_payload_snl(client.sock, snl) < 0) {
+            free(snl);
             return -1;
+        }
 
-        printf("%ld. \"%s\"\n", i+1, sws.username);
-    }
+        for (uint32_t i = 0; i < snl->len; i++)
+            printf("%ld. \"%s\"\n", ++n, snl->names[i]);
+    } while (snl->more != 0);
 
+    free(snl);
     return 0;
 }
 
@@ -610,6 +681,11 @@ static int cmd_message(UNUSED struct scmd_payload *scmd)
             printf("User off line, message stored\n");
             return 0;
 
+        case backlog_full:
+            printf("User off line with too many stored messages, message "
+                "dropped\n");
+            return 0;
+
         case user_blocked:
             printf("You have been blocked by receiver, message dropped\n");
             return 0;
@@ -644,7 +720,8 @@ static const char *get_first_non_space(const char *line)
     return ret;
 }
 
-/* Send the command to the server and handle the response appropriately */
+/* Send the command to the server, the reply is handled once it arrives (see
+ * handle_tagged()) */
 static int deploy_command(char cmd[MAX_COMMAND])
 {
     if (is_help_cmd(cmd) == true) {
@@ -652,17 +729,60 @@ static int deploy_command(char cmd[MAX_COMMAND])
         return 0;
     }
 
-    struct scmd_payload scmd = {0};
+    return (send_request(cmd) == 0) ? -1 : 0;
+}
 
-    if (send_payload_ccmd(client.sock, cmd) < 0) {
-        return -1;
+/* Send the command as a new request and return its id, 0 on error. If
+ * CLIENT_PENDING requests are already waiting, the replies are handled
+ * until the slot it needs is free */
+static uint32_t send_request(const char cmd[MAX_COMMAND])
+{
+    // Zero is saved for pushes
+    uint32_t id = ++client.last_id;
+    if (id == 0)
+        id = ++client.last_id;
+
+    struct request *req = &client.pending[id % CLIENT_PENDING];
+    while (req->id != 0) {
+        if (socket_read_handle() < 0)
+            return 0;
     }
 
-    if (recv_payload_scmd(client.sock, &scmd) < 0) {
+    req->id = id;
+    memcpy(req->cmd, cmd, MAX_COMMAND);
+
+    if (send_payload_creq(client.sock, id, req->cmd) < 0)
+        return 0;
+
+    return id;
+}
+
+int client_call(const char cmd[MAX_COMMAND], struct scmd_payload *scmd)
+{
+    uint32_t id = send_request(cmd);
+    if (id == 0)
         return -1;
+
+    client.waiting = id;
+    client.answered = false;
+
+    while (client.answered == false) {
+        if (socket_read_handle() < 0) {
+            client.waiting = 0;
+            return -1;
+        }
     }
 
-    switch (scmd.code) {
+    client.waiting = 0;
+    *scmd = client.answer;
+    return 0;
+}
+
+/* The server has answered the command with the scmd, the rest of the reply
+ * is read by the command's handle. Return -1 on error */
+static int handle_reply(const char cmd[MAX_COMMAND], struct scmd_payload *scmd)
+{
+    switch (scmd->code) {
         case server_error:
             printf("Internal server error!\n");
             return -1;
@@ -671,13 +791,16 @@ static int deploy_command(char cmd[MAX_COMMAND])
             printf("Invalid command: \"%s\"\n", cmd);
             return 0;
 
+        case slow_consumer:
+            return handle_slow_consumer();
+
         case task_ready:
             /* The task is ready to be handled */
             break;
 
         default:
             panic("Unknown error code: \"%s\"(%d)\n",
-                code_to_str(scmd.code), scmd.code
+                code_to_str(scmd->code), scmd->code
             );
     }
 
@@ -689,7 +812,7 @@ static int deploy_command(char cmd[MAX_COMMAND])
     for (i = 0; i < ARRSIZE(commands); i++) {
         const char *name = commands[i].name;
         if (strncmp(start, name, strlen(name)-1) == 0) {
-            return commands[i].handle(&scmd);
+            return commands[i].handle(scmd);
         }
     }
 
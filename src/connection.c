@@ -6,40 +6,167 @@
  *******************************************/
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include "connection.h"
+#include "ebr.h"
+#include "pool.h"
+#include "slogin.h"
 #include "util.h"
 #include "synch.h"
 #include "user.h"
 
+/* A group of frames queued together, they are sent back to back and dropped
+ * (if ever) as a whole */
+struct outbound {
+    struct outbound *next;      /* The group queued after this one */
+    enum push_type type;        /* Where the frames came from */
+    int curr;                   /* The next frame to be sent */
+    int nframes;                /* Number of frames */
+    struct frame *frames[];     /* The frames themselves */
+};
+
+/* The sendmsg() an io_uring reactor is sending, it has to stay put until
+ * the send is done (see flush_uring()) */
+struct flush {
+    struct msghdr msg;
+    struct iovec iov[FLUSH_IOVECS];
+};
+
+/* An array of connections that is never changed once published, readers go
+ * through it without any locks (see registry_traverse()) */
+struct snapshot {
+    uint32_t len;               /* Number of connections */
+    struct connection *conns[];
+};
+
+/* The registered connections of one reactor. Only that reactor touches the
+ * list, so other threads hand it their broadcasts (see broadcast()) */
+struct shard {
+    struct reactor *reactor;    /* Owns every connection on the list */
+    struct ilist conns;         /* Of each connection's shard link */
+    struct shard *next;         /* The shard of another reactor */
+};
+
+/* A broadcast on its way to the connections of a shard */
+struct shard_cast {
+    struct shard *shard;        /* Where it's going */
+    struct user *user;          /* Who it's about */
+    struct frame *frame;        /* What's being broadcast */
+    struct handoff handoff;     /* How a copy gets to the shard's reactor */
+};
+
+/* Who is logged in where, the connection for a user is slots[user id] */
+struct registry {
+    struct connection **slots;  /* Connections of logged in users */
+    uint32_t nslots;            /* One more than the largest user id */
+    struct snapshot *snap;      /* Every connection in the slots */
+    struct shard *shards;       /* One per reactor, see registry_add_shard() */
+    struct lock lock;           /* Held by writers */
+};
+
+/* Counters for every connection, see conn_get_stats() */
+static struct conn_stats stats = {0};
+
 struct connection {             /* Contains all information for
                                  * client/server communications */
     int sock;                   /* Socket for this connection */
     struct cic_payload cic;     /* Data delivered by client */
-    pthread_t *thread;          /* The thread handling this connection */
+    struct reactor *reactor;    /* The reactor handling this connection */
+    struct watch *watch;        /* Registration with the reactor */
+    conn_func on_read;          /* Called with what the client sends */
+    time_t last_active;         /* Last time the client sent something */
+    struct login *login;        /* Login progress, NULL once logged in */
+    struct decoder *decoder;    /* Bytes read but not handled yet, only
+                                 * touched by the reactor thread */
+    bool busy;                  /* Its last command is still being run, only
+                                 * touched by the reactor thread */
+    bool tagged;                /* Frames go out after a server_tagged */
     struct user *user;          /* The user on the other side */
-    struct lock *lock;          /* Just in case... shouldn't need it */
+    struct lock lock;           /* Just in case... shouldn't need it */
+    struct timer timer;         /* For the owner, see conn_get_timer() */
+    struct list_link shard;     /* On its reactor's shard while registered */
+
+    int refs;                   /* References held, free()'d at zero */
+    bool closed;                /* conn_free() has been called */
+
+    struct outbound *out_first; /* Next group to be sent to the client */
+    struct outbound *out_last;  /* Last group queued */
+    size_t out_bytes;           /* Bytes queued, excluding sent frames */
+    uint32_t out_off;           /* Bytes of the current frame already sent,
+                                 * only touched by the reactor thread */
+    struct outbound *out_busy;  /* The last group conn_flush() is sending
+                                 * from without the lock, NULL if none */
+    bool flush_posted;          /* A flush is waiting on the reactor */
+    struct handoff handoff;     /* How that flush gets to the reactor */
+    struct flush *flush;        /* What io_uring is sending from, NULL
+                                 * until the first send */
+    bool sending;               /* The flush is in flight (io_uring) */
+
+    enum slow_policy policy;    /* What to do once past the high water mark */
+    size_t high_water;          /* Queued bytes where the client is "slow" */
+    size_t low_water;           /* Queued bytes where it has caught up */
+    bool slow;                  /* Went past high_water, not yet low_water */
+    time_t kicked;              /* When it was kicked for being too slow,
+                                 * zero if it hasn't been */
 
     struct in_addr addr;        /* The IPv4 address */
     unsigned int port;          /* Port num for this connection */
 };
 
+static struct pool conn_pool = POOL_INIT("connections", struct connection);
+
+/* The request the calling thread is answering, see conn_reply_to() */
+static __thread struct {
+    struct connection *conn;    /* Who asked, NULL if nobody */
+    uint32_t id;                /* The id of their request */
+} replying;
+
 /* Helper functions */
-static int send_broad_logoff(int sock, struct user *user);
 static void num_blocked_iter(void *item, void *arg);
 static bool conn_user_blocked(struct connection *conn, struct user *user);
-static int send_broadcast_logon(struct connection *conn, struct user *new_user);
-static int deploy_logon_payload(int sock, struct user *user);
-static void deploy_logoff(void *item, void *arg);
-static int send_broadcast_msg(struct connection *, struct user *, char *);
 static bool valid_broadcast(struct connection *conn, struct user *user);
+static int broadcast(struct registry *, struct user *, struct frame *);
+static int post_broadcast(struct shard_cast *cast);
+static void broadcast_task(void *arg);
+static void shard_broadcast(struct shard_cast *cast);
+static struct shard *find_shard(struct registry *reg, struct reactor *reactor);
+static struct snapshot *snapshot_copy(struct snapshot *snap, uint32_t cap);
+static void unref_task(void *arg);
+static void deploy_frame(struct connection *conn, struct shard_cast *cast);
+static void flush_task(void *arg);
+static void conn_ready(void *arg, uint32_t events);
+static void conn_recv(void *arg, const char *data, ssize_t len);
+static void conn_sent(void *arg, ssize_t n);
+static int flush_uring(struct connection *conn);
+static int flush_now(struct connection *conn, bool closing);
+static int gather(struct connection *conn, struct iovec *iov);
+static void free_queue(struct outbound *out);
+static void kick_task(void *arg);
+static struct outbound *sent(struct connection *conn, size_t n);
+static size_t iov_len(struct iovec *iov, int iovcnt);
+static struct outbound *last_busy(struct connection *conn);
+static void free_frames(struct frame **frames, int nframes);
+static int queue_frames(struct connection *, enum push_type, struct frame **, int);
+static bool make_room(struct connection *conn, enum push_type type, size_t bytes);
+static bool drop_oldest(struct connection *conn, size_t bytes);
+static void kick_slow(struct connection *conn);
+static void free_outbound(struct outbound *out);
+static size_t frames_len(struct frame **frames, int nframes);
+static uint32_t reply_id(struct connection *conn, enum push_type type);
+static void count(unsigned long *counter);
 
 struct connection *conn_init(void)
 {
-    struct connection *conn = malloc(sizeof(struct connection));
+    struct connection *conn = pool_get(&conn_pool);
     if (conn == NULL)
         return conn;
 
@@ -48,13 +175,28 @@ struct connection *conn_init(void)
     // To represent uninitialised connection
     conn->sock = -1;
 
-    conn->lock = lock_init();
-    if (conn->lock == NULL) {
-        free(conn->thread);
-        free(conn);
+    // The caller holds the first reference
+    conn->refs = 1;
+
+    // Not idle until it's had a chance to say something
+    conn->last_active = time(NULL);
+
+    if (lock_setup(&conn->lock, lock_spin) < 0) {
+        pool_put(&conn_pool, conn);
+        return NULL;
+    }
+
+    conn->decoder = decoder_init();
+    if (conn->decoder == NULL) {
+        lock_teardown(&conn->lock);
+        pool_put(&conn_pool, conn);
         return NULL;
     }
 
+    conn->policy = CONN_SLOW_POLICY;
+    conn->high_water = CONN_HIGH_WATER;
+    conn->low_water = CONN_LOW_WATER;
+
     return conn;
 }
 
@@ -63,32 +205,72 @@ void conn_free(struct connection *conn)
     if (conn == NULL)
         return;
 
-    struct lock *lock = conn->lock;
-    lock_acquire(lock);
+    lock_acquire(&conn->lock);
 
-    if (conn->sock >= 0)
-        close(conn->sock);
+    // The reactor must be done with the socket before it's closed
+    assert(conn->watch == NULL);
+    assert(conn->closed == false);
+    conn->closed = true;
 
-    if (conn->thread != NULL)
-        free(conn->thread);
+    // The kernel may still be sending from the queue (io_uring), the socket
+    // and the rest of the queue are then left for conn_sent()
+    if (conn->sending == false) {
+        if (conn->sock >= 0)
+            close(conn->sock);
+        __atomic_store_n(&conn->sock, -1, __ATOMIC_RELAXED);
 
-    if (conn->user != NULL) {
-        // This is a reference, thus don't touch the user
+        free_queue(conn->out_first);
+        conn->out_first = NULL;
+        conn->out_last = NULL;
+        conn->out_bytes = 0;
     }
 
-    free(conn);
+    login_free(conn->login);
+    conn->login = NULL;
+
+    decoder_free(conn->decoder);
+    conn->decoder = NULL;
+
+    lock_release(&conn->lock);
 
-    lock_release(lock);
-    lock_free(lock);
+    conn_unref(conn);
+}
+
+void conn_ref(struct connection *conn)
+{
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    assert(conn->refs > 0);
+    conn->refs += 1;
+    lock_release(&conn->lock);
+}
+
+void conn_unref(struct connection *conn)
+{
+    if (conn == NULL)
+        return;
+
+    lock_acquire(&conn->lock);
+    assert(conn->refs > 0);
+    conn->refs -= 1;
+    bool last = (conn->refs == 0);
+    lock_release(&conn->lock);
+
+    if (last == false)
+        return;
+
+    // Only conn_free() drops the first reference, so it's already closed
+    assert(conn->closed == true);
+    free(conn->flush);
+    lock_teardown(&conn->lock);
+    pool_put(&conn_pool, conn);
 }
 
 int conn_get_sock(struct connection *conn)
 {
     assert(conn != NULL);
-    int sock;
-    lock_acquire(conn->lock);
-    sock = conn->sock;
-    lock_release(conn->lock);
+    // Asked for on every read and write, it's only set once so no lock
+    int sock = __atomic_load_n(&conn->sock, __ATOMIC_RELAXED);
     assert(sock >= 0);
     return sock;
 }
@@ -96,319 +278,1300 @@ int conn_get_sock(struct connection *conn)
 void conn_set_sock(struct connection *conn, int sock)
 {
     assert(conn != NULL);
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     assert(conn->sock == -1);
-    conn->sock = sock;
-    lock_release(conn->lock);
+    __atomic_store_n(&conn->sock, sock, __ATOMIC_RELAXED);
+    lock_release(&conn->lock);
 }
 
 void conn_set_user(struct connection *conn, struct user *user)
 {
     assert(conn != NULL);
     assert(user != NULL);
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     assert(conn->user == NULL);
     conn->user = user;
-    lock_release(conn->lock);
+    lock_release(&conn->lock);
 }
 
 void conn_set_in_addr(struct connection *conn, struct in_addr in)
 {
     assert(conn != NULL);
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     conn->addr = in;
-    lock_release(conn->lock);
+    lock_release(&conn->lock);
 }
 
 unsigned short conn_get_port(struct connection *conn)
 {
     unsigned short port;
     assert(conn);
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     port = conn->port;
-    lock_release(conn->lock);
+    lock_release(&conn->lock);
     return port;
 }
 
 void conn_set_port(struct connection *conn, unsigned short port)
 {
     assert(conn);
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     conn->port = port;
-    lock_release(conn->lock);
+    lock_release(&conn->lock);
 }
 
 struct in_addr conn_get_in_addr(struct connection *conn)
 {
     struct in_addr addr;
     assert(conn);
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     addr = conn->addr;
-    lock_release(conn->lock);
+    lock_release(&conn->lock);
     return addr;
 }
 
-pthread_t *conn_get_thread(struct connection *conn)
+struct user *conn_get_user(struct connection *conn)
 {
-    pthread_t *ret;
-    lock_acquire(conn->lock);
-    ret = conn->thread;
-    lock_release(conn->lock);
-    assert(ret != NULL);
+    struct user *ret;
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    ret = conn->user;
+    lock_release(&conn->lock);
+    return ret;
+}
+
+struct decoder *conn_get_decoder(struct connection *conn)
+{
+    assert(conn != NULL);
+    assert(conn->decoder != NULL);
+    return conn->decoder;
+}
+
+void conn_set_busy(struct connection *conn, bool busy)
+{
+    assert(conn != NULL);
+    conn->busy = busy;
+
+    // What the client sends in the meantime is left in the socket rather
+    // than piling up in the decoder
+    lock_acquire(&conn->lock);
+    if (conn->watch != NULL
+        && reactor_pause(conn->reactor, conn->watch, busy) < 0) {
+        // Wake up the reactor so the connection gets dropped
+        shutdown(conn->sock, SHUT_RDWR);
+    }
+    lock_release(&conn->lock);
+}
+
+bool conn_is_busy(struct connection *conn)
+{
+    assert(conn != NULL);
+    return conn->busy;
+}
+
+void conn_set_tagged(struct connection *conn, bool tagged)
+{
+    assert(conn != NULL);
+    __atomic_store_n(&conn->tagged, tagged, __ATOMIC_RELEASE);
+}
+
+void conn_reply_to(struct connection *conn, uint32_t id)
+{
+    replying.conn = conn;
+    replying.id = id;
+}
+
+bool conn_is_closed(struct connection *conn)
+{
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    bool ret = conn->closed;
+    lock_release(&conn->lock);
+    return ret;
+}
+
+struct timer *conn_get_timer(struct connection *conn)
+{
+    assert(conn != NULL);
+    return &conn->timer;
+}
+
+struct login *conn_get_login(struct connection *conn)
+{
+    struct login *ret;
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    ret = conn->login;
+    lock_release(&conn->lock);
     return ret;
 }
 
-void conn_set_thread(struct connection *conn, pthread_t *tid)
+void conn_set_login(struct connection *conn, struct login *login)
 {
     assert(conn != NULL);
-    assert(tid != NULL);
+    lock_acquire(&conn->lock);
+    login_free(conn->login);
+    conn->login = login;
+    lock_release(&conn->lock);
+}
 
-    lock_acquire(conn->lock);
-    assert(conn->thread == NULL);
-    conn->thread = tid;
-    lock_release(conn->lock);
+struct reactor *conn_get_reactor(struct connection *conn)
+{
+    struct reactor *ret;
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    ret = conn->reactor;
+    lock_release(&conn->lock);
+    return ret;
+}
+
+void conn_set_reactor(struct connection *conn, struct reactor *reactor)
+{
+    assert(conn != NULL);
+    assert(reactor != NULL);
+
+    lock_acquire(&conn->lock);
+    assert(conn->reactor == NULL);
+    conn->reactor = reactor;
+    lock_release(&conn->lock);
+}
+
+int conn_watch(struct connection *conn, conn_func func)
+{
+    assert(conn != NULL);
+    assert(func != NULL);
+
+    struct watch *watch;
+
+    lock_acquire(&conn->lock);
+    assert(conn->reactor != NULL);
+    assert(conn->watch == NULL);
+    conn->last_active = time(NULL);
+    conn->on_read = func;
+    if (reactor_get_backend(conn->reactor) == reactor_uring) {
+        watch = reactor_stream(
+            conn->reactor,
+            conn->sock,
+            conn_recv,
+            conn_sent,
+            conn
+        );
+    } else {
+        watch = reactor_add(
+            conn->reactor,
+            conn->sock,
+            EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+            conn_ready,
+            conn
+        );
+    }
+    conn->watch = watch;
+    lock_release(&conn->lock);
+
+    // The reactor may have already dropped (and free()'d) the connection,
+    // so it can't be touched from here on
+    return (watch == NULL) ? -1 : 0;
+}
+
+void conn_unwatch(struct connection *conn)
+{
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    reactor_del(conn->reactor, conn->watch);
+    conn->watch = NULL;
+    if (timer_armed(&conn->timer) == true)
+        reactor_disarm(conn->reactor, &conn->timer);
+    lock_release(&conn->lock);
+}
+
+void conn_touch(struct connection *conn)
+{
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    conn->last_active = time(NULL);
+    lock_release(&conn->lock);
+}
+
+time_t conn_idle_time(struct connection *conn)
+{
+    time_t ret;
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    ret = time(NULL) - conn->last_active;
+    lock_release(&conn->lock);
+    return ret;
 }
 
 void conn_set_cic(struct connection *conn, struct cic_payload cic)
 {
-    lock_acquire(conn->lock);
+    lock_acquire(&conn->lock);
     conn->cic = cic;
-    lock_release(conn->lock);
+    lock_release(&conn->lock);
 }
 
-int conn_broad_log_on(struct list *conns, struct user *user)
+struct cic_payload conn_get_cic(struct connection *conn)
 {
-    struct iter *iter = list_iter_init(conns);
-    if (iter == NULL)
-        return -1;
+    lock_acquire(&conn->lock);
+    struct cic_payload ret = conn->cic;
+    lock_release(&conn->lock);
+    return ret;
+}
 
-    while (iter_has_next(iter) == true) {
-        struct connection *conn = iter_get(iter);
-        if (conn_user_blocked(conn, user) == false) {
-            if (send_broadcast_logon(conn, user) < 0) {
-                iter_free(iter);
-                return -1;
-            }
-        }
-        iter_next(iter);
-    }
+int conn_send(struct connection *conn, struct frame *frame)
+{
+    return queue_frames(conn, push_reply, &frame, 1);
+}
 
-    iter_free(iter);
+int conn_send_many(struct connection *conn, struct frame **frames, int nframes)
+{
+    return queue_frames(conn, push_reply, frames, nframes);
+}
 
-    return 0;
+int conn_push
+(
+    struct connection *conn,
+    enum push_type type,
+    struct frame **frames,
+    int nframes
+)
+{
+    return queue_frames(conn, type, frames, nframes);
 }
 
-int conn_broad_log_off(struct list *conns, struct user *user)
+void conn_set_slow_policy
+(
+    struct connection *conn,
+    enum slow_policy policy,
+    size_t high_water,
+    size_t low_water
+)
 {
-    char *name = user_get_uname(user);
-    if (name == NULL)
-        return -1;
+    assert(conn != NULL);
+    assert(low_water <= high_water);
 
-    list_traverse(conns, deploy_logoff, user);
+    lock_acquire(&conn->lock);
+    conn->policy = policy;
+    conn->high_water = high_water;
+    conn->low_water = low_water;
+    lock_release(&conn->lock);
+}
 
-    free(name);
-    return 0;
+time_t conn_kicked_time(struct connection *conn)
+{
+    time_t ret = -1;
+    assert(conn != NULL);
+    lock_acquire(&conn->lock);
+    if (conn->kicked != 0)
+        ret = time(NULL) - conn->kicked;
+    lock_release(&conn->lock);
+    return ret;
 }
 
-int conn_broad_msg
+void conn_get_stats(struct conn_stats *ret)
+{
+    assert(ret != NULL);
+    ret->slow = __atomic_load_n(&stats.slow, __ATOMIC_RELAXED);
+    ret->dropped_old = __atomic_load_n(&stats.dropped_old, __ATOMIC_RELAXED);
+    ret->dropped_new = __atomic_load_n(&stats.dropped_new, __ATOMIC_RELAXED);
+    ret->kicked = __atomic_load_n(&stats.kicked, __ATOMIC_RELAXED);
+}
+
+int conn_flush(struct connection *conn)
+{
+    assert(conn != NULL);
+
+    if (reactor_get_backend(conn->reactor) == reactor_uring)
+        return flush_uring(conn);
+
+    return flush_now(conn, false);
+}
+
+/* Queue the frames as one group to be sent by the connection's reactor. If
+ * the client isn't keeping up the connection's slow_policy decides what
+ * happens. Return -1 if the frames weren't queued (they are free()'d) */
+static int queue_frames
 (
-    struct list *conns,
-    struct user *user,
-    char msg[MAX_MSG_LENGTH]
+    struct connection *conn,
+    enum push_type type,
+    struct frame **frames,
+    int nframes
 )
 {
-    struct iter *iter = list_iter_init(conns);
-    if (iter == NULL)
-        return -1;
+    assert(conn != NULL);
+    assert(nframes > 0);
 
-    while (iter_has_next(iter) == true) {
-        struct connection *conn = iter_get(iter);
+    for (int i = 0; i < nframes; i++) {
+        if (frames[i] == NULL) {
+            free_frames(frames, nframes);
+            return -1;
+        }
+    }
 
-        if (send_broadcast_msg(conn, user, msg) < 0) {
-            iter_free(iter);
+    // A tagged client is told what the group is for before it gets it
+    bool tagged = __atomic_load_n(&conn->tagged, __ATOMIC_ACQUIRE);
+    int first = (tagged == true) ? 1 : 0;
+
+    struct outbound *out = malloc(
+        sizeof(struct outbound) + sizeof(struct frame *) * (first + nframes)
+    );
+    if (out == NULL) {
+        free_frames(frames, nframes);
+        return -1;
+    }
+
+    *out = (struct outbound) {0};
+    out->type = type;
+    out->nframes = first + nframes;
+    for (int i = 0; i < nframes; i++)
+        out->frames[first + i] = frames[i];
+
+    if (tagged == true) {
+        out->frames[0] = pack_payload_stag(reply_id(conn, type),
+            frames_len(frames, nframes));
+        if (out->frames[0] == NULL) {
+            free_frames(frames, nframes);
+            free(out);
             return -1;
         }
+    }
+
+    size_t bytes = frames_len(out->frames, out->nframes);
+
+    lock_acquire(&conn->lock);
 
-        iter_next(iter);
+    if (conn->closed == true || conn->kicked != 0
+        || make_room(conn, type, bytes) == false) {
+        lock_release(&conn->lock);
+        free_outbound(out);
+        return -1;
+    }
+
+    // Queued under the lock so nobody else's frames end up in between
+    if (conn->out_last == NULL)
+        conn->out_first = out;
+    else
+        conn->out_last->next = out;
+    conn->out_last = out;
+    conn->out_bytes += bytes;
+
+    bool owner = reactor_is_current(conn->reactor);
+    bool post = (owner == false && conn->flush_posted == false);
+    if (post == true) {
+        // The task holds a reference until it has run. There's only ever
+        // one waiting, so it goes in the connection's own handoff
+        conn->flush_posted = true;
+        conn->handoff = (struct handoff) {.func = flush_task, .arg = conn};
+        conn->refs += 1;
     }
-    iter_free(iter);
+
+    lock_release(&conn->lock);
+
+    // The frames are queued whatever happens now. If the flush fails the
+    // socket is shut down and the reactor drops the connection
+    if (owner == true)
+        conn_flush(conn);
+
+    // An idle client may never see another flush, so this one can't be
+    // allowed to fail
+    if (post == true)
+        reactor_handoff(conn->reactor, &conn->handoff);
+
     return 0;
 }
 
-int conn_get_by_user(struct list *conns, struct user *user, struct connection **ret)
+/* Decide if "bytes" more of "type" can be queued on the conn, applying the
+ * slow_policy if the client is past the high water mark. Replies are always
+ * queued, the client asked for them and is waiting. Must hold conn->lock.
+ * Return true if the frames can be queued */
+static bool make_room(struct connection *conn, enum push_type type, size_t bytes)
 {
-    struct iter *iter = list_iter_init(conns);
-    if (iter == NULL)
-        return -1;
+    if (type == push_reply)
+        return true;
 
-    while (iter_has_next(iter) == true) {
-        struct connection *conn = iter_get(iter);
-        lock_acquire(conn->lock);
-        if (user_equal(conn->user, user) == true) {
-            *ret = conn;
-            lock_release(conn->lock);
-            return 0;
+    if (conn->slow == false && conn->out_bytes + bytes <= conn->high_water)
+        return true;
+
+    if (conn->slow == false) {
+        conn->slow = true;
+        count(&stats.slow);
+    }
+
+    switch (conn->policy) {
+        case slow_drop_old:
+            if (drop_oldest(conn, bytes) == true)
+                return true;
+            break;
+
+        case slow_drop_new:
+            break;
+
+        case slow_disconnect:
+            kick_slow(conn);
+            return false;
+    }
+
+    count(&stats.dropped_new);
+    return false;
+}
+
+/* Drop the oldest broadcasts until "bytes" more fit under the high water
+ * mark. Groups that may be half way through being sent are never touched.
+ * Must hold conn->lock. Return true if there is now enough room */
+static bool drop_oldest(struct connection *conn, size_t bytes)
+{
+    if (conn->out_first == NULL)
+        return (bytes <= conn->high_water);
+
+    struct outbound *prev = last_busy(conn);
+    while (conn->out_bytes + bytes > conn->high_water && prev->next != NULL) {
+        struct outbound *out = prev->next;
+        if (out->type != push_broadcast) {
+            prev = out;
+            continue;
         }
-        lock_release(conn->lock);
-        iter_next(iter);
+
+        prev->next = out->next;
+        if (conn->out_last == out)
+            conn->out_last = prev;
+
+        conn->out_bytes -= frames_len(out->frames, out->nframes);
+        free_outbound(out);
+        count(&stats.dropped_old);
     }
 
-    iter_free(iter);
-    *ret = NULL;
-    return 0;
+    return (conn->out_bytes + bytes <= conn->high_water);
 }
 
-int conn_get_num_blocked(struct list *conns, struct user *user)
+/* Return the last group that can't be dropped, everything after it can be.
+ * The first group may have been partly sent, and conn_flush() may be
+ * sending from up to conn->out_busy. Must hold conn->lock */
+static struct outbound *last_busy(struct connection *conn)
 {
-    int ret = 0;
-    struct tuple tuple = {
-        .items[0] = &ret,
-        .items[1] = user,
-    };
+    return (conn->out_busy != NULL) ? conn->out_busy : conn->out_first;
+}
 
-    list_traverse(conns, num_blocked_iter, &tuple);
-    return ret;
+/* The client isn't keeping up, throw away what it hasn't started receiving
+ * and tell it why. The connection is dropped once the client has read that,
+ * or when the connection's timer goes off SLOW_GRACE seconds later (see
+ * kick_task()). Must hold conn->lock */
+static void kick_slow(struct connection *conn)
+{
+    if (conn->kicked != 0)
+        return;
+
+    conn->kicked = time(NULL);
+    count(&stats.kicked);
+
+    // As in drop_oldest(), the groups being sent are left alone
+    struct outbound *keep = last_busy(conn);
+    struct outbound *out = (keep != NULL) ? keep->next : NULL;
+    while (out != NULL) {
+        struct outbound *next = out->next;
+        conn->out_bytes -= frames_len(out->frames, out->nframes);
+        free_outbound(out);
+        out = next;
+    }
+
+    if (keep != NULL) {
+        keep->next = NULL;
+        conn->out_last = keep;
+    }
+
+    // The last thing the client gets, a push if the client is tagged
+    struct outbound *bye = malloc(
+        sizeof(struct outbound) + sizeof(struct frame *) * 2
+    );
+    if (bye != NULL) {
+        *bye = (struct outbound) {0};
+        bye->type = push_reply;
+        bye->nframes = 1;
+        bye->frames[0] = pack_payload_scmd(slow_consumer, 0 /* ignored */);
+        if (bye->frames[0] != NULL && conn->tagged == true) {
+            bye->frames[1] = bye->frames[0];
+            bye->frames[0] = pack_payload_stag(0, bye->frames[1]->len);
+            bye->nframes = 2;
+        }
+        if (bye->frames[0] == NULL) {
+            free_outbound(bye);
+        } else {
+            if (conn->out_last == NULL)
+                conn->out_first = bye;
+            else
+                conn->out_last->next = bye;
+            conn->out_last = bye;
+            conn->out_bytes += frames_len(bye->frames, bye->nframes);
+        }
+    }
+
+    // Only the reactor can move the timer. The task holds a reference until
+    // it has run, the connection isn't closed so dropping it on failure
+    // can't be the last one
+    conn->refs += 1;
+    if (reactor_post(conn->reactor, kick_task, conn) < 0)
+        conn->refs -= 1;
 }
 
-/* Return if the user was the block list of the conn */
-static void num_blocked_iter(void *item, void *arg)
+/* The socket has taken "n" more bytes of the outbound queue, pop everything
+ * that has been sent in full and clear the busy mark. The groups that have
+ * been finished are returned as a list, for the caller to free() without
+ * holding the lock */
+static struct outbound *sent(struct connection *conn, size_t n)
 {
-    struct connection *conn = item;
-    struct tuple *tuple = arg;
+    struct outbound *done = NULL;
+    struct outbound **tail = &done;
 
-    int *ret_ptr = tuple->items[0];
-    struct user *user = tuple->items[1];
+    lock_acquire(&conn->lock);
+    conn->out_busy = NULL;
 
-    if (conn_user_blocked(conn, user) == true)
-        *ret_ptr += 1;
+    while (n > 0) {
+        struct outbound *out = conn->out_first;
+        struct frame *frame = out->frames[out->curr];
+        size_t left = frame->len - conn->out_off;
+
+        if (n < left) {
+            conn->out_off += n;
+            break;
+        }
+
+        n -= left;
+        conn->out_off = 0;
+        conn->out_bytes -= frame->len;
+        out->curr += 1;
+        frame_free(frame);
+
+        if (out->curr < out->nframes)
+            continue;
+
+        conn->out_first = out->next;
+        if (conn->out_first == NULL)
+            conn->out_last = NULL;
+
+        out->next = NULL;
+        *tail = out;
+        tail = &out->next;
+    }
+
+    if (conn->slow == true && conn->out_bytes <= conn->low_water)
+        conn->slow = false;
+
+    // The client has been told why it's being kicked, the reactor will
+    // see the end of the stream and drop the connection
+    if (conn->kicked != 0 && conn->out_first == NULL)
+        shutdown(conn->sock, SHUT_RD);
+    lock_release(&conn->lock);
+
+    return done;
 }
 
-/* Return true if the user is blocked by the conn->user */
-static bool conn_user_blocked(struct connection *conn, struct user *user)
+/* Return the total number of bytes in the buffers */
+static size_t iov_len(struct iovec *iov, int iovcnt)
 {
-    bool ret;
-    lock_acquire(conn->lock);
-    ret = user_on_blocklist(conn->user, user);
-    lock_release(conn->lock);
+    size_t ret = 0;
+    for (int i = 0; i < iovcnt; i++)
+        ret += iov[i].iov_len;
     return ret;
 }
 
-/* Used to iterate over the list of connection and notify each one
- * that the user has logged of */
-static void deploy_logoff(void *item, void *arg)
+/* Return a copy of the snapshot with room for "cap" connections, NULL on
+ * error */
+static struct snapshot *snapshot_copy(struct snapshot *snap, uint32_t cap)
 {
-    struct connection *conn = item;
-    struct user *user = arg;
-    lock_acquire(conn->lock);
+    struct snapshot *ret = malloc(
+        sizeof(struct snapshot) + cap * sizeof(struct connection *)
+    );
+    if (ret == NULL)
+        return NULL;
+
+    ret->len = snap->len;
+    memcpy(ret->conns, snap->conns, snap->len * sizeof(struct connection *));
+    return ret;
+}
+
+/* Drop the registry's reference to the connection, see registry_rm() */
+static void unref_task(void *arg)
+{
+    conn_unref(arg);
+}
+
+/* Handed to the connection's reactor when another thread queues frames */
+static void flush_task(void *arg)
+{
+    struct connection *conn = arg;
+
+    // Anything queued from here on hands over a new flush
+    lock_acquire(&conn->lock);
+    conn->flush_posted = false;
+    lock_release(&conn->lock);
+
+    conn_flush(conn);
+    conn_unref(conn);
+}
+
+/* Called by an epoll reactor when the client's socket is ready. The socket
+ * is edge triggered so it's read until there is nothing left, and the
+ * connection's func is given each read as soon as it's made. As much of the
+ * outbound queue as the socket will take is sent */
+static void conn_ready(void *arg, uint32_t events)
+{
+    struct connection *conn = arg;
+    int sock = conn_get_sock(conn);
+
+    if (events & EPOLLOUT)
+        conn_flush(conn);
 
-    if (valid_broadcast(conn, user) == false) {
-        lock_release(conn->lock);
+    // Nothing to read, the socket just has room to write again
+    if ((events & ~EPOLLOUT) == 0)
         return;
+
+    // A busy connection's watch is paused, the rest is read once it's done
+    while (conn->busy == false) {
+        ssize_t ret = decoder_recv(conn->decoder, sock);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (conn->on_read(conn, ret) < 0 || ret <= 0)
+            return;
     }
+}
+
+/* Called by an io_uring reactor with what it has read from the client */
+static void conn_recv(void *arg, const char *data, ssize_t len)
+{
+    struct connection *conn = arg;
 
-    send_broad_logoff(conn->sock, user);
-    lock_release(conn->lock);
+    if (len > 0 && decoder_feed(conn->decoder, data, len) < 0)
+        len = -1;
+
+    conn->on_read(conn, len);
 }
 
-/* Simple send the log off message via the sock, return -1 on error, otherwise
- * 0 is returned */
-static int send_broad_logoff(int sock, struct user *user)
+/* Called by an io_uring reactor once the socket has taken "n" bytes of the
+ * flush, the next one is queued straight away. The send holds a reference
+ * to the connection, so it's still here even if it's been closed */
+static void conn_sent(void *arg, ssize_t n)
 {
-    int ret;
-    if (send_payload_scmd(sock, broad_logoff, 0 /* ignored */) < 0)
+    struct connection *conn = arg;
+    int err = (n < 0) ? errno : 0;
+
+    free_queue(sent(conn, (n < 0) ? 0 : n));
+
+    lock_acquire(&conn->lock);
+    conn->sending = false;
+    bool closed = conn->closed;
+    lock_release(&conn->lock);
+
+    if (closed == true) {
+        // conn_free() left the socket and the rest of the queue for us. The
+        // client gets the same last write as with epoll
+        flush_now(conn, true);
+
+        lock_acquire(&conn->lock);
+        close(conn->sock);
+        __atomic_store_n(&conn->sock, -1, __ATOMIC_RELAXED);
+        struct outbound *left = conn->out_first;
+        conn->out_first = NULL;
+        conn->out_last = NULL;
+        conn->out_bytes = 0;
+        lock_release(&conn->lock);
+
+        free_queue(left);
+    } else if (err == 0 || err == EINTR || err == EAGAIN || err == ECANCELED) {
+        conn_flush(conn);
+    } else {
+        // Wake up the reactor so the connection gets dropped
+        shutdown(conn_get_sock(conn), SHUT_RDWR);
+    }
+
+    conn_unref(conn);
+}
+
+/* Write as much of the queue to the socket as it will take without waiting,
+ * see conn_flush(). A "closing" connection is written to one last time
+ * after conn_free(), see conn_sent(). Return -1 on error */
+static int flush_now(struct connection *conn, bool closing)
+{
+    while (1) {
+        struct iovec iov[FLUSH_IOVECS];
+
+        lock_acquire(&conn->lock);
+        if (conn->closed == true && closing == false) {
+            lock_release(&conn->lock);
+            return -1;
+        }
+        assert(reactor_is_current(conn->reactor));
+        int sock = conn->sock;
+        int iovcnt = gather(conn, iov);
+        lock_release(&conn->lock);
+
+        if (iovcnt == 0)
+            return 0;
+
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = iovcnt,
+        };
+
+        ssize_t n = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        int err = (n < 0) ? errno : 0;
+
+        free_queue(sent(conn, (n < 0) ? 0 : n));
+
+        if (err == EINTR)
+            continue;
+
+        if (err != 0 && err != EAGAIN && err != EWOULDBLOCK) {
+            // Wake up the reactor so the connection gets dropped
+            shutdown(sock, SHUT_RDWR);
+            return -1;
+        }
+
+        // The reactor calls us again once there's room (EPOLLOUT)
+        if (err != 0 || (size_t) n < iov_len(iov, iovcnt))
+            return 0;
+
+        // Everything that was queued has been sent
+        if (iovcnt < FLUSH_IOVECS)
+            return 0;
+    }
+}
+
+/* Queue a sendmsg() of the next FLUSH_IOVECS frames on an io_uring reactor,
+ * unless one is already in flight (conn_sent() carries on from there).
+ * Return -1 on error */
+static int flush_uring(struct connection *conn)
+{
+    lock_acquire(&conn->lock);
+    if (conn->closed == true) {
+        lock_release(&conn->lock);
         return -1;
+    }
+    assert(reactor_is_current(conn->reactor));
+
+    // Nothing can be sent once the reactor has let go of the socket
+    if (conn->sending == true || conn->watch == NULL) {
+        lock_release(&conn->lock);
+        return 0;
+    }
 
+    if (conn->flush == NULL) {
+        conn->flush = malloc(sizeof(struct flush));
+        if (conn->flush == NULL) {
+            // Nothing would send the queue, so the connection is dropped
+            shutdown(conn->sock, SHUT_RDWR);
+            lock_release(&conn->lock);
+            return -1;
+        }
+    }
+
+    int iovcnt = gather(conn, conn->flush->iov);
+    if (iovcnt == 0) {
+        lock_release(&conn->lock);
+        return 0;
+    }
+
+    conn->flush->msg = (struct msghdr) {
+        .msg_iov = conn->flush->iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    int ret = reactor_send(conn->reactor, conn->watch, &conn->flush->msg);
+    if (ret == 0) {
+        // Held until conn_sent()
+        conn->sending = true;
+        conn->refs += 1;
+    } else {
+        // As above, the reactor drops the connection
+        conn->out_busy = NULL;
+        shutdown(conn->sock, SHUT_RDWR);
+    }
+    lock_release(&conn->lock);
+
+    return ret;
+}
+
+/* Point the iovecs at the next FLUSH_IOVECS frames to be sent. The groups
+ * they come from are marked busy so other threads leave them alone (see
+ * drop_oldest()) while they're used without the lock. Must hold conn->lock.
+ * Return the number of iovecs used */
+static int gather(struct connection *conn, struct iovec *iov)
+{
+    int iovcnt = 0;
+    uint32_t off = conn->out_off;
+    struct outbound *out = conn->out_first;
+
+    while (out != NULL && iovcnt < FLUSH_IOVECS) {
+        for (int i = out->curr; i < out->nframes; i++) {
+            if (iovcnt == FLUSH_IOVECS)
+                break;
+            struct frame *frame = out->frames[i];
+            iov[iovcnt].iov_base = &frame->data[off];
+            iov[iovcnt].iov_len = frame->len - off;
+            iovcnt += 1;
+            off = 0;
+        }
+        conn->out_busy = out;
+        out = out->next;
+    }
+
+    return iovcnt;
+}
+
+/* Free a list of groups */
+static void free_queue(struct outbound *out)
+{
+    while (out != NULL) {
+        struct outbound *next = out->next;
+        free_outbound(out);
+        out = next;
+    }
+}
+
+/* Posted to the connection's reactor when the client is kicked for being
+ * slow. The client gets SLOW_GRACE seconds to read why before the timer goes
+ * off, and the reason is sent now if there's room */
+static void kick_task(void *arg)
+{
+    struct connection *conn = arg;
+
+    lock_acquire(&conn->lock);
+    if (conn->watch != NULL && conn->timer.func != NULL)
+        reactor_arm(conn->reactor, &conn->timer, conn->kicked + SLOW_GRACE);
+    lock_release(&conn->lock);
+
+    conn_flush(conn);
+    conn_unref(conn);
+}
+
+/* Free the frames that couldn't be queued */
+static void free_frames(struct frame **frames, int nframes)
+{
+    for (int i = 0; i < nframes; i++)
+        frame_free(frames[i]);
+}
+
+/* Free the group along with the frames that haven't been sent */
+static void free_outbound(struct outbound *out)
+{
+    free_frames(&out->frames[out->curr], out->nframes - out->curr);
+    free(out);
+}
+
+/* Return the total number of bytes in the frames */
+static size_t frames_len(struct frame **frames, int nframes)
+{
+    size_t ret = 0;
+    for (int i = 0; i < nframes; i++)
+        ret += frames[i]->len;
+    return ret;
+}
+
+/* Return the request a group of "type" queued on the conn answers, 0 if it's
+ * a push. Only replies from the thread answering the conn's request (see
+ * conn_reply_to()) are for that request */
+static uint32_t reply_id(struct connection *conn, enum push_type type)
+{
+    if (type != push_reply || replying.conn != conn)
+        return 0;
+    return replying.id;
+}
+
+/* Bump one of the stats counters, they are shared by every thread */
+static void count(unsigned long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+int conn_broad_log_on(struct registry *reg, struct user *user)
+{
     char *name = user_get_uname(user);
     if (name == NULL)
         return -1;
 
-    ret = send_payload_sbof(sock, name);
-    free(name);
-    return ret;
+    struct frame *frames[] = {
+        pack_payload_scmd(broad_logon, 0 /* ignored */),
+        pack_payload_sbon(name),
+    };
+
+    pool_strfree(name);
+    return broadcast(reg, user, frame_join(frames, ARRSIZE(frames)));
 }
 
-/* Used to send the broadcast payload to a particular user to show that
- * the "msg" has been sent */
-static int send_broadcast_msg
+int conn_broad_log_off(struct registry *reg, struct user *user)
+{
+    char *name = user_get_uname(user);
+    if (name == NULL)
+        return -1;
+
+    struct frame *frames[] = {
+        pack_payload_scmd(broad_logoff, 0 /* ignored */),
+        pack_payload_sbof(name),
+    };
+
+    pool_strfree(name);
+    return broadcast(reg, user, frame_join(frames, ARRSIZE(frames)));
+}
+
+int conn_broad_msg
 (
-    struct connection *conn,
+    struct registry *reg,
     struct user *user,
-    char *msg
+    char msg[MAX_MSG_LENGTH]
 )
 {
-    lock_acquire(conn->lock);
+    struct frame *frames[] = {
+        pack_payload_scmd(broad_msg, 0 /* ignored */),
+        pack_payload_sbm(msg),
+    };
 
-    if (valid_broadcast(conn, user) == false) {
-        lock_release(conn->lock);
-        return 0;
-    }
+    return broadcast(reg, user, frame_join(frames, ARRSIZE(frames)));
+}
 
-    if (send_payload_scmd(conn->sock, broad_msg, 0 /* ignored */) < 0) {
-        lock_release(conn->lock);
+/* Queue the frame for every connection that should hear about the "user",
+ * see valid_broadcast(). The frame is packed once and shared, each client
+ * holds a reference until it has been sent. Our reference is dropped.
+ *
+ * Each reactor queues the frame for its own connections, so the other
+ * shards are handed it (see post_broadcast()) and nobody else's connections
+ * are locked from here. Return -1 on error, when some shards may have missed
+ * out */
+static int broadcast(struct registry *reg, struct user *user, struct frame *frame)
+{
+    if (frame == NULL)
         return -1;
+
+    struct shard_cast cast = {
+        .user = user,
+        .frame = frame,
+    };
+
+    int ret = 0;
+    for (cast.shard = reg->shards; cast.shard; cast.shard = cast.shard->next) {
+        if (reactor_is_current(cast.shard->reactor) == true)
+            shard_broadcast(&cast);
+        else if (post_broadcast(&cast) < 0)
+            ret = -1;
     }
 
-    if (send_payload_sbm(conn->sock, msg) < 0) {
-        lock_release(conn->lock);
+    frame_free(frame);
+    return ret;
+}
+
+/* Hand a copy of the cast to the shard's reactor. Unlike reactor_post() a
+ * handoff can't be turned away, so the only error is running out of memory.
+ * Return -1 on error */
+static int post_broadcast(struct shard_cast *cast)
+{
+    struct shard_cast *copy = malloc(sizeof(struct shard_cast));
+    if (copy == NULL)
         return -1;
-    }
 
-    lock_release(conn->lock);
+    *copy = *cast;
+    frame_ref(copy->frame);
+
+    copy->handoff = (struct handoff) {.func = broadcast_task, .arg = copy};
+    reactor_handoff(copy->shard->reactor, &copy->handoff);
     return 0;
 }
 
-/* Return true if the "user" is valid enough to broadcast the the user on
- * the "conn" side */
-static bool valid_broadcast(struct connection *conn, struct user *user)
+/* Handed to a shard's reactor by broadcast() */
+static void broadcast_task(void *arg)
 {
-    if (user_is_logged_on(conn->user) == false)
-        return false;
+    struct shard_cast *cast = arg;
+    shard_broadcast(cast);
+    frame_free(cast->frame);
+    free(cast);
+}
 
-    if (user_equal(conn->user, user) == true)
-        return false;
+/* Queue the broadcast for the connections of the shard, must be called on
+ * the shard's reactor */
+static void shard_broadcast(struct shard_cast *cast)
+{
+    struct list_link *link;
+    ilist_for_each(&cast->shard->conns, link)
+        deploy_frame(ilist_item(link, struct connection, shard), cast);
+}
 
-    if (user_on_blocklist(conn->user, user) == true)
-        return false;
+/* Return the shard of the reactor, NULL if it hasn't been added */
+static struct shard *find_shard(struct registry *reg, struct reactor *reactor)
+{
+    struct shard *shard = reg->shards;
+    while (shard != NULL && shard->reactor != reactor)
+        shard = shard->next;
+    return shard;
+}
 
-    return true;
+struct registry *registry_init(uint32_t max_id)
+{
+    struct registry *ret = malloc(sizeof(struct registry));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct registry) {0};
+    ret->nslots = max_id + 1;
+
+    ret->slots = calloc(ret->nslots, sizeof(struct connection *));
+    if (ret->slots == NULL) {
+        free(ret);
+        return NULL;
+    }
+
+    ret->snap = calloc(1, sizeof(struct snapshot));
+    if (ret->snap == NULL) {
+        free(ret->slots);
+        free(ret);
+        return NULL;
+    }
+
+    if (lock_setup(&ret->lock, lock_park) < 0) {
+        free(ret->snap);
+        free(ret->slots);
+        free(ret);
+        return NULL;
+    }
+
+    return ret;
 }
 
-/* Used to send the broadcast payload to a particular user to show that
- * "new_user" is logged in */
-static int send_broadcast_logon(struct connection *conn, struct user *new_user)
+void registry_free(struct registry *reg)
 {
-    lock_acquire(conn->lock);
+    if (reg == NULL)
+        return;
 
-    if (valid_broadcast(conn, new_user) == false) {
-        lock_release(conn->lock);
-        return 0;
+    while (reg->shards != NULL) {
+        struct shard *shard = reg->shards;
+        reg->shards = shard->next;
+        free(shard);
     }
 
-    if (deploy_logon_payload(conn->sock, new_user) < 0) {
-        lock_release(conn->lock);
+    lock_teardown(&reg->lock);
+    free(reg->snap);
+    free(reg->slots);
+    free(reg);
+}
+
+int registry_add_shard(struct registry *reg, struct reactor *reactor)
+{
+    assert(reg != NULL);
+    assert(reactor != NULL);
+
+    struct shard *shard = malloc(sizeof(struct shard));
+    if (shard == NULL)
         return -1;
-    }
 
-    lock_release(conn->lock);
+    shard->reactor = reactor;
+    ilist_init(&shard->conns);
+    shard->next = reg->shards;
+    reg->shards = shard;
     return 0;
 }
 
-/* Send the name of the new user to the client for them to handle */
-static int deploy_logon_payload(int sock, struct user *user)
+int registry_add(struct registry *reg, struct connection *conn)
 {
-    if (send_payload_scmd(sock, broad_logon, 0 /* ignored */) < 0) {
+    assert(reg != NULL);
+
+    struct user *user = conn_get_user(conn);
+    assert(user != NULL);
+
+    uint32_t id = user_getid(user);
+    if (id >= reg->nslots)
         return -1;
-    }
 
-    char *name = user_get_uname(user);
-    if (name == NULL)
+    struct shard *shard = find_shard(reg, conn->reactor);
+    if (shard == NULL)
         return -1;
+    assert(reactor_is_current(shard->reactor));
+
+    lock_acquire(&reg->lock);
+
+    struct snapshot *old = reg->snap;
+    struct snapshot *new = NULL;
+    if (reg->slots[id] == NULL)
+        new = snapshot_copy(old, old->len + 1);
 
-    if (send_payload_sbon(sock, name) < 0) {
-        free(name);
+    if (new == NULL) {
+        lock_release(&reg->lock);
         return -1;
     }
 
-    free(name);
+    new->conns[new->len++] = conn;
+
+    // The registry's reference, see registry_rm()
+    conn_ref(conn);
+
+    __atomic_store_n(&reg->slots[id], conn, __ATOMIC_RELEASE);
+    __atomic_store_n(&reg->snap, new, __ATOMIC_RELEASE);
+    lock_release(&reg->lock);
+
+    ilist_add(&shard->conns, &conn->shard);
+
+    ebr_retire(old, free);
     return 0;
 }
+
+void registry_rm(struct registry *reg, struct connection *conn)
+{
+    assert(reg != NULL);
+
+    struct user *user = conn_get_user(conn);
+    if (user == NULL)
+        return;
+
+    uint32_t id = user_getid(user);
+    if (id >= reg->nslots)
+        return;
+
+    struct shard *shard = find_shard(reg, conn->reactor);
+    if (shard != NULL)
+        ilist_rm(&shard->conns, &conn->shard);
+
+    lock_acquire(&reg->lock);
+
+    // The user may have logged in again on another connection
+    if (reg->slots[id] != conn) {
+        lock_release(&reg->lock);
+        return;
+    }
+
+    // Without memory for a new snapshot the current one is changed in
+    // place, a reader may see a connection twice but never a stale one
+    struct snapshot *old = reg->snap;
+    struct snapshot *new = snapshot_copy(old, old->len);
+    struct snapshot *snap = (new != NULL) ? new : old;
+
+    for (uint32_t i = 0; i < snap->len; i++) {
+        if (snap->conns[i] == conn) {
+            __atomic_store_n(
+                &snap->conns[i],
+                snap->conns[snap->len - 1],
+                __ATOMIC_RELAXED
+            );
+            __atomic_store_n(&snap->len, snap->len - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+
+    __atomic_store_n(&reg->slots[id], NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&reg->snap, snap, __ATOMIC_RELEASE);
+    lock_release(&reg->lock);
+
+    if (new != NULL)
+        ebr_retire(old, free);
+
+    // Readers may still be looking at the connection, the registry's
+    // reference is only dropped once they're done
+    ebr_retire(conn, unref_task);
+}
+
+void registry_traverse
+(
+    struct registry *reg,
+    void (*func)(void *conn, void *arg),
+    void *arg
+)
+{
+    assert(reg != NULL);
+
+    ebr_enter();
+    struct snapshot *snap = __atomic_load_n(&reg->snap, __ATOMIC_ACQUIRE);
+    uint32_t len = __atomic_load_n(&snap->len, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < len; i++)
+        func(__atomic_load_n(&snap->conns[i], __ATOMIC_RELAXED), arg);
+    ebr_exit();
+}
+
+int conn_get_by_user
+(
+    struct registry *reg,
+    struct user *user,
+    struct connection **ret
+)
+{
+    assert(reg != NULL);
+    *ret = NULL;
+
+    uint32_t id = user_getid(user);
+    if (id >= reg->nslots)
+        return -1;
+
+    // The registry holds a reference until no reader can see the connection,
+    // so it's still alive while we take ours
+    ebr_enter();
+    struct connection *conn = __atomic_load_n(&reg->slots[id], __ATOMIC_ACQUIRE);
+    if (conn != NULL)
+        conn_ref(conn);
+    ebr_exit();
+
+    *ret = conn;
+    return 0;
+}
+
+int conn_get_num_blocked(struct registry *reg, struct user *user)
+{
+    int ret = 0;
+    struct tuple tuple = {
+        .items[0] = &ret,
+        .items[1] = user,
+    };
+
+    registry_traverse(reg, num_blocked_iter, &tuple);
+    return ret;
+}
+
+/* Return if the user was the block list of the conn */
+static void num_blocked_iter(void *item, void *arg)
+{
+    struct connection *conn = item;
+    struct tuple *tuple = arg;
+
+    int *ret_ptr = tuple->items[0];
+    struct user *user = tuple->items[1];
+
+    if (conn_user_blocked(conn, user) == true)
+        *ret_ptr += 1;
+}
+
+/* Return true if the user is blocked by the conn->user */
+static bool conn_user_blocked(struct connection *conn, struct user *user)
+{
+    bool ret;
+    lock_acquire(&conn->lock);
+    ret = user_on_blocklist(conn->user, user);
+    lock_release(&conn->lock);
+    return ret;
+}
+
+/* Queue the broadcast for the connection of the cast's shard if it should
+ * hear about it, must be called on the shard's reactor */
+static void deploy_frame(struct connection *conn, struct shard_cast *cast)
+{
+    struct user *user = cast->user;
+
+    lock_acquire(&conn->lock);
+    bool valid = valid_broadcast(conn, user);
+    lock_release(&conn->lock);
+
+    if (valid == false)
+        return;
+
+    // A client that can't keep up misses out (see slow_policy), it's not
+    // worth stopping the broadcast for everybody else
+    struct frame *frame = frame_ref(cast->frame);
+    conn_push(conn, push_broadcast, &frame, 1);
+}
+
+/* Return true if the "user" is valid enough to broadcast the the user on
+ * the "conn" side */
+static bool valid_broadcast(struct connection *conn, struct user *user)
+{
+    if (user_is_logged_on(conn->user) == false)
+        return false;
+
+    if (user_equal(conn->user, user) == true)
+        return false;
+
+    if (user_on_blocklist(conn->user, user) == true)
+        return false;
+
+    return true;
+}
@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "deque.h"
+#include "util.h"
+
+/* The owner moves bottom, the thieves race each other (and the owner, for
+ * the last item) to move top. Both only ever go up, so they're signed to
+ * let deque_pop() step bottom past top for a moment. They live on their own
+ * cache lines so the two sides don't slow each other down */
+struct deque {
+    _Alignas(CACHE_LINE) long top;      /* Next item to steal */
+    _Alignas(CACHE_LINE) long bottom;   /* Next slot to push to */
+    long mask;                          /* Number of slots - 1 */
+    void **slots;
+};
+
+struct deque *deque_init(size_t size)
+{
+    size_t nslots = 2;
+    while (nslots < size)
+        nslots *= 2;
+
+    struct deque *ret = aligned_alloc(CACHE_LINE, sizeof(struct deque));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct deque) {0};
+    ret->mask = nslots - 1;
+
+    ret->slots = calloc(nslots, sizeof(void *));
+    if (ret->slots == NULL) {
+        free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+void deque_free(struct deque *deque)
+{
+    if (deque == NULL)
+        return;
+
+    free(deque->slots);
+    free(deque);
+}
+
+int deque_push(struct deque *deque, void *item)
+{
+    assert(deque != NULL);
+
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (b - t > deque->mask)
+        return -1;
+
+    // The item has to be in its slot before a thief can see the new bottom
+    __atomic_store_n(&deque->slots[b & deque->mask], item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void *deque_pop(struct deque *deque)
+{
+    assert(deque != NULL);
+
+    // Claim the bottom item before looking at top, a thief that reads top
+    // after this sees the item is gone
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        // It was already empty
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&deque->slots[b & deque->mask],
+        __ATOMIC_RELAXED);
+    if (t < b)
+        return item;
+
+    // The last item, a thief may be after it too
+    if (__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) == false)
+        item = NULL;
+
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return item;
+}
+
+void *deque_steal(struct deque *deque)
+{
+    assert(deque != NULL);
+
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return NULL;
+
+    // Read before the claim, once top moves on the owner may reuse the slot
+    void *item = __atomic_load_n(&deque->slots[t & deque->mask],
+        __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) == false)
+        return NULL;
+
+    return item;
+}
+
+size_t deque_len(struct deque *deque)
+{
+    assert(deque != NULL);
+
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    // The owner's deque_pop() can have bottom one short of top
+    return (b > t) ? (size_t) (b - t) : 0;
+}
@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "ebr.h"
+#include "synch.h"
+
+/* The low bit of a thread's state is set while it's reading, the rest is the
+ * epoch it saw when it started */
+#define ACTIVE (1ul)
+
+/* Every thread that has ever read gets one of these, they're never free()'d
+ * (the threads live as long as the server) */
+struct record {
+    unsigned long state;        /* (epoch << 1) | ACTIVE */
+    int nest;                   /* Depth of ebr_enter() calls */
+    struct record *next;        /* The next thread's record */
+};
+
+/* Something waiting to be free()'d */
+struct limbo {
+    void *ptr;                  /* Passed to func */
+    void (*func)(void *);       /* Frees the ptr */
+    unsigned long epoch;        /* The epoch it was retired in */
+    struct limbo *next;         /* Retired before this one */
+};
+
+static unsigned long global_epoch = 0;
+static struct record *records = NULL;
+
+/* Everything in limbo, only touched with the limbo_lock held */
+static struct limbo *limbo = NULL;
+static struct lock limbo_lock = LOCK_INITIALIZER;
+
+static __thread struct record *self = NULL;
+
+/* Helper functions */
+static struct record *get_record(void);
+static bool try_advance(void);
+static struct limbo *take_safe(void);
+static void run_all(struct limbo *list);
+static void synchronize(void);
+
+void ebr_enter(void)
+{
+    struct record *rec = get_record();
+
+    if (rec->nest++ > 0)
+        return;
+
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&rec->state, (epoch << 1) | ACTIVE, __ATOMIC_RELAXED);
+
+    // The state must be seen by writers before we read anything shared
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void)
+{
+    struct record *rec = self;
+    assert(rec != NULL && rec->nest > 0);
+
+    if (--rec->nest > 0)
+        return;
+
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+void ebr_retire(void *ptr, void (*func)(void *))
+{
+    assert(func != NULL);
+    assert(self == NULL || self->nest == 0);
+
+    struct limbo *item = malloc(sizeof(struct limbo));
+    if (item == NULL) {
+        // Nowhere to put it, wait for the readers instead
+        synchronize();
+        func(ptr);
+        return;
+    }
+
+    item->ptr = ptr;
+    item->func = func;
+
+    lock_acquire(&limbo_lock);
+    item->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    item->next = limbo;
+    limbo = item;
+    try_advance();
+    struct limbo *safe = take_safe();
+    lock_release(&limbo_lock);
+
+    run_all(safe);
+}
+
+void ebr_collect(void)
+{
+    lock_acquire(&limbo_lock);
+    if (limbo == NULL) {
+        lock_release(&limbo_lock);
+        return;
+    }
+    try_advance();
+    struct limbo *safe = take_safe();
+    lock_release(&limbo_lock);
+
+    run_all(safe);
+}
+
+/* Return the record for this thread, it's made the first time */
+static struct record *get_record(void)
+{
+    if (self != NULL)
+        return self;
+
+    struct record *rec = calloc(1, sizeof(struct record));
+    if (rec == NULL)
+        abort();
+
+    rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+        &records,
+        &rec->next,
+        rec,
+        true,
+        __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED
+    ));
+
+    self = rec;
+    return rec;
+}
+
+/* Move on to the next epoch if every reader has seen the current one. Must
+ * hold the limbo_lock. Return true if the epoch moved on */
+static bool try_advance(void)
+{
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    struct record *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; rec != NULL; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & ACTIVE) && (state >> 1) != epoch)
+            return false;
+    }
+
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Take everything out of limbo that was retired at least two epochs ago, no
+ * reader can still see it. Must hold the limbo_lock */
+static struct limbo *take_safe(void)
+{
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    struct limbo *safe = NULL;
+    struct limbo **curr = &limbo;
+
+    while (*curr != NULL) {
+        struct limbo *item = *curr;
+        if (item->epoch + 2 <= epoch) {
+            *curr = item->next;
+            item->next = safe;
+            safe = item;
+        } else {
+            curr = &item->next;
+        }
+    }
+
+    return safe;
+}
+
+/* Free everything in the list */
+static void run_all(struct limbo *list)
+{
+    while (list != NULL) {
+        struct limbo *next = list->next;
+        list->func(list->ptr);
+        free(list);
+        list = next;
+    }
+}
+
+/* Wait until every reader active right now has finished */
+static void synchronize(void)
+{
+    lock_acquire(&limbo_lock);
+    unsigned long start = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&global_epoch, __ATOMIC_RELAXED) < start + 2) {
+        if (try_advance() == false) {
+            lock_release(&limbo_lock);
+            sched_yield();
+            lock_acquire(&limbo_lock);
+        }
+    }
+    lock_release(&limbo_lock);
+}
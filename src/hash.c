@@ -0,0 +1,245 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "hash.h"
+#include "synch.h"
+
+struct hash_node {
+    struct hash_node *next;     /* Next node in the bucket */
+    uint32_t hash;              /* Hash of the item's key */
+    void *item;                 /* The item passed to hash_add() */
+};
+
+/* The buckets are swapped for a bigger set as the table grows. Readers may
+ * still be walking the old set, so it's kept around until hash_free() */
+struct table {
+    size_t nbuckets;            /* Always a power of two */
+    struct table *retired;      /* The smaller table this one replaced */
+    struct hash_node *buckets[];
+};
+
+struct hash {
+    struct table *table;        /* Read without the lock, see hash_get() */
+    size_t len;                 /* Number of items */
+    hash_func func;             /* Hashes a key */
+    hash_cmp cmp;               /* Matches an item to a key */
+    struct lock lock;           /* Held by writers */
+};
+
+/* Helper functions */
+static struct table *table_init(size_t nbuckets);
+static void table_free(struct table *table);
+static int table_insert(struct table *table, uint32_t hash, void *item);
+static int grow(struct hash *hash);
+static void *find(struct hash *, struct table *, uint32_t, const void *);
+
+struct hash *hash_init(size_t size, hash_func func, hash_cmp cmp)
+{
+    assert(func != NULL);
+    assert(cmp != NULL);
+
+    struct hash *ret = malloc(sizeof(struct hash));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct hash) {0};
+    ret->func = func;
+    ret->cmp = cmp;
+
+    // Aim for no more than one item per bucket
+    size_t nbuckets = 16;
+    while (nbuckets < size)
+        nbuckets *= 2;
+
+    ret->table = table_init(nbuckets);
+    if (ret->table == NULL) {
+        free(ret);
+        return NULL;
+    }
+
+    if (lock_setup(&ret->lock, lock_spin) < 0) {
+        table_free(ret->table);
+        free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+void hash_free(struct hash *hash, void (*f)(void *))
+{
+    if (hash == NULL)
+        return;
+
+    struct table *table = hash->table;
+
+    if (f != NULL) {
+        for (size_t i = 0; i < table->nbuckets; i++) {
+            for (struct hash_node *n = table->buckets[i]; n; n = n->next)
+                f(n->item);
+        }
+    }
+
+    while (table != NULL) {
+        struct table *retired = table->retired;
+        table_free(table);
+        table = retired;
+    }
+
+    lock_teardown(&hash->lock);
+    free(hash);
+}
+
+int hash_add(struct hash *hash, const void *key, void *item)
+{
+    assert(hash != NULL);
+
+    uint32_t h = hash->func(key);
+    int ret = 0;
+
+    lock_acquire(&hash->lock);
+
+    if (find(hash, hash->table, h, key) != NULL) {
+        ret = 1;
+    } else if (hash->len >= hash->table->nbuckets && grow(hash) < 0) {
+        ret = -1;
+    } else if (table_insert(hash->table, h, item) < 0) {
+        ret = -1;
+    } else {
+        __atomic_store_n(&hash->len, hash->len + 1, __ATOMIC_RELAXED);
+    }
+
+    lock_release(&hash->lock);
+    return ret;
+}
+
+void *hash_get(struct hash *hash, const void *key)
+{
+    assert(hash != NULL);
+
+    struct table *table = __atomic_load_n(&hash->table, __ATOMIC_ACQUIRE);
+    return find(hash, table, hash->func(key), key);
+}
+
+size_t hash_len(struct hash *hash)
+{
+    assert(hash != NULL);
+
+    return __atomic_load_n(&hash->len, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a of the (at most max bytes long) string */
+uint32_t hash_str(const char *str, size_t max)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < max && str[i] != '\0'; i++) {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Spread the bits of n, ids are handed out in order so they'd otherwise
+ * only fill the bottom of the table */
+uint32_t hash_u32(uint32_t n)
+{
+    n ^= n >> 16;
+    n *= 0x7feb352du;
+    n ^= n >> 15;
+    n *= 0x846ca68bu;
+    n ^= n >> 16;
+    return n;
+}
+
+/* Return a table with empty buckets, NULL on error */
+static struct table *table_init(size_t nbuckets)
+{
+    struct table *ret = calloc(
+        1,
+        sizeof(struct table) + nbuckets * sizeof(struct hash_node *)
+    );
+    if (ret == NULL)
+        return NULL;
+
+    ret->nbuckets = nbuckets;
+    return ret;
+}
+
+/* Free the table and its nodes, the items are untouched */
+static void table_free(struct table *table)
+{
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        struct hash_node *node = table->buckets[i];
+        while (node != NULL) {
+            struct hash_node *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(table);
+}
+
+/* Put the item at the front of its bucket. The node is filled in before it's
+ * published so a reader never sees half a node. Return -1 on error */
+static int table_insert(struct table *table, uint32_t hash, void *item)
+{
+    struct hash_node *node = malloc(sizeof(struct hash_node));
+    if (node == NULL)
+        return -1;
+
+    size_t i = hash & (table->nbuckets - 1);
+    node->hash = hash;
+    node->item = item;
+    node->next = table->buckets[i];
+
+    __atomic_store_n(&table->buckets[i], node, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Double the number of buckets. The new table is filled in completely before
+ * it replaces the old one, so readers see one or the other. Must hold the
+ * hash's lock. Return -1 on error */
+static int grow(struct hash *hash)
+{
+    struct table *old = hash->table;
+    struct table *new = table_init(old->nbuckets * 2);
+    if (new == NULL)
+        return -1;
+
+    for (size_t i = 0; i < old->nbuckets; i++) {
+        for (struct hash_node *n = old->buckets[i]; n != NULL; n = n->next) {
+            if (table_insert(new, n->hash, n->item) < 0) {
+                table_free(new);
+                return -1;
+            }
+        }
+    }
+
+    new->retired = old;
+    __atomic_store_n(&hash->table, new, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Search the table for the item with the key, NULL if it isn't there */
+static void *find
+(
+    struct hash *hash,
+    struct table *table,
+    uint32_t h,
+    const void *key
+)
+{
+    size_t i = h & (table->nbuckets - 1);
+    struct hash_node *node = __atomic_load_n(
+        &table->buckets[i],
+        __ATOMIC_ACQUIRE
+    );
+
+    while (node != NULL) {
+        if (node->hash == h && hash->cmp(node->item, key) == 0)
+            return node->item;
+        node = node->next;
+    }
+
+    return NULL;
+}
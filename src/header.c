@@ -7,42 +7,279 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
 #include "header.h"
+#include "util.h"
+
+/* The header on the wire, the task_id and data_len in network byte order */
+#define HEADER_LEN (2 * sizeof(uint32_t))
+
+/* Payloads that encode to at most this many bytes are sent straight from the
+ * stack by send_payload(), bigger ones go through a frame */
+#define SEND_STACK_LEN (4 * 1024)
+
+/* How a field of a payload struct travels on the wire */
+enum field_type {
+    f_end = 0,                  /* No more fields */
+    f_u32,                      /* 4 bytes (e.g. an enum status_code) */
+    f_u64,                      /* 8 bytes */
+    f_u16,                      /* 2 bytes (e.g. a port) */
+    f_addr,                     /* struct in_addr, already network order */
+    f_str,                      /* 2 byte length then that many chars */
+    f_strs,                     /* 4 byte count then that many f_str's */
+    f_opt_u32,                  /* An f_u32 added to the payload later on,
+                                 * left as 0 if an older peer leaves it off */
+};
+
+struct field {
+    enum field_type type;       /* How to encode the field */
+    size_t offset;              /* Where the field is in the struct */
+    size_t size;                /* For f_str(s) the size of (each) buffer */
+    size_t count;               /* For f_strs where the uint32_t count is */
+    size_t max;                 /* For f_strs the number of buffers */
+};
+
+/* The most fields any payload has (cic and ssp) */
+#define CODEC_FIELDS (3)
+
+/* How to encode/decode the payload struct for a task_id */
+struct codec {
+    size_t size;                /* sizeof() the payload struct */
+    struct field fields[CODEC_FIELDS + 1]; /* The fields in order, ends
+                                            * with f_end */
+};
+
+#define FIELD(TYPE,T,F) { TYPE, offsetof(struct T ## _payload, F), \
+    sizeof(((struct T ## _payload *) NULL)->F) }
+#define U32(T,F) FIELD(f_u32, T, F)
+#define OPT_U32(T,F) FIELD(f_opt_u32, T, F)
+#define U64(T,F) FIELD(f_u64, T, F)
+#define U16(T,F) FIELD(f_u16, T, F)
+#define ADDR(T,F) FIELD(f_addr, T, F)
+#define STRING(T,F) FIELD(f_str, T, F)
+#define STRINGS(T,N,F) { f_strs, offsetof(struct T ## _payload, F),        \
+    sizeof(((struct T ## _payload *) NULL)->F[0]),                          \
+    offsetof(struct T ## _payload, N),                                      \
+    ARRSIZE(((struct T ## _payload *) NULL)->F) }
+/* The f_end always goes in the last slot. A codec with more than
+ * CODEC_FIELDS fields would overwrite it (or not fit at all), either of
+ * which fails the build */
+#define CODEC(T,...) { sizeof(struct T ## _payload),                      \
+    { [CODEC_FIELDS] = { f_end } __VA_OPT__(, [0] =) __VA_ARGS__ } }
+
+_Static_assert(sizeof(enum status_code) == sizeof(uint32_t),
+    "f_u32 is used for enum status_code");
+
+/* The payloads with a "dummy_" don't send anything at all */
+static const struct codec codecs[] = {
+    [client_init_conn]     = CODEC(cic,
+        U32(cic, code), U32(cic, version), OPT_U32(cic, flags)),
+    [server_init_conn]     = CODEC(sic, U32(sic, code)),
+    [client_uname_auth]    = CODEC(cua, STRING(cua, username)),
+    [server_uname_auth]    = CODEC(sua, U32(sua, code)),
+    [client_pword_auth]    = CODEC(cpa, STRING(cpa, password)),
+    [server_pword_auth]    = CODEC(spa, U32(spa, code)),
+    [client_command]       = CODEC(ccmd, STRING(ccmd, cmd)),
+    [server_command]       = CODEC(scmd, U32(scmd, code), U64(scmd, extra)),
+    [client_whoelse]       = CODEC(cw),
+    [server_whoelse]       = CODEC(sw, STRING(sw, username)),
+    [client_whoelse_since] = CODEC(cws),
+    [server_whoelse_since] = CODEC(sws, STRING(sws, username)),
+    [client_broad_logon]   = CODEC(cbon),
+    [server_broad_logon]   = CODEC(sbon, STRING(sbon, username)),
+    [client_broad_msg]     = CODEC(cbm),
+    [server_broad_msg]     = CODEC(sbm, STRING(sbm, msg)),
+    [client_block_user]    = CODEC(cbu),
+    [server_block_user]    = CODEC(sbu, U32(sbu, code)),
+    [client_dm_response]   = CODEC(cdmr),
+    [server_dm_response]   = CODEC(sdmr, U32(sdmr, code)),
+    [client_dm_msg]        = CODEC(cdmm),
+    [server_dm_msg]        = CODEC(sdmm, STRING(sdmm, sender), STRING(sdmm, msg)),
+    [client_unblock_user]  = CODEC(cuu),
+    [server_unblock_user]  = CODEC(suu, U32(suu, code)),
+    [client_broad_logoff]  = CODEC(cbof),
+    [server_broad_logoff]  = CODEC(sbof, STRING(sbof, name)),
+    [client_start_private] = CODEC(csp),
+    [server_start_private] = CODEC(ssp,
+        U32(ssp, code), U16(ssp, port), ADDR(ssp, addr)),
+    [ptop_command]         = CODEC(pcmd, STRING(pcmd, cmd)),
+    [ptop_init_conn]       = CODEC(pic, U16(pic, port), ADDR(pic, addr)),
+    [ptop_handshake]       = CODEC(phs, STRING(phs, name)),
+    [server_name_list]     = CODEC(snl, U32(snl, more), STRINGS(snl, len, names)),
+    [client_request]       = CODEC(creq, U32(creq, id), STRING(creq, cmd)),
+    [server_tagged]        = CODEC(stag, U32(stag, reply_to), U32(stag, len)),
+};
 
 /* Helper functions */
+static int reserve(struct decoder *decoder, size_t len);
 static int recv_payload(int, enum task_id, void *, uint32_t);
+static int recv_all(int sock, char *buf, uint32_t len);
+static int send_iov(int sock, struct iovec *iov, int iovcnt);
+static int read_header(const char *, struct header *, const struct codec **);
+static int unpack(const struct codec *, const char *, struct header *, void **);
+static const struct codec *get_codec(enum task_id task_id);
+static uint32_t encoded_len(const struct codec *codec, const char *payload);
+static uint32_t max_encoded_len(const struct codec *codec);
+static void encode(const struct codec *codec, const char *payload, char *buf);
+static int decode(const struct codec *, const char *buf, uint32_t, char *);
+static uint32_t strs_count(const struct field *f, const char *payload);
+static char *put_str(char *buf, const char *src, size_t size);
+static const char *get_str(const char *, const char *, char *, size_t);
+static void put_u32(char *buf, uint32_t n);
+static uint32_t get_u32(const char *buf);
+static struct frame *page_init(uint32_t len);
+static struct frame *page_fit(struct frame *page, char **end, const char *name);
+static struct frame *page_close(struct frame *page, char *end, uint32_t n, bool more);
+
+/* Where the names start in a server_name_list frame, after the header, the
+ * "more" flag and the count */
+#define PAGE_NAMES (HEADER_LEN + 2 * sizeof(uint32_t))
+
+/* How big a name_list page starts out, it's doubled as names are added (see
+ * page_fit()) */
+#define PAGE_START (PAGE_NAMES + 256)
+
+/* A list of names as it's packed, see name_list_init() */
+struct name_list {
+    uint32_t len;               /* Names added so far */
+    struct frame **pages;       /* LIST_PAGES(len) pages, the last is still
+                                 * being filled in */
+    char *end;                  /* Where the next name goes in that page */
+};
+
+/* Bytes that have been received but not handed out as payloads yet. The
+ * bytes waiting are buf[start] to buf[end] */
+struct decoder {
+    char *buf;                  /* NULL while nothing is buffered */
+    size_t cap;                 /* Size of buf */
+    size_t start;               /* First byte not decoded yet */
+    size_t end;                 /* One past the last byte received */
+};
 
 int get_payload(int sock, struct header *h, void **p)
 {
+    char raw[HEADER_LEN];
+    const struct codec *codec;
     struct header head = {0};
-    void *payload;
+    char *buf;
+    int ret;
 
-    if (recv(sock, &head, sizeof(struct header), 0) != sizeof(struct header)) {
-        return -errno;
-    }
+    ret = recv_all(sock, raw, sizeof(raw));
+    if (ret < 0)
+        return ret;
+
+    ret = read_header(raw, &head, &codec);
+    if (ret < 0)
+        return ret;
+
+    buf = malloc(head.data_len + 1);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    ret = recv_all(sock, buf, head.data_len);
+    if (ret == 0)
+        ret = unpack(codec, buf, &head, p);
+
+    free(buf);
+
+    if (ret < 0)
+        return ret;
+
+    *h = head;
+    return 0;
+}
+
+struct decoder *decoder_init(void)
+{
+    struct decoder *ret = malloc(sizeof(struct decoder));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct decoder) {0};
+    return ret;
+}
+
+void decoder_free(struct decoder *decoder)
+{
+    if (decoder == NULL)
+        return;
+
+    free(decoder->buf);
+    free(decoder);
+}
+
+ssize_t decoder_recv(struct decoder *decoder, int sock)
+{
+    assert(decoder != NULL);
+
+    if (reserve(decoder, DECODER_CHUNK) < 0)
+        return -1;
+
+    ssize_t ret = recv(
+        sock,
+        decoder->buf + decoder->end,
+        decoder->cap - decoder->end,
+        MSG_DONTWAIT
+    );
+
+    if (ret > 0)
+        decoder->end += ret;
+
+    return ret;
+}
+
+int decoder_feed(struct decoder *decoder, const void *data, size_t len)
+{
+    assert(decoder != NULL);
+
+    if (reserve(decoder, len) < 0)
+        return -1;
 
-    if (head.data_len == 0) {
-        *p = NULL;
-        *h = head;
+    memcpy(decoder->buf + decoder->end, data, len);
+    decoder->end += len;
+    return 0;
+}
+
+int decoder_next(struct decoder *decoder, struct header *h, void **p)
+{
+    assert(decoder != NULL);
+
+    const struct codec *codec;
+    struct header head = {0};
+    size_t len = decoder->end - decoder->start;
+    const char *raw = decoder->buf + decoder->start;
+    int ret;
+
+    if (len < HEADER_LEN) {
+        // An idle connection doesn't need to hold on to a buffer
+        if (len == 0) {
+            free(decoder->buf);
+            *decoder = (struct decoder) {0};
+        }
         return 0;
     }
 
-    payload = malloc(head.data_len);
-    if (payload == NULL) {
+    if (read_header(raw, &head, &codec) < 0)
         return -1;
-    }
 
-    if (recv(sock, payload, head.data_len, 0) != head.data_len) {
-        free (payload);
-        return -errno;
-    }
+    // Only part of the frame has arrived, wait for the rest
+    uint32_t wire_len = head.data_len;
+    if (len - HEADER_LEN < wire_len)
+        return 0;
 
-    *p = payload;
+    ret = unpack(codec, raw + HEADER_LEN, &head, p);
+    if (ret < 0)
+        return -1;
+
+    decoder->start += HEADER_LEN + wire_len;
     *h = head;
-    return 0;
+    return 1;
 }
 
 int send_payload(
@@ -52,30 +289,124 @@ int send_payload(
     void *payload
 )
 {
-    struct header h = {
-        .task_id = task_id,
-        .data_len = len,
+    const struct codec *codec = get_codec(task_id);
+    if (codec == NULL || len != codec->size)
+        return -1;
+
+    uint32_t data_len = encoded_len(codec, payload);
+
+    // Nothing sent by the client or server comes close, but just in case
+    if (data_len > SEND_STACK_LEN)
+        return send_frame(sock, pack_payload(task_id, len, payload));
+
+    char head[HEADER_LEN];
+    char body[SEND_STACK_LEN];
+
+    put_u32(&head[0], task_id);
+    put_u32(&head[sizeof(uint32_t)], data_len);
+    encode(codec, payload, body);
+
+    struct iovec iov[] = {
+        { .iov_base = head, .iov_len = sizeof(head) },
+        { .iov_base = body, .iov_len = data_len },
     };
 
-    uint32_t total_len = sizeof(struct header) + len;
+    return send_iov(sock, iov, ARRSIZE(iov));
+}
 
-    char *total_payload = malloc(total_len);
-    if (!total_payload)
-        return -1;
+struct frame *pack_payload(enum task_id task_id, uint32_t len, void *payload)
+{
+    const struct codec *codec = get_codec(task_id);
+    if (codec == NULL || len != codec->size)
+        return NULL;
+
+    uint32_t data_len = encoded_len(codec, payload);
+
+    struct frame *frame = malloc(sizeof(struct frame) + HEADER_LEN + data_len);
+    if (frame == NULL)
+        return NULL;
 
     // It's important to send the header and payload at the same time just in
     // case two or more payloads are sent at the same time.
-    memcpy(total_payload, &h, sizeof(h));
-    memcpy(&total_payload[sizeof(h)], payload, len);
+    frame->refs = 1;
+    frame->len = HEADER_LEN + data_len;
+    put_u32(&frame->data[0], task_id);
+    put_u32(&frame->data[sizeof(uint32_t)], data_len);
+    encode(codec, payload, &frame->data[HEADER_LEN]);
 
-    if (send(sock, total_payload, total_len, 0) != total_len) {
-        free (total_payload);
-        return -1;
+    return frame;
+}
+
+struct frame *frame_alloc(uint32_t len)
+{
+    struct frame *ret = malloc(sizeof(struct frame) + len);
+    if (ret == NULL)
+        return NULL;
+
+    ret->refs = 1;
+    ret->len = len;
+    return ret;
+}
+
+struct frame *frame_join(struct frame **frames, int nframes)
+{
+    struct frame *ret = NULL;
+    uint32_t len = 0;
+    int i;
+
+    for (i = 0; i < nframes; i++) {
+        if (frames[i] == NULL)
+            goto frame_join_out;
+        len += frames[i]->len;
     }
 
-    free (total_payload);
-    return 0;
+    ret = malloc(sizeof(struct frame) + len);
+    if (ret == NULL)
+        goto frame_join_out;
+
+    ret->refs = 1;
+    ret->len = 0;
+    for (i = 0; i < nframes; i++) {
+        memcpy(&ret->data[ret->len], frames[i]->data, frames[i]->len);
+        ret->len += frames[i]->len;
+    }
+
+frame_join_out:
+    for (i = 0; i < nframes; i++)
+        frame_free(frames[i]);
+    return ret;
+}
+
+struct frame *frame_ref(struct frame *frame)
+{
+    if (frame != NULL)
+        __atomic_fetch_add(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void frame_free(struct frame *frame)
+{
+    if (frame == NULL)
+        return;
+
+    // Whoever drops the last reference is the only one left using it
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(frame);
+}
 
+int send_frame(int sock, struct frame *frame)
+{
+    if (frame == NULL)
+        return -1;
+
+    struct iovec iov = {
+        .iov_base = frame->data,
+        .iov_len = frame->len,
+    };
+
+    int ret = send_iov(sock, &iov, 1);
+    frame_free(frame);
+    return ret;
 }
 
 const char *id_to_str(enum task_id id)
@@ -112,10 +443,406 @@ const char *id_to_str(enum task_id id)
         case ptop_command:         return "ptop_command";
         case ptop_init_conn:       return "ptop_init_conn";
         case ptop_handshake:       return "ptop_handshake";
+        case server_name_list:     return "server_name_list";
+        case client_request:       return "client_request";
+        case server_tagged:        return "server_tagged";
         default:                   return "{Invalid task_id}";
     }
 }
 
+/* Return how the payload for the task_id is encoded, NULL if the task_id
+ * isn't valid */
+static const struct codec *get_codec(enum task_id task_id)
+{
+    if ((unsigned int) task_id >= ARRSIZE(codecs))
+        return NULL;
+
+    if (codecs[task_id].size == 0)
+        return NULL;
+
+    return &codecs[task_id];
+}
+
+/* Return the number of bytes the payload takes up on the wire */
+static uint32_t encoded_len(const struct codec *codec, const char *payload)
+{
+    uint32_t ret = 0;
+
+    for (const struct field *f = codec->fields; f->type != f_end; f++) {
+        switch (f->type) {
+            case f_u32:
+            case f_opt_u32: ret += sizeof(uint32_t); break;
+            case f_u64:  ret += sizeof(uint64_t); break;
+            case f_u16:  ret += sizeof(uint16_t); break;
+            case f_addr: ret += sizeof(uint32_t); break;
+            case f_str:
+                ret += sizeof(uint16_t);
+                ret += strnlen(&payload[f->offset], f->size - 1);
+                break;
+            case f_strs:
+                ret += sizeof(uint32_t);
+                for (uint32_t i = 0; i < strs_count(f, payload); i++) {
+                    const char *str = &payload[f->offset + i * f->size];
+                    ret += sizeof(uint16_t) + strnlen(str, f->size - 1);
+                }
+                break;
+            case f_end:
+                break;
+        }
+    }
+
+    return ret;
+}
+
+/* Return the most bytes any payload for the codec can take up on the wire */
+static uint32_t max_encoded_len(const struct codec *codec)
+{
+    uint32_t ret = 0;
+
+    for (const struct field *f = codec->fields; f->type != f_end; f++) {
+        switch (f->type) {
+            case f_u32:
+            case f_opt_u32: ret += sizeof(uint32_t); break;
+            case f_u64:  ret += sizeof(uint64_t); break;
+            case f_u16:  ret += sizeof(uint16_t); break;
+            case f_addr: ret += sizeof(uint32_t); break;
+            case f_str:  ret += sizeof(uint16_t) + f->size - 1; break;
+            case f_strs:
+                ret += sizeof(uint32_t);
+                ret += f->max * (sizeof(uint16_t) + f->size - 1);
+                break;
+            case f_end:  break;
+        }
+    }
+
+    return ret;
+}
+
+/* Write the payload to the buf in its wire format, the buf must have room
+ * for encoded_len() bytes */
+static void encode(const struct codec *codec, const char *payload, char *buf)
+{
+    for (const struct field *f = codec->fields; f->type != f_end; f++) {
+        const char *src = &payload[f->offset];
+        uint32_t u32;
+        uint64_t u64;
+        uint16_t u16;
+
+        switch (f->type) {
+            case f_u32:
+            case f_opt_u32:
+                memcpy(&u32, src, sizeof(u32));
+                put_u32(buf, u32);
+                buf += sizeof(u32);
+                break;
+
+            case f_u64:
+                memcpy(&u64, src, sizeof(u64));
+                put_u32(buf, u64 >> 32);
+                put_u32(buf + sizeof(uint32_t), u64);
+                buf += sizeof(u64);
+                break;
+
+            case f_u16:
+                memcpy(&u16, src, sizeof(u16));
+                u16 = htons(u16);
+                memcpy(buf, &u16, sizeof(u16));
+                buf += sizeof(u16);
+                break;
+
+            case f_addr:
+                memcpy(buf, src, sizeof(uint32_t));
+                buf += sizeof(uint32_t);
+                break;
+
+            case f_str:
+                buf = put_str(buf, src, f->size);
+                break;
+
+            case f_strs:
+                u32 = strs_count(f, payload);
+                put_u32(buf, u32);
+                buf += sizeof(u32);
+                for (uint32_t i = 0; i < u32; i++)
+                    buf = put_str(buf, &src[i * f->size], f->size);
+                break;
+
+            case f_end:
+                break;
+        }
+    }
+}
+
+/* Read the wire format in buf (len bytes) into the payload, which must be
+ * zero'd. Strings are always nul terminated. Return -1 if the buf isn't a
+ * valid payload for the codec */
+static int decode
+(
+    const struct codec *codec,
+    const char *buf,
+    uint32_t len,
+    char *payload
+)
+{
+    const char *end = buf + len;
+
+    for (const struct field *f = codec->fields; f->type != f_end; f++) {
+        char *dst = &payload[f->offset];
+        uint64_t u64;
+        uint32_t u32;
+        uint16_t u16;
+
+        switch (f->type) {
+            case f_opt_u32:
+                // The payload is zero'd already
+                if (buf == end)
+                    break;
+                // fall through
+
+            case f_u32:
+                if (end - buf < (ssize_t) sizeof(u32))
+                    return -1;
+                u32 = get_u32(buf);
+                memcpy(dst, &u32, sizeof(u32));
+                buf += sizeof(u32);
+                break;
+
+            case f_u64:
+                if (end - buf < (ssize_t) sizeof(u64))
+                    return -1;
+                u64 = ((uint64_t) get_u32(buf) << 32)
+                    | get_u32(buf + sizeof(uint32_t));
+                memcpy(dst, &u64, sizeof(u64));
+                buf += sizeof(u64);
+                break;
+
+            case f_u16:
+                if (end - buf < (ssize_t) sizeof(u16))
+                    return -1;
+                memcpy(&u16, buf, sizeof(u16));
+                u16 = ntohs(u16);
+                memcpy(dst, &u16, sizeof(u16));
+                buf += sizeof(u16);
+                break;
+
+            case f_addr:
+                if (end - buf < (ssize_t) sizeof(uint32_t))
+                    return -1;
+                memcpy(dst, buf, sizeof(uint32_t));
+                buf += sizeof(uint32_t);
+                break;
+
+            case f_str:
+                buf = get_str(buf, end, dst, f->size);
+                if (buf == NULL)
+                    return -1;
+                break;
+
+            case f_strs:
+                if (end - buf < (ssize_t) sizeof(u32))
+                    return -1;
+                u32 = get_u32(buf);
+                buf += sizeof(u32);
+                if (u32 > f->max)
+                    return -1;
+                memcpy(&payload[f->count], &u32, sizeof(u32));
+                for (uint32_t i = 0; i < u32 && buf != NULL; i++)
+                    buf = get_str(buf, end, &dst[i * f->size], f->size);
+                if (buf == NULL)
+                    return -1;
+                break;
+
+            case f_end:
+                break;
+        }
+    }
+
+    // Trailing garbage means the sender has a different idea of the payload
+    return (buf == end) ? 0 : -1;
+}
+
+/* Make room for "len" more bytes after decoder->end. The undecoded bytes are
+ * moved to the front first so the buffer only grows for a frame that really
+ * is that big. Return -1 on error */
+static int reserve(struct decoder *decoder, size_t len)
+{
+    if (decoder->cap - decoder->end < len) {
+        size_t used = decoder->end - decoder->start;
+        memmove(decoder->buf, decoder->buf + decoder->start, used);
+        decoder->start = 0;
+        decoder->end = used;
+    }
+
+    if (decoder->cap - decoder->end < len) {
+        size_t grow = (len > DECODER_CHUNK) ? len : DECODER_CHUNK;
+        size_t cap = decoder->end + grow;
+        char *buf = realloc(decoder->buf, cap);
+        if (buf == NULL)
+            return -1;
+        decoder->buf = buf;
+        decoder->cap = cap;
+    }
+
+    return 0;
+}
+
+/* Keep reading from the (blocking) socket until all len bytes have arrived,
+ * however the sender's writes were split up on the way. Return 0 on
+ * success, otherwise -errno (-EPIPE if the socket was closed) */
+static int recv_all(int sock, char *buf, uint32_t len)
+{
+    while (len > 0) {
+        ssize_t ret = recv(sock, buf, len, 0);
+        if (ret == 0)
+            return -EPIPE;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -errno;
+
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Write all of the buffers to the (blocking) socket with as few syscalls as
+ * possible, picking up where a short write left off. The iov is changed.
+ * Return -1 on error */
+static int send_iov(int sock, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+
+        // Skip over what was written
+        while (msg.msg_iovlen > 0 && (size_t) ret >= msg.msg_iov->iov_len) {
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Read the header from its wire format, the codec for the task_id is
+ * returned by reference. Return -EPROTO if it isn't a valid header */
+static int read_header
+(
+    const char *raw,
+    struct header *head,
+    const struct codec **codec
+)
+{
+    head->task_id = get_u32(&raw[0]);
+    head->data_len = get_u32(&raw[sizeof(uint32_t)]);
+
+    *codec = get_codec(head->task_id);
+    if (*codec == NULL || head->data_len > max_encoded_len(*codec))
+        return -EPROTO;
+
+    return 0;
+}
+
+/* Decode head->data_len bytes of buf into a malloc'd payload struct. The
+ * head->data_len is then the size of the struct. Return -errno on error */
+static int unpack
+(
+    const struct codec *codec,
+    const char *buf,
+    struct header *head,
+    void **p
+)
+{
+    void *payload = calloc(1, codec->size);
+    if (payload == NULL)
+        return -ENOMEM;
+
+    if (decode(codec, buf, head->data_len, payload) < 0) {
+        free(payload);
+        return -EPROTO;
+    }
+
+    // From here on the caller deals with the struct, not the wire
+    head->data_len = codec->size;
+
+    *p = payload;
+    return 0;
+}
+
+/* Return how many of the f_strs field's strings are in use, never more than
+ * there is room for */
+static uint32_t strs_count(const struct field *f, const char *payload)
+{
+    uint32_t ret;
+    memcpy(&ret, &payload[f->count], sizeof(ret));
+    return (ret < f->max) ? ret : f->max;
+}
+
+/* Write the string (from a buffer of "size" bytes) to the buf in its wire
+ * format. Return the end of what was written */
+static char *put_str(char *buf, const char *src, size_t size)
+{
+    uint16_t len = strnlen(src, size - 1);
+    memcpy(buf, &(uint16_t) {htons(len)}, sizeof(len));
+    memcpy(buf + sizeof(len), src, len);
+    return buf + sizeof(len) + len;
+}
+
+/* Read a string in its wire format from the buf (which ends at "end") into
+ * the dst of "size" bytes. Return the end of what was read, NULL if it isn't
+ * a valid string */
+static const char *get_str
+(
+    const char *buf,
+    const char *end,
+    char *dst,
+    size_t size
+)
+{
+    uint16_t len;
+
+    if (end - buf < (ssize_t) sizeof(len))
+        return NULL;
+    memcpy(&len, buf, sizeof(len));
+    len = ntohs(len);
+    buf += sizeof(len);
+
+    if (len > size - 1 || end - buf < len)
+        return NULL;
+    memcpy(dst, buf, len);
+    return buf + len;
+}
+
+/* Write "n" to the buf in network byte order */
+static void put_u32(char *buf, uint32_t n)
+{
+    n = htonl(n);
+    memcpy(buf, &n, sizeof(n));
+}
+
+/* Read a uint32_t in network byte order from the buf */
+static uint32_t get_u32(const char *buf)
+{
+    uint32_t n;
+    memcpy(&n, buf, sizeof(n));
+    return ntohl(n);
+}
+
 /* Helper function for all of the recv_* functions */
 static int recv_payload
 (
@@ -126,15 +853,16 @@ static int recv_payload
 )
 {
     struct header head = {0};
-    if (recv(sock, &head, sizeof(head), 0) != sizeof(head))
+    void *p = NULL;
+
+    if (get_payload(sock, &head, &p) < 0)
         return -1;
 
     assert(head.task_id == task_id);
     assert(head.data_len == size);
 
-    if (recv(sock, payload, head.data_len, 0) != head.data_len)
-        return -1;
-
+    memcpy(payload, p, size);
+    free(p);
     return 0;
 }
 
@@ -181,9 +909,23 @@ MAKE_RECV(server_start_private, ssp)
 MAKE_RECV(ptop_command, pcmd)
 MAKE_RECV(ptop_init_conn, pic)
 MAKE_RECV(ptop_handshake, phs)
+MAKE_RECV(server_name_list, snl)
+MAKE_RECV(server_tagged, stag)
 
 /* Simplify the send process for dummy structs */
 #define MAKE_SEND_DUMMY(HEAD,TYPE)          \
+struct frame *pack_payload_ ## TYPE (void)  \
+{                                           \
+    struct TYPE ## _payload TYPE = {0};     \
+    TYPE.dummy_ = '\0';                     \
+                                            \
+    return pack_payload(                    \
+        HEAD,                               \
+        sizeof(struct TYPE ## _payload),    \
+        (void **) & TYPE                    \
+    );                                      \
+}                                           \
+                                            \
 int send_payload_ ## TYPE (int sock)        \
 {                                           \
     struct TYPE ## _payload TYPE = {0};     \
@@ -209,6 +951,18 @@ MAKE_SEND_DUMMY(client_start_private, csp)
 
 /* Simplify the send process for structs with code_status's */
 #define MAKE_SEND_CODE(HEAD,TYPE)                           \
+struct frame *pack_payload_ ## TYPE (enum status_code code) \
+{                                                           \
+    struct TYPE ## _payload TYPE = {0};                     \
+    TYPE.code = code;                                       \
+                                                            \
+    return pack_payload(                                    \
+        HEAD,                                               \
+        sizeof(struct TYPE ## _payload),                    \
+        (void **) & TYPE                                    \
+    );                                                      \
+}                                                           \
+                                                            \
 int send_payload_ ## TYPE (int sock, enum status_code code) \
 {                                                           \
     struct TYPE ## _payload TYPE = {0};                     \
@@ -223,7 +977,6 @@ int send_payload_ ## TYPE (int sock, enum status_code code) \
 }
 MAKE_SEND_CODE(server_block_user, sbu)
 MAKE_SEND_CODE(server_init_conn, sic)
-MAKE_SEND_CODE(client_init_conn, cic)
 MAKE_SEND_CODE(server_uname_auth, sua)
 MAKE_SEND_CODE(server_pword_auth, spa)
 MAKE_SEND_CODE(server_dm_response, sdmr)
@@ -231,6 +984,18 @@ MAKE_SEND_CODE(server_unblock_user, suu)
 
 /* Simplify the send process for structs with buffers */
 #define MAKE_SEND_BUFF(HEAD,TYPE,BUFF_NAME,BUFF_SIZE)           \
+struct frame *pack_payload_ ## TYPE (const char BUFF_NAME[BUFF_SIZE]) \
+{                                                               \
+    struct TYPE ## _payload TYPE = {0};                         \
+    memcpy(TYPE . BUFF_NAME, BUFF_NAME, BUFF_SIZE);             \
+                                                                \
+    return pack_payload(                                        \
+        HEAD,                                                   \
+        sizeof(struct TYPE ## _payload),                        \
+        (void **) & TYPE                                        \
+    );                                                          \
+}                                                               \
+                                                                \
 int send_payload_ ## TYPE (int sock, const char BUFF_NAME[BUFF_SIZE]) \
 {                                                               \
     struct TYPE ## _payload TYPE = {0};                         \
@@ -254,6 +1019,52 @@ MAKE_SEND_BUFF(server_broad_logoff, sbof, name, MAX_UNAME)
 MAKE_SEND_BUFF(ptop_command, pcmd, cmd, MAX_MSG_LENGTH)
 MAKE_SEND_BUFF(ptop_handshake, phs, name, MAX_UNAME)
 
+struct frame *pack_payload_cic(enum status_code code, uint32_t flags)
+{
+    struct cic_payload cic = {0};
+    cic.code = code;
+    cic.version = PROTOCOL_VERSION;
+    cic.flags = flags;
+
+    return pack_payload(
+        client_init_conn,
+        sizeof(cic),
+        (void **) &cic
+    );
+}
+
+int send_payload_cic(int sock, enum status_code code, uint32_t flags)
+{
+    struct cic_payload cic = {0};
+    cic.code = code;
+    cic.version = PROTOCOL_VERSION;
+    cic.flags = flags;
+
+    return send_payload(
+        sock,
+        client_init_conn,
+        sizeof(cic),
+        (void **) &cic
+    );
+}
+
+struct frame *pack_payload_sdmm
+(
+    const char sender[MAX_UNAME],
+    const char msg[MAX_MSG_LENGTH]
+)
+{
+    struct sdmm_payload sdmm = {0};
+    memcpy(sdmm.sender, sender, MAX_UNAME);
+    memcpy(sdmm.msg, msg, MAX_MSG_LENGTH);
+
+    return pack_payload(
+        server_dm_msg,
+        sizeof(struct sdmm_payload),
+        (void **) &sdmm
+    );
+}
+
 int send_payload_sdmm
 (
     int sock,
@@ -273,6 +1084,19 @@ int send_payload_sdmm
     );
 }
 
+struct frame *pack_payload_scmd(enum status_code code, uint64_t extra)
+{
+    struct scmd_payload scmd = {0};
+    scmd.code = code;
+    scmd.extra = extra;
+
+    return pack_payload(
+        server_command,
+        sizeof(scmd),
+        (void **) &scmd
+    );
+}
+
 int send_payload_scmd(int sock, enum status_code code, uint64_t extra)
 {
     struct scmd_payload scmd = {0};
@@ -287,6 +1111,25 @@ int send_payload_scmd(int sock, enum status_code code, uint64_t extra)
     );
 }
 
+struct frame *pack_payload_ssp
+(
+    enum status_code code,
+    unsigned short port,
+    struct in_addr addr
+)
+{
+    struct ssp_payload ssp = {0};
+    ssp.port = port;
+    ssp.addr = addr;
+    ssp.code = code;
+
+    return pack_payload(
+        server_start_private,
+        sizeof(ssp),
+        (void **) &ssp
+    );
+}
+
 int send_payload_ssp
 (
     int sock,
@@ -323,3 +1166,218 @@ int send_pic_payload(int sock, unsigned short port, struct in_addr addr)
 
     return 0;
 }
+
+struct frame *pack_payload_snl(const char *const names[], uint32_t len, bool more)
+{
+    assert(len <= LIST_PAGE);
+
+    // All the names are known, so the page is only as big as they need
+    uint32_t size = PAGE_NAMES;
+    for (uint32_t i = 0; i < len; i++)
+        size += sizeof(uint16_t) + strnlen(names[i], MAX_UNAME - 1);
+
+    struct frame *page = page_init(size);
+    if (page == NULL)
+        return NULL;
+
+    char *end = &page->data[PAGE_NAMES];
+    for (uint32_t i = 0; i < len; i++)
+        end = put_str(end, names[i], MAX_UNAME);
+
+    return page_close(page, end, len, more);
+}
+
+int send_payload_creq(int sock, uint32_t id, const char cmd[MAX_MSG_LENGTH])
+{
+    struct creq_payload creq = {0};
+    creq.id = id;
+    memcpy(creq.cmd, cmd, MAX_MSG_LENGTH);
+
+    return send_payload(
+        sock,
+        client_request,
+        sizeof(creq),
+        (void **) &creq
+    );
+}
+
+struct frame *pack_payload_stag(uint32_t reply_to, uint32_t len)
+{
+    struct stag_payload stag = {0};
+    stag.reply_to = reply_to;
+    stag.len = len;
+
+    return pack_payload(
+        server_tagged,
+        sizeof(stag),
+        (void **) &stag
+    );
+}
+
+int pack_name_list(const char *const names[], uint32_t len, struct frame **pages)
+{
+    struct name_list *list = name_list_init();
+    if (list == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (name_list_add(list, names[i]) < 0) {
+            name_list_free(list);
+            return -1;
+        }
+    }
+
+    name_list_finish(list, pages);
+    return 0;
+}
+
+struct name_list *name_list_init(void)
+{
+    struct name_list *ret = malloc(sizeof(struct name_list));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct name_list) {0};
+
+    // There's always a page, even if it ends up empty
+    ret->pages = malloc(sizeof(struct frame *));
+    if (ret->pages == NULL) {
+        free(ret);
+        return NULL;
+    }
+
+    ret->pages[0] = page_init(PAGE_START);
+    if (ret->pages[0] == NULL) {
+        free(ret->pages);
+        free(ret);
+        return NULL;
+    }
+
+    ret->end = &ret->pages[0]->data[PAGE_NAMES];
+    return ret;
+}
+
+int name_list_add(struct name_list *list, const char *name)
+{
+    assert(list != NULL);
+
+    uint32_t last = LIST_PAGES(list->len) - 1;
+
+    // The last page is full, so it's finished and another one started
+    if (list->len > 0 && list->len % LIST_PAGE == 0) {
+        struct frame **pages = realloc(
+            list->pages,
+            sizeof(struct frame *) * (last + 2)
+        );
+        if (pages == NULL)
+            return -1;
+        list->pages = pages;
+
+        struct frame *page = page_init(PAGE_START);
+        if (page == NULL)
+            return -1;
+
+        pages[last] = page_close(pages[last], list->end, LIST_PAGE, true);
+        pages[last + 1] = page;
+        list->end = &page->data[PAGE_NAMES];
+        last += 1;
+    }
+
+    struct frame *page = page_fit(list->pages[last], &list->end, name);
+    if (page == NULL)
+        return -1;
+    list->pages[last] = page;
+
+    list->end = put_str(list->end, name, MAX_UNAME);
+    list->len += 1;
+    return 0;
+}
+
+uint32_t name_list_len(struct name_list *list)
+{
+    assert(list != NULL);
+    return list->len;
+}
+
+void name_list_finish(struct name_list *list, struct frame **pages)
+{
+    assert(list != NULL);
+
+    uint32_t last = LIST_PAGES(list->len) - 1;
+    uint32_t n = list->len - last * LIST_PAGE;
+
+    list->pages[last] = page_close(list->pages[last], list->end, n, false);
+    memcpy(pages, list->pages, sizeof(struct frame *) * (last + 1));
+
+    free(list->pages);
+    free(list);
+}
+
+void name_list_free(struct name_list *list)
+{
+    if (list == NULL)
+        return;
+
+    for (uint32_t i = 0; i < LIST_PAGES(list->len); i++)
+        frame_free(list->pages[i]);
+
+    free(list->pages);
+    free(list);
+}
+
+/* Return a server_name_list frame of "len" bytes, for the names to be
+ * written straight into (see page_close()). Until it's closed page->len is
+ * the room there is rather than what's been used. Return NULL on error */
+static struct frame *page_init(uint32_t len)
+{
+    struct frame *page = frame_alloc(len);
+    if (page == NULL)
+        return NULL;
+
+    put_u32(&page->data[0], server_name_list);
+    return page;
+}
+
+/* Make room in the page for the name to be written at "end", doubling it
+ * (up to a full page of the longest names) as needed. Return the page, which
+ * may have moved along with "end", or NULL if it couldn't grow */
+static struct frame *page_fit(struct frame *page, char **end, const char *name)
+{
+    uint32_t max = HEADER_LEN + max_encoded_len(get_codec(server_name_list));
+    uint32_t used = *end - page->data;
+    uint32_t need = used + sizeof(uint16_t) + strnlen(name, MAX_UNAME - 1);
+
+    if (need <= page->len)
+        return page;
+
+    uint32_t len = page->len;
+    while (len < need)
+        len *= 2;
+    if (len > max)
+        len = max;
+
+    struct frame *ret = realloc(page, sizeof(struct frame) + len);
+    if (ret == NULL)
+        return NULL;
+
+    ret->len = len;
+    *end = &ret->data[used];
+    return ret;
+}
+
+/* The page's "n" names have been written up to "end", fill in the rest of
+ * it and give back the room it didn't need. Return the page, which may have
+ * moved */
+static struct frame *page_close(struct frame *page, char *end, uint32_t n, bool more)
+{
+    uint32_t len = end - page->data;
+
+    put_u32(&page->data[sizeof(uint32_t)], len - HEADER_LEN);
+    put_u32(&page->data[HEADER_LEN], more);
+    put_u32(&page->data[HEADER_LEN + sizeof(uint32_t)], n);
+    page->len = len;
+
+    // Only ever shrinks, so it's no worse off if this fails
+    struct frame *ret = realloc(page, sizeof(struct frame) + len);
+    return (ret != NULL) ? ret : page;
+}
@@ -0,0 +1,309 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "idset.h"
+#include "synch.h"
+
+#define WORD_BITS (32)
+
+/* Storage for the set, either the sorted ids or the bitmap. Readers may still
+ * be looking at a block after it's been replaced, so replaced blocks are
+ * only free()'d along with the set */
+struct block {
+    struct block *retired;      /* The next replaced block */
+    uint32_t cap;               /* Number of words */
+    uint32_t words[];           /* The ids, or the bits of the bitmap */
+};
+
+/* The writer bumps seq before and after every change, so it's odd while the
+ * set is being changed. A reader that sees seq change under it tries again
+ * (a seqlock) */
+struct idset {
+    unsigned int seq;           /* Odd while the set is being changed */
+    struct block *ids;          /* The sorted ids, NULL once a bitmap */
+    uint32_t len;               /* Number of ids in use */
+    struct block *bits;         /* The bitmap, NULL until promoted */
+    struct block *retired;      /* Blocks that have been replaced */
+    struct lock lock;           /* Held by writers */
+};
+
+/* Helper functions */
+static struct block *block_init(uint32_t cap);
+static void retire(struct idset *set, struct block *block);
+static bool lookup(struct idset *set, uint32_t id);
+static uint32_t search(struct block *ids, uint32_t len, uint32_t id);
+static uint32_t get(uint32_t *word);
+static void put(uint32_t *word, uint32_t val);
+static void write_begin(struct idset *set);
+static void write_end(struct idset *set);
+static int add_id(struct idset *set, uint32_t id);
+static int add_bit(struct idset *set, uint32_t id);
+static int promote(struct idset *set);
+
+struct idset *idset_init(void)
+{
+    struct idset *ret = malloc(sizeof(struct idset));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct idset) {0};
+
+    if (lock_setup(&ret->lock, lock_spin) < 0) {
+        free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+void idset_free(struct idset *set)
+{
+    if (set == NULL)
+        return;
+
+    retire(set, set->ids);
+    retire(set, set->bits);
+
+    while (set->retired != NULL) {
+        struct block *block = set->retired;
+        set->retired = block->retired;
+        free(block);
+    }
+
+    lock_teardown(&set->lock);
+    free(set);
+}
+
+int idset_add(struct idset *set, uint32_t id)
+{
+    assert(set != NULL);
+
+    lock_acquire(&set->lock);
+
+    int ret = 1;
+    if (lookup(set, id) == false) {
+        if (set->bits == NULL && set->len >= IDSET_ARRAY_MAX)
+            ret = promote(set);
+        if (ret >= 0)
+            ret = (set->bits != NULL) ? add_bit(set, id) : add_id(set, id);
+    }
+
+    lock_release(&set->lock);
+    return ret;
+}
+
+int idset_rm(struct idset *set, uint32_t id)
+{
+    assert(set != NULL);
+
+    lock_acquire(&set->lock);
+
+    if (lookup(set, id) == false) {
+        lock_release(&set->lock);
+        return 1;
+    }
+
+    write_begin(set);
+    if (set->bits != NULL) {
+        uint32_t *word = &set->bits->words[id / WORD_BITS];
+        put(word, get(word) & ~(1u << (id % WORD_BITS)));
+    } else {
+        uint32_t i = search(set->ids, set->len, id);
+        for (; i + 1 < set->len; i++)
+            put(&set->ids->words[i], get(&set->ids->words[i + 1]));
+        __atomic_store_n(&set->len, set->len - 1, __ATOMIC_RELAXED);
+    }
+    write_end(set);
+
+    lock_release(&set->lock);
+    return 0;
+}
+
+bool idset_has(struct idset *set, uint32_t id)
+{
+    assert(set != NULL);
+
+    while (1) {
+        unsigned int seq = __atomic_load_n(&set->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        bool ret = lookup(set, id);
+
+        // The lookup must be finished before seq is checked again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&set->seq, __ATOMIC_RELAXED) == seq)
+            return ret;
+    }
+}
+
+/* Return a block with "cap" zero'd words, NULL on error */
+static struct block *block_init(uint32_t cap)
+{
+    struct block *ret = calloc(1, sizeof(struct block) + cap * sizeof(uint32_t));
+    if (ret == NULL)
+        return NULL;
+
+    ret->cap = cap;
+    return ret;
+}
+
+/* Put the block on the list of blocks to free with the set */
+static void retire(struct idset *set, struct block *block)
+{
+    if (block == NULL)
+        return;
+
+    block->retired = set->retired;
+    set->retired = block;
+}
+
+/* Return true if the id is in the set. The set may be changing under a
+ * reader, so everything is loaded atomically and never read out of bounds,
+ * the caller works out if the answer can be trusted */
+static bool lookup(struct idset *set, uint32_t id)
+{
+    struct block *bits = __atomic_load_n(&set->bits, __ATOMIC_ACQUIRE);
+    if (bits != NULL) {
+        if (id / WORD_BITS >= bits->cap)
+            return false;
+        return (get(&bits->words[id / WORD_BITS]) >> (id % WORD_BITS)) & 1;
+    }
+
+    struct block *ids = __atomic_load_n(&set->ids, __ATOMIC_ACQUIRE);
+    uint32_t len = __atomic_load_n(&set->len, __ATOMIC_RELAXED);
+    if (ids == NULL)
+        return false;
+    if (len > ids->cap)
+        len = ids->cap;
+
+    uint32_t i = search(ids, len, id);
+    return (i < len && get(&ids->words[i]) == id);
+}
+
+/* Return where the id is (or should be) in the first len sorted ids */
+static uint32_t search(struct block *ids, uint32_t len, uint32_t id)
+{
+    uint32_t lo = 0;
+    uint32_t hi = len;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (get(&ids->words[mid]) < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Read a word that may be written at the same time */
+static uint32_t get(uint32_t *word)
+{
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+/* Write a word that may be read at the same time */
+static void put(uint32_t *word, uint32_t val)
+{
+    __atomic_store_n(word, val, __ATOMIC_RELAXED);
+}
+
+/* Tell readers the set is about to change, must hold the lock */
+static void write_begin(struct idset *set)
+{
+    __atomic_store_n(&set->seq, set->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Tell readers the set has stopped changing, must hold the lock */
+static void write_end(struct idset *set)
+{
+    __atomic_store_n(&set->seq, set->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Insert the id (which isn't in the set) into the sorted array, must hold
+ * the lock. Return -1 on error, otherwise 0 */
+static int add_id(struct idset *set, uint32_t id)
+{
+    struct block *ids = set->ids;
+
+    // The readers may be using the old array, so it's copied not realloc'd
+    if (ids == NULL || set->len == ids->cap) {
+        ids = block_init((set->ids == NULL) ? 4 : set->ids->cap * 2);
+        if (ids == NULL)
+            return -1;
+        for (uint32_t i = 0; i < set->len; i++)
+            ids->words[i] = set->ids->words[i];
+    }
+
+    write_begin(set);
+    if (ids != set->ids) {
+        retire(set, set->ids);
+        __atomic_store_n(&set->ids, ids, __ATOMIC_RELEASE);
+    }
+
+    uint32_t at = search(ids, set->len, id);
+    for (uint32_t i = set->len; i > at; i--)
+        put(&ids->words[i], get(&ids->words[i - 1]));
+    put(&ids->words[at], id);
+    __atomic_store_n(&set->len, set->len + 1, __ATOMIC_RELAXED);
+    write_end(set);
+
+    return 0;
+}
+
+/* Set the bit for the id, growing the bitmap if it's too small. Must hold
+ * the lock. Return -1 on error, otherwise 0 */
+static int add_bit(struct idset *set, uint32_t id)
+{
+    struct block *bits = set->bits;
+    uint32_t need = id / WORD_BITS + 1;
+
+    if (need > bits->cap) {
+        bits = block_init(need * 2);
+        if (bits == NULL)
+            return -1;
+        for (uint32_t i = 0; i < set->bits->cap; i++)
+            bits->words[i] = get(&set->bits->words[i]);
+    }
+
+    write_begin(set);
+    if (bits != set->bits) {
+        retire(set, set->bits);
+        __atomic_store_n(&set->bits, bits, __ATOMIC_RELEASE);
+    }
+
+    uint32_t *word = &bits->words[id / WORD_BITS];
+    put(word, get(word) | (1u << (id % WORD_BITS)));
+    write_end(set);
+
+    return 0;
+}
+
+/* Turn the sorted array into a bitmap, must hold the lock. Return -1 on
+ * error, otherwise 0 */
+static int promote(struct idset *set)
+{
+    uint32_t max = set->ids->words[set->len - 1];
+
+    struct block *bits = block_init(max / WORD_BITS + 1);
+    if (bits == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < set->len; i++) {
+        uint32_t id = set->ids->words[i];
+        bits->words[id / WORD_BITS] |= 1u << (id % WORD_BITS);
+    }
+
+    write_begin(set);
+    retire(set, set->ids);
+    __atomic_store_n(&set->ids, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&set->len, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&set->bits, bits, __ATOMIC_RELEASE);
+    write_end(set);
+
+    return 0;
+}
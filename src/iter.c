@@ -9,30 +9,26 @@
 #include <stdlib.h>
 
 #include "iter.h"
-#include "synch.h"
+#include "pool.h"
 
+/* Only the thread that made the iterator uses it, so there's no lock */
 struct iter {
-    struct lock *lock;
     void *container;            /* The type of object (e.g. list) */
     void *curr;                 /* The object to iterate (e.g. node) */
     struct iter_funcs ifuncs;   /* Operations for nodes */
 };
 
+static struct pool iter_pool = POOL_INIT("iterators", struct iter);
+
 struct iter *iter_init(struct iter_funcs *iter_funcs, void *cont, void *first)
 {
     assert(iter_funcs != NULL);
     assert(cont != NULL);
 
-    struct iter *ret = malloc(sizeof(struct iter));
+    struct iter *ret = pool_get(&iter_pool);
     if (ret == NULL)
         return NULL;
 
-    ret->lock = lock_init();
-    if (ret->lock == NULL) {
-        free (ret);
-        return NULL;
-    }
-
     ret->container = cont;
     ret->curr = first;
     ret->ifuncs = *iter_funcs;
@@ -45,57 +41,43 @@ void iter_free(struct iter *iter)
     if (iter == NULL)
         return;
 
-    struct lock *lock = iter->lock;
-    lock_acquire(lock);
-    free(iter);
-    lock_release(lock);
-    lock_free(lock);
+    pool_put(&iter_pool, iter);
 }
 
 void iter_next(struct iter *iter)
 {
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.next != NULL);
     iter->curr = iter->ifuncs.next(iter->container, iter->curr);
-    lock_release(iter->lock);
 }
 
 void iter_prev(struct iter *iter)
 {
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.prev != NULL);
     iter->curr = iter->ifuncs.prev(iter->container, iter->curr);
-    lock_release(iter->lock);
 }
 
 void iter_first(struct iter *iter)
 {
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.first != NULL);
     iter->curr = iter->ifuncs.first(iter->container, iter->curr);
-    lock_release(iter->lock);
 }
 
 void iter_last(struct iter *iter)
 {
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.last != NULL);
     iter->curr = iter->ifuncs.last(iter->container, iter->curr);
-    lock_release(iter->lock);
 }
 
 void *iter_get(struct iter *iter)
 {
     void *ret;
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.get != NULL);
     ret = iter->ifuncs.get(iter->container, iter->curr);
-    lock_release(iter->lock);
     return ret;
 }
 
@@ -103,10 +85,8 @@ bool iter_has_next(struct iter *iter)
 {
     bool ret;
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.has_next != NULL);
     ret = iter->ifuncs.has_next(iter->container, iter->curr);
-    lock_release(iter->lock);
     return ret;
 }
 
@@ -114,9 +94,7 @@ bool iter_has_prev(struct iter *iter)
 {
     bool ret;
     assert(iter != NULL);
-    lock_acquire(iter->lock);
     assert(iter->ifuncs.has_prev != NULL);
     ret = iter->ifuncs.has_prev(iter->container, iter->curr);
-    lock_release(iter->lock);
     return ret;
 }
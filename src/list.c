@@ -11,27 +11,37 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "ebr.h"
 #include "iter.h"
 #include "list.h"
+#include "pool.h"
 #include "synch.h"
 #include "util.h"
 
-struct node {
-    struct node *next;
-    struct node *prev;
+/* Cursors follow first and next without the lock, so they're only changed
+ * with atomic stores (see list_cursor_init()) */
+struct list_node {
+    struct list_node *next;
+    struct list_node *prev;
     void *item;
 };
 
 struct list {
-    struct node *first;
-    struct node *last;
+    struct list_node *first;
+    struct list_node *last;
     int len;
-    struct lock *lock;
+    bool shared;                /* Removed nodes wait for the cursors */
+    struct rwlock lock;         /* Read by list_get() and list_traverse() */
 };
 
+static struct pool node_pool = POOL_INIT("list nodes", struct list_node);
+
 /* Helper functions */
-static struct node *init_node (void *item);
-static void rm_node (struct list *list, struct node *node);
+static struct list_node *init_node (void *item);
+static void rm_node (struct list *list, struct list_node *node);
+static void free_node (struct list *list, struct list_node *node);
+static void put_node (void *node);
+static struct list_node *next_node (struct list_node *node);
 
 struct list *list_init (void)
 {
@@ -41,8 +51,7 @@ struct list *list_init (void)
 
     *ret = (struct list) {0};
 
-    ret->lock = lock_init();
-    if (ret->lock == NULL) {
+    if (rwlock_setup(&ret->lock) < 0) {
         free(ret);
         return NULL;
     }
@@ -50,27 +59,36 @@ struct list *list_init (void)
     return ret;
 }
 
+struct list *list_init_shared (void)
+{
+    struct list *ret = list_init();
+    if (ret != NULL)
+        ret->shared = true;
+    return ret;
+}
+
 int list_add (struct list *list, void *item)
 {
     if (list == NULL)
         return -1;
 
-    struct node *node = init_node(item);
+    struct list_node *node = init_node(item);
     if (node == NULL) {
         return -1;
     }
 
-    lock_acquire(list->lock);
+    // The node is filled in before a cursor can reach it
+    rwlock_write(&list->lock);
     if (list->first == NULL) {
-        list->first = node;
+        __atomic_store_n(&list->first, node, __ATOMIC_RELEASE);
         list->last = node;
     } else {
         node->prev = list->last;
-        list->last->next = node;
+        __atomic_store_n(&list->last->next, node, __ATOMIC_RELEASE);
         list->last = node;
     }
-    list->len += 1;
-    lock_release(list->lock);
+    __atomic_store_n(&list->len, list->len + 1, __ATOMIC_RELAXED);
+    rwlock_release(&list->lock);
     return 0;
 }
 
@@ -79,16 +97,16 @@ void list_free (struct list *list, void (*f)(void*))
     if (list == NULL)
         return;
 
-    struct node *prev = NULL;
-    struct node *curr = list->first;
+    struct list_node *prev = NULL;
+    struct list_node *curr = list->first;
     while (curr != NULL) {
         prev = curr;
         curr = curr->next;
         if (f)
             f(prev->item);
-        free(prev);
+        pool_put(&node_pool, prev);
     }
-    lock_free(list->lock);
+    rwlock_teardown(&list->lock);
     free(list);
 }
 
@@ -96,34 +114,34 @@ void *list_rm (struct list *list, void *item, int (*cmp)(void*, void*))
 {
     void *ret;
 
-    lock_acquire(list->lock);
+    rwlock_write(&list->lock);
     if (list->len == 0) {
-        lock_release(list->lock);
+        rwlock_release(&list->lock);
         return NULL;
     }
 
-    struct node *curr = list->first;
+    struct list_node *curr = list->first;
     while (curr != NULL) {
         if (cmp(item, curr->item) == 0) {
             ret = curr->item;
             rm_node (list, curr);
-            free(curr);
-            lock_release(list->lock);
+            rwlock_release(&list->lock);
+            free_node (list, curr);
             return ret;
         }
         curr = curr->next;
     }
-    lock_release(list->lock);
+    rwlock_release(&list->lock);
     return NULL;
 }
 
 void *list_get (struct list *list, int (*cmp)(void*, void*), void *arg)
 {
-    struct node *curr;
+    struct list_node *curr;
 
-    lock_acquire(list->lock);
+    rwlock_read(&list->lock);
     if (list->len == 0) {
-        lock_release(list->lock);
+        rwlock_release(&list->lock);
         return NULL;
     }
 
@@ -131,26 +149,27 @@ void *list_get (struct list *list, int (*cmp)(void*, void*), void *arg)
 
     while (curr != NULL) {
         if (cmp(curr->item, arg) == 0) {
-            lock_release(list->lock);
+            rwlock_release(&list->lock);
             return curr->item;
         }
 
         curr = curr->next;
     }
-    lock_release(list->lock);
+    rwlock_release(&list->lock);
     return NULL;
 }
 
 /* Simply remove the node from the linked list */
-static void rm_node (struct list *list, struct node *node)
+static void rm_node (struct list *list, struct list_node *node)
 {
     if (node == NULL)
         return;
 
+    // The node keeps its next, a cursor sitting on it can still move on
     if (list->first == node) {
-        list->first = node->next;
+        __atomic_store_n(&list->first, node->next, __ATOMIC_RELEASE);
     } else {
-        node->prev->next = node->next;
+        __atomic_store_n(&node->prev->next, node->next, __ATOMIC_RELEASE);
     }
 
     if (list->last == node) {
@@ -158,13 +177,38 @@ static void rm_node (struct list *list, struct node *node)
     } else {
         node->next->prev = node->prev;
     }
-    list->len -= 1;
+    __atomic_store_n(&list->len, list->len - 1, __ATOMIC_RELAXED);
+}
+
+/* Give the removed node back to the pool. Cursors of a shared list may
+ * still be on it, so it waits for them first */
+static void free_node (struct list *list, struct list_node *node)
+{
+    if (node == NULL)
+        return;
+
+    if (list->shared == true)
+        ebr_retire(node, put_node);
+    else
+        pool_put(&node_pool, node);
+}
+
+/* Put the node back in the pool, for ebr_retire() */
+static void put_node (void *node)
+{
+    pool_put(&node_pool, node);
+}
+
+/* Return the node after "node", it may be changing under us */
+static struct list_node *next_node (struct list_node *node)
+{
+    return __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
 }
 
 /* Initialise a node and return it, NULL on error */
-static struct node *init_node (void *item)
+static struct list_node *init_node (void *item)
 {
-    struct node *ret = malloc(sizeof(struct node));
+    struct list_node *ret = pool_get(&node_pool);
     if (!ret)
         return ret;
     ret->next = ret->prev = NULL;
@@ -174,23 +218,19 @@ static struct node *init_node (void *item)
 
 void list_traverse (struct list *list, void(*func)(void*, void*), void *arg)
 {
-    struct node *curr;
-    lock_acquire(list->lock);
+    struct list_node *curr;
+    rwlock_read(&list->lock);
     curr = list->first;
     while (curr != NULL) {
         func(curr->item, arg);
         curr = curr->next;
     }
-    lock_release(list->lock);
+    rwlock_release(&list->lock);
 }
 
 int list_len(struct list *list)
 {
-    int ret;
-    lock_acquire(list->lock);
-    ret = list->len;
-    lock_release(list->lock);
-    return ret;
+    return __atomic_load_n(&list->len, __ATOMIC_RELAXED);
 }
 
 void *list_pop(struct list *list)
@@ -199,23 +239,25 @@ void *list_pop(struct list *list)
         return NULL;
 
     void *ret;
-    lock_acquire(list->lock);
+    struct list_node *node = NULL;
+    rwlock_write(&list->lock);
     if (list->len == 0)
         ret = NULL;
     else {
-        ret = list->first->item;
-        rm_node(list, list->first);
+        node = list->first;
+        ret = node->item;
+        rm_node(list, node);
     }
-    lock_release(list->lock);
+    rwlock_release(&list->lock);
 
+    free_node(list, node);
     return ret;
 }
 
 /* Return the next node after "n" */
 static void *set_iter_next(UNUSED void *c, void *n)
 {
-    struct node *curr = n;
-    return curr->next;
+    return next_node(n);
 }
 
 /* Return if there is a next node in the list */
@@ -227,7 +269,7 @@ static bool set_iter_has_next(UNUSED void *c, void *n)
 /* Return the item from the node */
 static void *set_iter_get(UNUSED void *c, void *n)
 {
-    struct node *curr = n;
+    struct list_node *curr = n;
     return curr->item;
 }
 
@@ -240,15 +282,92 @@ struct iter *list_iter_init(struct list *list)
     iter_funcs.has_next = set_iter_has_next;
     iter_funcs.get = set_iter_get;
 
-    struct iter *ret = iter_init(&iter_funcs, list, list->first);
+    struct list_node *first = __atomic_load_n(&list->first, __ATOMIC_ACQUIRE);
+    struct iter *ret = iter_init(&iter_funcs, list, first);
     return ret;
 }
 
+void list_cursor_init(struct list_cursor *cursor, struct list *list)
+{
+    assert(cursor != NULL);
+    assert(list != NULL);
+
+    ebr_enter();
+    cursor->node = __atomic_load_n(&list->first, __ATOMIC_ACQUIRE);
+}
+
+bool list_cursor_has_next(struct list_cursor *cursor)
+{
+    assert(cursor != NULL);
+    return (cursor->node != NULL);
+}
+
+void *list_cursor_get(struct list_cursor *cursor)
+{
+    assert(cursor != NULL && cursor->node != NULL);
+    return cursor->node->item;
+}
+
+void list_cursor_next(struct list_cursor *cursor)
+{
+    assert(cursor != NULL && cursor->node != NULL);
+    cursor->node = next_node(cursor->node);
+}
+
+void list_cursor_end(struct list_cursor *cursor)
+{
+    assert(cursor != NULL);
+    cursor->node = NULL;
+    ebr_exit();
+}
+
 bool list_is_empty(struct list *list)
 {
-    bool ret;
-    lock_acquire(list->lock);
-    ret = (list->len == 0);
-    lock_release(list->lock);
-    return ret;
+    return (list_len(list) == 0);
+}
+
+void ilist_init(struct ilist *ilist)
+{
+    assert(ilist != NULL);
+    ilist->head.next = &ilist->head;
+    ilist->head.prev = &ilist->head;
+    ilist->len = 0;
+}
+
+void ilist_add(struct ilist *ilist, struct list_link *link)
+{
+    assert(ilist != NULL);
+    assert(link != NULL && link->next == NULL);
+
+    link->next = &ilist->head;
+    link->prev = ilist->head.prev;
+    ilist->head.prev->next = link;
+    ilist->head.prev = link;
+    ilist->len += 1;
+}
+
+void ilist_rm(struct ilist *ilist, struct list_link *link)
+{
+    assert(ilist != NULL);
+    assert(link != NULL);
+
+    if (link->next == NULL)
+        return;
+
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = link->prev = NULL;
+    ilist->len -= 1;
+}
+
+struct list_link *ilist_pop(struct ilist *ilist)
+{
+    assert(ilist != NULL);
+
+    if (ilist->len == 0)
+        return NULL;
+
+    struct list_link *link = ilist->head.next;
+    ilist_rm(ilist, link);
+    return link;
 }
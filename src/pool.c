@@ -0,0 +1,320 @@
+#include <assert.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/* A thread's free objects for one pool. Only the owner touches the free
+ * list, the counters are read by pool_traverse() as well */
+struct cache {
+    void *free;                 /* Free objects, linked through their start */
+    size_t nfree;               /* Number of free objects */
+    unsigned long hits;         /* See struct pool_stats */
+    unsigned long misses;
+    struct pool *pool;          /* The pool the cache is for */
+    struct cache *next;         /* The next cache of the pool */
+};
+
+/* The caches of a thread, indexed by the pool's id - 1 */
+struct thread_caches {
+    struct cache *caches[POOL_MAX];
+};
+
+/* Strings start with a tag saying where they came from */
+enum str_tag {
+    str_malloc = 0,
+    str_pool   = 1,
+};
+
+/* Something as big as the longest string that can come from a pool */
+struct short_str {
+    char tag;
+    char str[POOL_STR_MAX];
+};
+
+static struct pool strings = POOL_INIT("strings", struct short_str);
+
+/* Every pool that has been used, and how many there are */
+static struct pool *pools = NULL;
+static int npools = 0;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Flushes a thread's caches when it exits */
+static pthread_key_t caches_key;
+static pthread_once_t caches_once = PTHREAD_ONCE_INIT;
+
+static __thread struct thread_caches *mine = NULL;
+
+/* Helper functions */
+static struct cache *get_cache(struct pool *pool);
+static int register_pool(struct pool *pool);
+static void make_key(void);
+static void flush_caches(void *arg);
+static int refill(struct cache *cache);
+static void spill(struct cache *cache, size_t nobjs);
+static int grow(struct pool *pool);
+static size_t obj_size(struct pool *pool);
+static void push(void **list, void *obj);
+static void *pop(void **list);
+
+void *pool_get(struct pool *pool)
+{
+    assert(pool != NULL);
+
+    struct cache *cache = get_cache(pool);
+    if (cache == NULL)
+        return NULL;
+
+    if (cache->free != NULL) {
+        __atomic_store_n(&cache->hits, cache->hits + 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&cache->misses, cache->misses + 1, __ATOMIC_RELAXED);
+        if (refill(cache) < 0)
+            return NULL;
+    }
+
+    cache->nfree -= 1;
+    return pop(&cache->free);
+}
+
+void pool_put(struct pool *pool, void *obj)
+{
+    assert(pool != NULL);
+
+    if (obj == NULL)
+        return;
+
+    struct cache *cache = get_cache(pool);
+    if (cache == NULL) {
+        // No cache for this thread, straight back to the shared list
+        pthread_mutex_lock(&pool->mutex);
+        push(&pool->free, obj);
+        pool->nfree += 1;
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    push(&cache->free, obj);
+    cache->nfree += 1;
+
+    // Keep a batch around for the next gets, give the rest to the others
+    if (cache->nfree >= POOL_BATCH * 2)
+        spill(cache, POOL_BATCH);
+}
+
+void pool_traverse(void (*func)(struct pool_stats *, void *), void *arg)
+{
+    assert(func != NULL);
+
+    pthread_mutex_lock(&pools_mutex);
+    for (struct pool *pool = pools; pool != NULL; pool = pool->next) {
+        struct pool_stats stats = {
+            .name = pool->name,
+            .size = pool->size,
+        };
+
+        pthread_mutex_lock(&pool->mutex);
+        stats.nobjs = pool->nobjs;
+        for (struct cache *c = pool->caches; c != NULL; c = c->next) {
+            stats.hits += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+            stats.misses += __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        func(&stats, arg);
+    }
+    pthread_mutex_unlock(&pools_mutex);
+}
+
+char *pool_strdup(const char *str)
+{
+    assert(str != NULL);
+
+    size_t len = strlen(str) + 1;
+    char *ret;
+
+    if (len <= POOL_STR_MAX) {
+        ret = pool_get(&strings);
+        if (ret == NULL)
+            return NULL;
+        ret[0] = str_pool;
+        strncpy(ret + 1, str, POOL_STR_MAX);
+    } else {
+        ret = malloc(len + 1);
+        if (ret == NULL)
+            return NULL;
+        ret[0] = str_malloc;
+        memcpy(ret + 1, str, len);
+    }
+
+    return ret + 1;
+}
+
+void pool_strfree(char *str)
+{
+    if (str == NULL)
+        return;
+
+    char *start = str - 1;
+    if (start[0] == str_pool)
+        pool_put(&strings, start);
+    else
+        free(start);
+}
+
+/* Return this thread's cache of the pool, it's made the first time. Return
+ * NULL on error */
+static struct cache *get_cache(struct pool *pool)
+{
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id == 0 && (id = register_pool(pool)) < 0)
+        return NULL;
+
+    if (mine != NULL && mine->caches[id - 1] != NULL)
+        return mine->caches[id - 1];
+
+    pthread_once(&caches_once, make_key);
+
+    if (mine == NULL) {
+        mine = calloc(1, sizeof(struct thread_caches));
+        if (mine == NULL)
+            return NULL;
+        pthread_setspecific(caches_key, mine);
+    }
+
+    struct cache *cache = calloc(1, sizeof(struct cache));
+    if (cache == NULL)
+        return NULL;
+    cache->pool = pool;
+
+    // Caches are kept after their thread exits, the stats still count
+    pthread_mutex_lock(&pool->mutex);
+    cache->next = pool->caches;
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->mutex);
+
+    mine->caches[id - 1] = cache;
+    return cache;
+}
+
+/* Give the pool an id the first time it's used. Return the id, -1 if there
+ * are already POOL_MAX pools */
+static int register_pool(struct pool *pool)
+{
+    pthread_mutex_lock(&pools_mutex);
+
+    // Another thread may have got here first
+    int id = pool->id;
+    if (id == 0 && npools < POOL_MAX) {
+        id = ++npools;
+        pool->next = pools;
+        pools = pool;
+        __atomic_store_n(&pool->id, id, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&pools_mutex);
+    return (id != 0) ? id : -1;
+}
+
+/* Called once, before any thread has caches */
+static void make_key(void)
+{
+    if (pthread_key_create(&caches_key, flush_caches) != 0)
+        abort();
+}
+
+/* The thread is exiting, give everything in its caches back */
+static void flush_caches(void *arg)
+{
+    struct thread_caches *caches = arg;
+
+    for (int i = 0; i < POOL_MAX; i++) {
+        struct cache *cache = caches->caches[i];
+        if (cache != NULL && cache->nfree > 0)
+            spill(cache, cache->nfree);
+    }
+
+    free(caches);
+    mine = NULL;
+}
+
+/* Move a batch from the shared list to the cache, growing the pool if it's
+ * out. Return -1 on error */
+static int refill(struct cache *cache)
+{
+    struct pool *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->nfree < POOL_BATCH && grow(pool) < 0 && pool->nfree == 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    while (cache->nfree < POOL_BATCH && pool->free != NULL) {
+        push(&cache->free, pop(&pool->free));
+        pool->nfree -= 1;
+        cache->nfree += 1;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/* Move nobjs from the cache to the shared list */
+static void spill(struct cache *cache, size_t nobjs)
+{
+    struct pool *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (size_t i = 0; i < nobjs && cache->free != NULL; i++) {
+        push(&pool->free, pop(&cache->free));
+        cache->nfree -= 1;
+        pool->nfree += 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Carve a new slab into free objects. Must hold the pool's mutex. Return -1
+ * on error */
+static int grow(struct pool *pool)
+{
+    size_t size = obj_size(pool);
+
+    char *slab = malloc(size * POOL_SLAB);
+    if (slab == NULL)
+        return -1;
+
+    for (size_t i = 0; i < POOL_SLAB; i++)
+        push(&pool->free, slab + i * size);
+
+    pool->nfree += POOL_SLAB;
+    pool->nobjs += POOL_SLAB;
+    return 0;
+}
+
+/* Return the bytes each object takes in a slab, enough for the free list's
+ * link and aligned like malloc() would */
+static size_t obj_size(struct pool *pool)
+{
+    size_t align = alignof(max_align_t);
+    size_t size = (pool->size < sizeof(void *)) ? sizeof(void *) : pool->size;
+    return (size + align - 1) / align * align;
+}
+
+/* Put the free object on the front of the list */
+static void push(void **list, void *obj)
+{
+    *(void **) obj = *list;
+    *list = obj;
+}
+
+/* Take the free object off the front of the list */
+static void *pop(void **list)
+{
+    void *obj = *list;
+    *list = *(void **) obj;
+    return obj;
+}
@@ -394,21 +394,20 @@ static int cmd_private(char *safe_cmd, struct tokens *toks)
 static int ptop_get_by_name(const char *name, struct ptop **ptop)
 {
     struct list *ptop_list = client_get_ptops();
-    struct iter *iter = list_iter_init(ptop_list);
-    if (iter == NULL)
-        return -1;
+    struct list_cursor cursor;
 
-    while (iter_has_next(iter) == true) {
+    list_cursor_init(&cursor, ptop_list);
+    while (list_cursor_has_next(&cursor) == true) {
 
-        struct ptop *curr_ptop = iter_get(iter);
+        struct ptop *curr_ptop = list_cursor_get(&cursor);
         if (ptop_name_cmp(curr_ptop, name) == 0) {
             *ptop = curr_ptop;
             break;
         }
 
-        iter_next(iter);
+        list_cursor_next(&cursor);
     }
-    iter_free(iter);
+    list_cursor_end(&cursor);
     return 0;
 }
 
@@ -564,12 +563,8 @@ static void ptop_free(struct ptop *ptop)
  * on error, otherwise 0 is returned */
 static int init_conn_to_server(char *cmd)
 {
-    int sock = client_get_server_sock();
-    if (send_payload_ccmd(sock, cmd) < 0)
-        return -1;
-
     struct scmd_payload scmd = {0};
-    if (recv_payload_scmd(sock, &scmd) < 0)
+    if (client_call(cmd, &scmd) < 0)
         return -1;
 
     assert(scmd.code == task_ready);
@@ -6,41 +6,55 @@
  *******************************************/
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "queue.h"
-#include "synch.h"
+#include "util.h"
 
-struct node {
-    struct node *next;
-    struct node *prev;
+/* A slot in the ring. The seq says whose turn it is: pos means it's free for
+ * the producer claiming pos, pos + 1 means the item for pos is ready */
+struct cell {
+    size_t seq;
     void *item;
 };
 
+/* The producers fight over tail, only the consumer touches head. They live
+ * on their own cache lines so the two sides don't slow each other down */
 struct queue {
-    struct node *first;
-    struct node *last;
-    int len;
-    struct lock *lock;
+    _Alignas(CACHE_LINE) size_t tail;   /* Next position to push to */
+    _Alignas(CACHE_LINE) size_t head;   /* Next position to pop from */
+    size_t mask;                        /* Number of cells - 1 */
+    struct cell *cells;
 };
 
 /* Helper functions */
-static struct node *init_node (void *item);
+static struct cell *ready_cell(struct queue *queue);
 
-struct queue *queue_init(void)
+struct queue *queue_init(size_t size)
 {
-    struct queue *ret = malloc(sizeof(struct queue));
+    size_t ncells = 2;
+    while (ncells < size)
+        ncells *= 2;
+
+    struct queue *ret = aligned_alloc(CACHE_LINE, sizeof(struct queue));
     if (ret == NULL)
         return NULL;
 
     *ret = (struct queue) {0};
+    ret->mask = ncells - 1;
 
-    ret->lock = lock_init();
-    if (ret->lock == NULL) {
-        free (ret);
+    ret->cells = malloc(sizeof(struct cell) * ncells);
+    if (ret->cells == NULL) {
+        free(ret);
         return NULL;
     }
 
+    for (size_t i = 0; i < ncells; i++) {
+        ret->cells[i].seq = i;
+        ret->cells[i].item = NULL;
+    }
+
     return ret;
 }
 
@@ -49,63 +63,58 @@ int queue_push (struct queue *queue, void *item)
     if (queue == NULL)
         return -1;
 
-    struct node *node = init_node(item);
-    if (node == NULL)
-        return -1;
-
-    lock_acquire(queue->lock);
-    if (queue->first == NULL) {
-        queue->first = node;
-        queue->last = node;
-    } else {
-        node->next = queue->last;
-        queue->last->prev = node;
-        queue->last = node;
+    struct cell *cell;
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            // The cell is free, claim it before another producer does
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // The consumer hasn't popped the last lap yet
+            return -1;
+        } else {
+            // Another producer got there first
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
     }
-    queue->len += 1;
-    lock_release(queue->lock);
+
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
     return 0;
 }
 
-/* Initialise a node and return it containing the item, return NULL on error */
-static struct node *init_node (void *item)
+void *queue_pop (struct queue *queue)
 {
-    struct node *ret = malloc(sizeof(struct node));
-    if (ret == NULL)
+    if (queue == NULL)
         return NULL;
 
-    *ret = (struct node) {0};
-    ret->item = item;
-    return ret;
-}
+    struct cell *cell = ready_cell(queue);
+    if (cell == NULL)
+        return NULL;
 
-void *queue_pop (struct queue *queue)
-{
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    void *item = cell->item;
 
-    void *item;
-    struct node *dead_node;
+    // Hand the cell back to the producers for the next lap
+    __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->head, pos + 1, __ATOMIC_RELEASE);
+    return item;
+}
 
+void *queue_peek (struct queue *queue)
+{
     if (queue == NULL)
         return NULL;
 
-    lock_acquire(queue->lock);
-    if (queue->len == 0) {
-        dead_node = NULL;
-    } else if (queue->len == 1) {
-        dead_node = queue->first;
-        queue->first = queue->last = NULL;
-        queue->len = 0;
-    } else {
-        dead_node = queue->first;
-        queue->first = queue->first->prev;
-        queue->first->next = NULL;
-        queue->len -= 1;
-    }
-    lock_release(queue->lock);
-
-    item = dead_node->item;
-    free (dead_node);
-    return item;
+    struct cell *cell = ready_cell(queue);
+    return (cell != NULL) ? cell->item : NULL;
 }
 
 void queue_free(struct queue *queue, void (*f)(void *))
@@ -113,35 +122,41 @@ void queue_free(struct queue *queue, void (*f)(void *))
     if (queue == NULL)
         return;
 
-    struct node *prev = NULL;
-    struct node *curr = queue->first;
-    while (curr != NULL) {
-        prev = curr;
-        curr = curr->next;
+    void *item;
+    while ((item = queue_pop(queue)) != NULL) {
         if (f)
-           f(prev->item);
-        free(prev);
+            f(item);
     }
-    lock_free(queue->lock);
+
+    free(queue->cells);
     free(queue);
 }
 
 bool queue_is_empty(struct queue *q)
 {
     assert (q != NULL);
-    bool ret;
-    lock_acquire(q->lock);
-    ret = (q->len == 0);
-    lock_release(q->lock);
-    return ret;
+    return ready_cell(q) == NULL;
 }
 
 int queue_len(struct queue *q)
 {
     assert(q != NULL);
-    int ret;
-    lock_acquire(q->lock);
-    ret = q->len;
-    lock_release(q->lock);
-    return ret;
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+    // The consumer may have popped past a tail that was loaded first
+    return (tail > head) ? (int) (tail - head) : 0;
+}
+
+/* Return the cell at the front of the queue if its item is ready, otherwise
+ * NULL. Only the consumer may call this */
+static struct cell *ready_cell(struct queue *queue)
+{
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    struct cell *cell = &queue->cells[pos & queue->mask];
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+
+    return cell;
 }
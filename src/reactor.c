@@ -0,0 +1,947 @@
+// For pthread_setaffinity_np() and accept4()
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "config.h"
+#include "queue.h"
+#include "reactor.h"
+#include "uring.h"
+#include "util.h"
+
+/* With io_uring the low bit of a request's user_data is set if it's a
+ * reactor_send(), otherwise it's the watch's own (multishot) request */
+#define SEND_TAG (1ul)
+
+/* What the watch is for */
+enum watch_type {
+    watch_poll,                 /* See reactor_add() */
+    watch_accept,               /* See reactor_accept() */
+    watch_stream,               /* See reactor_stream() */
+};
+
+struct watch {
+    int fd;                     /* The fd being watched */
+    bool dead;                  /* reactor_del() has been called */
+    enum watch_type type;       /* Which of the funcs is used */
+    uint32_t events;            /* What a watch_poll is interested in */
+    bool paused;                /* Not reading, see reactor_pause() */
+    bool receiving;             /* A watch_stream's recv is in flight (or
+                                 * stalled) */
+    reactor_func func;          /* Called when the fd is ready */
+    reactor_accept_func accept; /* Called with each client */
+    reactor_recv_func recv;     /* Called with what's been read */
+    reactor_sent_func sent;     /* Called once a reactor_send() is done */
+    void *arg;                  /* Passed to the funcs */
+    int inflight;               /* io_uring requests (or stalls) that still
+                                 * point at the watch */
+    time_t dead_tick;           /* The tick it was removed in */
+    bool lingering;             /* Its sends have been left to finish */
+    uint64_t uncancelled;       /* Key of a cancel the ring had no room
+                                 * for, 0 if none (see cancel()) */
+    struct watch *next_dead;    /* Next watch waiting to be free()'d */
+    struct watch *next_stalled; /* Next watch waiting to be armed again */
+};
+
+struct task {
+    reactor_task func;          /* Called on the reactor's thread */
+    void *arg;                  /* Passed to func */
+};
+
+struct reactor {
+    int epfd;                   /* The epoll instance, -1 with io_uring */
+    struct uring *ring;         /* The io_uring instance, NULL with epoll */
+    bool started;               /* reactor_start() has been called */
+    pthread_t thread;           /* The thread running the event loop */
+    int cpu;                    /* The core the thread is pinned to, -1 if
+                                 * it may run anywhere */
+
+    int wakefd;                 /* eventfd to wake up the reactor */
+    struct watch *wake;         /* The watch for wakefd */
+    struct queue *tasks;        /* Tasks posted by other threads */
+    struct handoff *handoffs;   /* Handed off by other threads, the newest
+                                 * first */
+
+    struct wheel *timers;       /* Only touched by the reactor's thread */
+    reactor_tick tick;          /* Called once a second */
+    void *tick_arg;             /* Passed to tick */
+    time_t last_tick;           /* When tick was last called */
+
+    struct watch *dead;         /* Watches to free after the current batch */
+    struct watch *stalled;      /* io_uring watches whose request failed,
+                                 * they're armed again on the next tick */
+};
+
+/* The reactor running on this thread, NULL if not a reactor thread */
+static __thread struct reactor *current_reactor = NULL;
+
+/* Helper functions */
+static void *reactor_landing(void *arg);
+static void pin(struct reactor *reactor);
+static void bury_dead(struct reactor *reactor);
+static void run_tick(struct reactor *reactor);
+static void run_tasks(void *arg, uint32_t events);
+static void run_handoffs(struct reactor *reactor);
+static struct watch *watch_init(int fd, enum watch_type type, void *arg);
+static int start_watch(struct reactor *reactor, struct watch *watch);
+static void epoll_loop(struct reactor *reactor);
+static void accept_all(struct watch *watch);
+static void uring_loop(struct reactor *reactor);
+static uint32_t wanted(struct watch *watch);
+static int arm(struct reactor *reactor, struct watch *watch);
+static void stall(struct reactor *reactor, struct watch *watch);
+static void unstall(struct reactor *reactor);
+static void cancel(struct reactor *reactor, struct watch *watch, uint64_t key);
+static void retry_cancels(struct reactor *reactor);
+static void end_lingering(struct reactor *reactor);
+static void complete(struct reactor *reactor, struct io_uring_cqe *cqe);
+static void polled(struct reactor *, struct watch *, struct io_uring_cqe *);
+static void accepted(struct reactor *, struct watch *, struct io_uring_cqe *);
+static void received(struct reactor *, struct watch *, struct io_uring_cqe *);
+static bool accept_failed(int err);
+
+struct reactor *reactor_init(enum reactor_backend backend)
+{
+    struct reactor *ret = malloc(sizeof(struct reactor));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct reactor) {0};
+    ret->cpu = -1;
+    ret->epfd = -1;
+
+    // Anything that stops the ring being set up leaves us with epoll
+    if (backend == reactor_uring) {
+        ret->ring = uring_init(
+            REACTOR_URING_ENTRIES,
+            REACTOR_URING_BUFS,
+            REACTOR_URING_BUF_LEN
+        );
+    }
+
+    if (ret->ring == NULL) {
+        ret->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (ret->epfd < 0) {
+            free(ret);
+            return NULL;
+        }
+    }
+
+    ret->tasks = queue_init(REACTOR_MAILBOX);
+    if (ret->tasks == NULL)
+        goto reactor_init_error;
+
+    ret->last_tick = time(NULL);
+    ret->timers = wheel_init(ret->last_tick);
+    if (ret->timers == NULL)
+        goto reactor_init_error;
+
+    ret->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ret->wakefd < 0)
+        goto reactor_init_error;
+
+    ret->wake = reactor_add(ret, ret->wakefd, EPOLLIN, run_tasks, ret);
+    if (ret->wake == NULL) {
+        close(ret->wakefd);
+        goto reactor_init_error;
+    }
+
+    return ret;
+
+reactor_init_error:
+    wheel_free(ret->timers);
+    queue_free(ret->tasks, NULL);
+    if (ret->epfd >= 0)
+        close(ret->epfd);
+    uring_free(ret->ring);
+    free(ret);
+    return NULL;
+}
+
+int reactor_start(struct reactor *reactor)
+{
+    assert(reactor != NULL);
+
+    reactor->started = true;
+    if (pthread_create(&reactor->thread, NULL, reactor_landing, reactor) != 0) {
+        reactor->started = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+enum reactor_backend reactor_get_backend(struct reactor *reactor)
+{
+    assert(reactor != NULL);
+    return (reactor->ring != NULL) ? reactor_uring : reactor_epoll;
+}
+
+void reactor_set_cpu(struct reactor *reactor, int cpu)
+{
+    assert(reactor != NULL);
+    reactor->cpu = cpu;
+}
+
+void reactor_set_tick(struct reactor *reactor, reactor_tick tick, void *arg)
+{
+    assert(reactor != NULL);
+    reactor->tick = tick;
+    reactor->tick_arg = arg;
+}
+
+struct watch *reactor_add
+(
+    struct reactor *reactor,
+    int fd,
+    uint32_t events,
+    reactor_func func,
+    void *arg
+)
+{
+    assert(reactor != NULL);
+    assert(func != NULL);
+
+    struct watch *watch = watch_init(fd, watch_poll, arg);
+    if (watch == NULL)
+        return NULL;
+
+    watch->events = events;
+    watch->func = func;
+
+    if (start_watch(reactor, watch) < 0) {
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+int reactor_mod(struct reactor *reactor, struct watch *watch, uint32_t events)
+{
+    assert(reactor != NULL);
+    assert(watch != NULL && watch->type == watch_poll);
+
+    watch->events = events;
+    events = wanted(watch);
+
+    if (reactor->ring == NULL) {
+        struct epoll_event ev = {
+            .events = events | EPOLLET,
+            .data.ptr = watch,
+        };
+        return epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, watch->fd, &ev);
+    }
+
+    assert(reactor->started == false || reactor_is_current(reactor));
+
+    // A stalled watch picks up the new events when it's armed again
+    if (watch->inflight == 0)
+        return 0;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(reactor->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = (uintptr_t) watch;
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = events;
+    return 0;
+}
+
+int reactor_pause(struct reactor *reactor, struct watch *watch, bool paused)
+{
+    assert(reactor != NULL);
+    assert(watch != NULL && watch->type != watch_accept);
+    assert(reactor->started == false || reactor_is_current(reactor));
+
+    if (watch->paused == paused)
+        return 0;
+
+    watch->paused = paused;
+
+    if (watch->type == watch_poll)
+        return reactor_mod(reactor, watch, watch->events);
+
+    // Whatever the kernel has already read is still handed over, the
+    // recv's last completion says it's stopped (see received())
+    if (paused == true) {
+        if (watch->receiving == true)
+            cancel(reactor, watch, (uintptr_t) watch);
+        return 0;
+    }
+
+    watch->uncancelled = 0;
+    if (watch->receiving == false && arm(reactor, watch) < 0)
+        stall(reactor, watch);
+    return 0;
+}
+
+struct watch *reactor_accept
+(
+    struct reactor *reactor,
+    int fd,
+    reactor_accept_func func,
+    void *arg
+)
+{
+    assert(reactor != NULL);
+    assert(func != NULL);
+
+    struct watch *watch = watch_init(fd, watch_accept, arg);
+    if (watch == NULL)
+        return NULL;
+
+    watch->events = EPOLLIN;
+    watch->accept = func;
+
+    if (start_watch(reactor, watch) < 0) {
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+struct watch *reactor_stream
+(
+    struct reactor *reactor,
+    int fd,
+    reactor_recv_func recv,
+    reactor_sent_func sent,
+    void *arg
+)
+{
+    assert(reactor != NULL);
+    assert(reactor->ring != NULL);
+    assert(recv != NULL);
+    assert(sent != NULL);
+
+    struct watch *watch = watch_init(fd, watch_stream, arg);
+    if (watch == NULL)
+        return NULL;
+
+    watch->recv = recv;
+    watch->sent = sent;
+
+    if (start_watch(reactor, watch) < 0) {
+        free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+int reactor_send(struct reactor *reactor, struct watch *watch, struct msghdr *msg)
+{
+    assert(reactor_is_current(reactor));
+    assert(reactor->ring != NULL);
+    assert(watch != NULL && watch->type == watch_stream);
+    assert(watch->dead == false);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(reactor->ring);
+    if (sqe == NULL)
+        return -1;
+
+    // Not MSG_DONTWAIT, the kernel waits for room in the socket itself
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = watch->fd;
+    sqe->addr = (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) watch | SEND_TAG;
+
+    watch->inflight += 1;
+    return 0;
+}
+
+void reactor_del(struct reactor *reactor, struct watch *watch)
+{
+    if (watch == NULL)
+        return;
+
+    assert(watch->dead == false);
+
+    if (reactor->ring != NULL) {
+        // Sends still in flight are given until the next tick to finish,
+        // like the last write epoll's users make before closing the fd
+        cancel(reactor, watch, (uintptr_t) watch);
+        watch->dead_tick = reactor->last_tick;
+        watch->lingering = (watch->type == watch_stream);
+
+        // The requests only name the fd, which the caller is free to close
+        // as soon as we return. The kernel has to have them (and anything
+        // queued for the fd) before then
+        uring_submit(reactor->ring);
+    } else {
+        // The fd may already be closed, in which case the kernel has
+        // dropped it from the interest list for us.
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+    }
+
+    // There may be an event for this watch later in the current batch, so
+    // it can't be free()'d just yet.
+    watch->dead = true;
+    watch->next_dead = reactor->dead;
+    reactor->dead = watch;
+}
+
+int reactor_post(struct reactor *reactor, reactor_task func, void *arg)
+{
+    assert(reactor != NULL);
+    assert(func != NULL);
+
+    struct task *task = malloc(sizeof(struct task));
+    if (task == NULL)
+        return -1;
+
+    task->func = func;
+    task->arg = arg;
+
+    // Any thread may post, only the reactor pops
+    if (queue_push(reactor->tasks, task) < 0) {
+        free(task);
+        return -1;
+    }
+
+    // Only fails if the counter would overflow, in which case the reactor
+    // has plenty of wake ups coming anyway
+    uint64_t one = 1;
+    if (write(reactor->wakefd, &one, sizeof(one)) < 0) {
+        // Ignored
+    }
+
+    return 0;
+}
+
+void reactor_handoff(struct reactor *reactor, struct handoff *handoff)
+{
+    assert(reactor != NULL);
+    assert(handoff != NULL && handoff->func != NULL);
+
+    // Any thread may push, the reactor takes the whole list at once
+    handoff->next = __atomic_load_n(&reactor->handoffs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+        &reactor->handoffs,
+        &handoff->next,
+        handoff,
+        true,
+        __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED
+    ));
+
+    uint64_t one = 1;
+    if (write(reactor->wakefd, &one, sizeof(one)) < 0) {
+        // Ignored, see reactor_post()
+    }
+}
+
+void reactor_arm(struct reactor *reactor, struct timer *timer, time_t when)
+{
+    assert(reactor_is_current(reactor));
+    wheel_add(reactor->timers, timer, when);
+}
+
+void reactor_disarm(struct reactor *reactor, struct timer *timer)
+{
+    assert(reactor_is_current(reactor));
+    wheel_rm(reactor->timers, timer);
+}
+
+bool reactor_is_current(struct reactor *reactor)
+{
+    return (reactor != NULL && current_reactor == reactor);
+}
+
+/* Run all of the tasks that other threads have posted to the reactor */
+static void run_tasks(void *arg, UNUSED uint32_t events)
+{
+    struct reactor *reactor = arg;
+    uint64_t count;
+
+    // Reset the eventfd before looking at the queue, anything posted after
+    // this point wakes us up again
+    if (read(reactor->wakefd, &count, sizeof(count)) < 0) {
+        // Nothing to read, tasks may still be waiting
+    }
+
+    struct task *task;
+    while ((task = queue_pop(reactor->tasks)) != NULL) {
+        task->func(task->arg);
+        free(task);
+    }
+
+    run_handoffs(reactor);
+}
+
+/* Run everything that's been given to reactor_handoff(), oldest first */
+static void run_handoffs(struct reactor *reactor)
+{
+    struct handoff *list = __atomic_exchange_n(
+        &reactor->handoffs,
+        NULL,
+        __ATOMIC_ACQUIRE
+    );
+
+    // They were pushed on to the front
+    struct handoff *oldest = NULL;
+    while (list != NULL) {
+        struct handoff *next = list->next;
+        list->next = oldest;
+        oldest = list;
+        list = next;
+    }
+
+    // The func may free the handoff, so it's done with first
+    while (oldest != NULL) {
+        struct handoff *handoff = oldest;
+        oldest = handoff->next;
+        handoff->func(handoff->arg);
+    }
+}
+
+/* This is where the reactor's thread starts, it never returns */
+static void *reactor_landing(void *arg)
+{
+    struct reactor *reactor = arg;
+
+    current_reactor = reactor;
+    pin(reactor);
+
+    if (reactor->ring != NULL)
+        uring_loop(reactor);
+    else
+        epoll_loop(reactor);
+
+    return NULL;
+}
+
+/* Wait for the fds to be ready and call their watch's func, forever */
+static void epoll_loop(struct reactor *reactor)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(
+            reactor->epfd,
+            events,
+            ARRSIZE(events),
+            1000 /* ms, for the tick */
+        );
+
+        if (n < 0 && errno != EINTR)
+            panic("epoll_wait() failed: %d\n", errno);
+
+        for (int i = 0; i < n; i++) {
+            struct watch *watch = events[i].data.ptr;
+            if (watch->dead == true)
+                continue;
+            if (watch->type == watch_accept)
+                accept_all(watch);
+            else
+                watch->func(watch->arg, events[i].events);
+        }
+
+        bury_dead(reactor);
+        run_tick(reactor);
+    }
+}
+
+/* Accept every client waiting on an epoll reactor's listening socket */
+static void accept_all(struct watch *watch)
+{
+    while (watch->dead == false) {
+        int fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (fd < 0 && accept_failed(errno) == false)
+            continue;
+
+        watch->accept(watch->arg, fd);
+
+        // Out of fds or memory, the next client to connect tries again
+        if (fd < 0)
+            return;
+    }
+}
+
+/* Send everything queued and wait for the completions, forever. Whatever
+ * the completions queue goes with the next wait */
+static void uring_loop(struct reactor *reactor)
+{
+    if (uring_enable(reactor->ring) < 0)
+        panic("Failed to enable io_uring: %d\n", errno);
+
+    while (1) {
+        if (uring_wait(reactor->ring, 1000 /* ms, for the tick */) < 0)
+            panic("io_uring_enter() failed: %d\n", errno);
+
+        // Copied out so the kernel can reuse the slot while it's handled
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(reactor->ring)) != NULL) {
+            struct io_uring_cqe copy = *cqe;
+            uring_seen(reactor->ring);
+            complete(reactor, &copy);
+        }
+
+        retry_cancels(reactor);
+        bury_dead(reactor);
+        run_tick(reactor);
+    }
+}
+
+/* Pin the calling thread to the reactor's core, if it has one. The thread
+ * keeps running wherever it likes if that core isn't available */
+static void pin(struct reactor *reactor)
+{
+    if (reactor->cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(reactor->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        // Ignored
+    }
+}
+
+/* Free all of the watches removed during the last batch of events, apart
+ * from those the kernel still has requests for (io_uring) */
+static void bury_dead(struct reactor *reactor)
+{
+    struct watch **curr = &reactor->dead;
+
+    while (*curr != NULL) {
+        struct watch *watch = *curr;
+        if (watch->inflight > 0) {
+            curr = &watch->next_dead;
+            continue;
+        }
+        *curr = watch->next_dead;
+        free(watch);
+    }
+}
+
+/* Set off the timers that are due and call the tick function, if at least a
+ * second has passed since the last time */
+static void run_tick(struct reactor *reactor)
+{
+    time_t now = time(NULL);
+    if (now == reactor->last_tick)
+        return;
+
+    reactor->last_tick = now;
+    unstall(reactor);
+    end_lingering(reactor);
+    wheel_advance(reactor->timers, now);
+    if (reactor->tick != NULL)
+        reactor->tick(reactor, reactor->tick_arg);
+    bury_dead(reactor);
+}
+
+/* Return a new watch on the fd, NULL on error */
+static struct watch *watch_init(int fd, enum watch_type type, void *arg)
+{
+    struct watch *ret = malloc(sizeof(struct watch));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct watch) {0};
+    ret->fd = fd;
+    ret->type = type;
+    ret->arg = arg;
+    return ret;
+}
+
+/* Start watching the watch's fd, return -1 on error */
+static int start_watch(struct reactor *reactor, struct watch *watch)
+{
+    if (reactor->ring == NULL) {
+        struct epoll_event ev = {
+            .events = watch->events | EPOLLET,
+            .data.ptr = watch,
+        };
+        return epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, watch->fd, &ev);
+    }
+
+    // Only the reactor's thread may touch the ring once it's running
+    assert(reactor->started == false || reactor_is_current(reactor));
+    return arm(reactor, watch);
+}
+
+/* Queue the (multishot) request for an io_uring watch, it stays in flight
+ * until the watch is cancelled or something goes wrong. Return -1 on
+ * error */
+static int arm(struct reactor *reactor, struct watch *watch)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(reactor->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->fd = watch->fd;
+    sqe->user_data = (uintptr_t) watch;
+
+    switch (watch->type) {
+        case watch_poll:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = wanted(watch);
+            break;
+
+        case watch_accept:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+
+        case watch_stream:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+            watch->receiving = true;
+            break;
+    }
+
+    watch->inflight += 1;
+    return 0;
+}
+
+/* Return the events a watch_poll is waiting for right now, a paused one
+ * isn't told about anything to read */
+static uint32_t wanted(struct watch *watch)
+{
+    return (watch->paused == true) ? watch->events & ~EPOLLIN : watch->events;
+}
+
+/* The watch's request has stopped and can't be queued again straight away
+ * (it would most likely fail the same way), it's armed again on the next
+ * tick. It counts as in flight until then */
+static void stall(struct reactor *reactor, struct watch *watch)
+{
+    watch->inflight += 1;
+    watch->receiving = (watch->type == watch_stream);
+    watch->next_stalled = reactor->stalled;
+    reactor->stalled = watch;
+}
+
+/* Arm every stalled watch again, unless it's been removed or paused (it's
+ * armed once it's carried on with then) */
+static void unstall(struct reactor *reactor)
+{
+    struct watch *watch = reactor->stalled;
+    reactor->stalled = NULL;
+
+    while (watch != NULL) {
+        struct watch *next = watch->next_stalled;
+        watch->inflight -= 1;
+        watch->receiving = false;
+        if (watch->dead == false && watch->paused == false
+            && arm(reactor, watch) < 0)
+            stall(reactor, watch);
+        watch = next;
+    }
+}
+
+/* Cancel the requests the kernel has in flight for the watch with the
+ * user_data "key". If the ring has no room even once what's queued has been
+ * submitted, it's tried again after the next batch of completions (see
+ * retry_cancels()). The watch isn't free()'d until the requests are gone */
+static void cancel(struct reactor *reactor, struct watch *watch, uint64_t key)
+{
+    if (watch->inflight == 0)
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(reactor->ring);
+    if (sqe == NULL) {
+        uring_submit(reactor->ring);
+        sqe = uring_get_sqe(reactor->ring);
+    }
+
+    if (sqe == NULL) {
+        watch->uncancelled = key;
+        return;
+    }
+
+    // The cancel's own completion (user_data 0) is ignored
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = key;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    watch->uncancelled = 0;
+}
+
+/* Cancel the requests of the removed watches that the ring didn't have room
+ * for, now that the completions have made some */
+static void retry_cancels(struct reactor *reactor)
+{
+    for (struct watch *w = reactor->dead; w != NULL; w = w->next_dead) {
+        if (w->uncancelled != 0)
+            cancel(reactor, w, w->uncancelled);
+    }
+}
+
+/* Cancel the sends of the removed watches that have had a whole tick to
+ * finish, the client isn't reading them */
+static void end_lingering(struct reactor *reactor)
+{
+    for (struct watch *w = reactor->dead; w != NULL; w = w->next_dead) {
+        // Left for the next tick if the other requests are still to be
+        // cancelled
+        if (w->lingering == true && w->dead_tick < reactor->last_tick
+            && w->uncancelled == 0) {
+            w->lingering = false;
+            cancel(reactor, w, (uintptr_t) w | SEND_TAG);
+        }
+    }
+}
+
+/* Hand a completion to the watch it's for */
+static void complete(struct reactor *reactor, struct io_uring_cqe *cqe)
+{
+    if (cqe->user_data == 0)
+        return;
+
+    struct watch *watch = (void *) (uintptr_t) (cqe->user_data & ~SEND_TAG);
+
+    // The last completion of a request doesn't have F_MORE
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+        watch->inflight -= 1;
+
+    // The caller is waiting on this even if the watch has gone
+    if (cqe->user_data & SEND_TAG) {
+        errno = (cqe->res < 0) ? -cqe->res : 0;
+        watch->sent(watch->arg, (cqe->res < 0) ? -1 : cqe->res);
+        return;
+    }
+
+    switch (watch->type) {
+        case watch_poll:
+            polled(reactor, watch, cqe);
+            break;
+
+        case watch_accept:
+            accepted(reactor, watch, cqe);
+            break;
+
+        case watch_stream:
+            received(reactor, watch, cqe);
+            break;
+    }
+}
+
+/* The fd of a reactor_add() watch is ready. The multishot poll is armed
+ * again if it stopped on its own */
+static void polled
+(
+    struct reactor *reactor,
+    struct watch *watch,
+    struct io_uring_cqe *cqe
+)
+{
+    if (watch->dead == false && cqe->res > 0)
+        watch->func(watch->arg, cqe->res);
+
+    if ((cqe->flags & IORING_CQE_F_MORE) || watch->dead == true)
+        return;
+
+    if (cqe->res < 0 || arm(reactor, watch) < 0)
+        stall(reactor, watch);
+}
+
+/* A client has been accepted by a reactor_accept() watch. The multishot
+ * accept stops when accepting fails, it's tried again on the next tick */
+static void accepted
+(
+    struct reactor *reactor,
+    struct watch *watch,
+    struct io_uring_cqe *cqe
+)
+{
+    if (watch->dead == true) {
+        // Accepted after the watch was removed, nobody wants it
+        if (cqe->res >= 0)
+            close(cqe->res);
+        return;
+    }
+
+    if (cqe->res >= 0) {
+        watch->accept(watch->arg, cqe->res);
+    } else if (accept_failed(-cqe->res) == true) {
+        errno = -cqe->res;
+        watch->accept(watch->arg, -1);
+    }
+
+    if ((cqe->flags & IORING_CQE_F_MORE) || watch->dead == true)
+        return;
+
+    if (cqe->res < 0 || arm(reactor, watch) < 0)
+        stall(reactor, watch);
+}
+
+/* Data has arrived for a reactor_stream() watch in one of the provided
+ * buffers, which goes back to the kernel as soon as it's been handed on.
+ * The multishot receive stops at the end of the stream, when it's cancelled
+ * by reactor_pause(), or early if the kernel ran out of buffers. It's armed
+ * again then unless the watch is paused */
+static void received
+(
+    struct reactor *reactor,
+    struct watch *watch,
+    struct io_uring_cqe *cqe
+)
+{
+    char *buf = NULL;
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        buf = uring_buf(reactor->ring, bid);
+
+    if (watch->dead == false && cqe->res >= 0) {
+        watch->recv(watch->arg, buf, cqe->res);
+    } else if (watch->dead == false && cqe->res != -ENOBUFS
+               && cqe->res != -ECANCELED) {
+        errno = -cqe->res;
+        watch->recv(watch->arg, NULL, -1);
+    }
+
+    if (buf != NULL)
+        uring_put_buf(reactor->ring, bid);
+
+    if (watch->dead == true)
+        return;
+
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        // The ring had no room for the pause's cancel last time
+        if (watch->paused == true && watch->uncancelled != 0)
+            cancel(reactor, watch, watch->uncancelled);
+        return;
+    }
+
+    watch->receiving = false;
+    if (watch->paused == true)
+        return;
+
+    // Not the end of the stream or a failed socket
+    bool more = (cqe->res > 0 || cqe->res == -ENOBUFS
+                 || cqe->res == -ECANCELED);
+    if (more && arm(reactor, watch) < 0)
+        stall(reactor, watch);
+}
+
+/* Return true if accept(2) failing with "err" is worth telling the caller
+ * about, otherwise the client just went away before it was accepted */
+static bool accept_failed(int err)
+{
+    return (err != EINTR && err != ECONNABORTED);
+}
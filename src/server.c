@@ -7,38 +7,77 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <pthread.h>
-
 #include "connection.h"
+#include "ebr.h"
 #include "logger.h"
+#include "pool.h"
 #include "slogin.h"
+#include "synch.h"
 #include "util.h"
+#include "workers.h"
 
 /* For returning a service function pointer */
-typedef int (*service_handle)(int sock, struct tokens *, struct user *);
+typedef int (*service_handle)(struct connection *, struct tokens *, struct user *);
 typedef void (*log_handle)(struct tokens *, const char *);
 
+/* An event loop and the listening socket it accepts its own clients on. The
+ * sockets share the port (SO_REUSEPORT), the kernel spreads the clients
+ * between them */
+struct shard {
+    struct reactor *reactor;    /* Owns every connection accepted here */
+    int listen_sock;            /* The socket to listen on (i.e. the fd) */
+};
+
 static struct {
 
     /* User args */
     time_t block_duration;      /* How long to block a user */
     int port;                   /* Port to listen to connections */
     int timeout;                /* How long until a user gets kicked */
-
-    int listen_sock;            /* The socket to listen on (i.e. the fd) */
+    enum reactor_backend backend; /* How the reactors wait on the clients */
 
     struct list *users;         /* List of all valid users */
+    struct hash *names;         /* The users, indexed by username */
+    struct hash *ids;           /* The users, indexed by id */
 
-    struct list *connections;   /* All connections to clients */
+    struct registry *registry;  /* The connection of each logged in user */
+
+    struct shard shards[SERVER_REACTORS]; /* Event loops for clients */
+    struct workers *workers;    /* Run the slow commands, see offload() */
 
     time_t time_started;        /* The exact time the server started */
+    time_t last_stats;          /* When the slow client stats were printed */
+    struct conn_stats stats;    /* The slow client stats last printed */
+    unsigned long pool_gets;    /* Total pool_get()'s when last printed */
+    struct work_stats work;     /* The worker stats last printed */
 } server = {0};
 
+/* A message on its way to the receiver's reactor, see deploy_message() */
+struct delivery {
+    struct connection *conn;    /* The receiver's, holds a reference */
+    struct user *receiver;      /* Gets it in their backlog if it can't be
+                                 * queued on the connection */
+    char sender[MAX_UNAME];
+    char msg[MAX_MSG_LENGTH];
+};
+
+/* A command on its way through a worker, see offload() */
+struct command {
+    struct connection *conn;    /* Who asked, holds a reference */
+    struct user *user;          /* The user logged in on conn */
+    struct tokens *toks;        /* The command, free()'d by the worker */
+    service_handle service;     /* Runs it */
+    uint32_t id;                /* The client's request id, 0 if none */
+    int ret;                    /* What the service returned */
+    struct handoff done;        /* Brings it back to conn's reactor */
+};
+
 /* Helper functions */
 static void log_command(struct tokens *tokes, struct user *);
 static void message_logger(struct tokens *toks, const char *user_name);
@@ -49,33 +88,67 @@ static void block_logger(struct tokens *toks, const char *user_name);
 static void unblock_logger(struct tokens *toks, const char *user_name);
 static void logout_logger(struct tokens *toks, const char *user_name);
 static void startprivate_logger(struct tokens *toks, const char *user_name);
-static int message_service(int sock, struct tokens *toks, struct user *user);
-static int logout_service(int sock, struct tokens *toks, struct user *user);
+static int message_service(struct connection *, struct tokens *, struct user *);
+static int logout_service(struct connection *, struct tokens *, struct user *);
 static void usage (void);
-static int unblock_service(int sock, struct tokens *toks, struct user *user);
+static int unblock_service(struct connection *, struct tokens *, struct user *);
 static int init_users (void);
 static int init_args (const char *port, const char *dur, const char *timeout);
+static int init_backend(const char *name);
 static int init_server (void);
-static int deploy_full_ssp(int sock, struct connection *conn);
-static int send_default_ssp(int sock, enum status_code code);
-static int startprivate_service(int sock, struct tokens *toks, struct user *);
+static int open_listener(void);
+static void close_listeners(void);
+static int deploy_full_ssp(struct connection *conn, struct connection *recv);
+static int send_default_ssp(struct connection *conn, enum status_code code);
+static int startprivate_service(struct connection *, struct tokens *, struct user *);
 static void free_users (void);
-static int block_service(int sock, struct tokens *toks, struct user *user);
-static int dispatch_event (struct connection *conn);
-static void client_command_handler(int sock, struct user *user);
-static int set_timeout(int sock);
-static int timeout_user(int sock, struct user *user);
-static int whoelse_service (int sock, struct tokens *toks, struct user *user);
-static int whoelsesince_service (int sock, struct tokens *, struct user *user);
-static int broadcast_service (int sock, struct tokens *, struct user *user);
-static int ptr_cmp (void *a, void *b);
+static int block_service(struct connection *, struct tokens *, struct user *);
+static void accept_event(void *arg, int sock);
+static int dispatch_event (struct connection *conn, struct reactor *reactor);
+static int client_query(struct connection *conn, struct header, void *);
+static int login_query(struct connection *conn, struct header, void *);
+static int service_query(struct connection *, struct user *, struct header, void *);
+static int start_session(struct connection *conn, struct user *user);
+static int client_event(struct connection *conn, ssize_t len);
+static int handle_payloads(struct connection *conn, struct decoder *decoder);
+static void drop_conn(struct connection *conn);
+static int handle_backlog(struct connection *conn, struct user *user);
+static time_t idle_limit(struct connection *conn);
+static time_t idle_left(struct connection *conn);
+static void arm_idle(struct connection *conn);
+static void idle_timeout(void *arg);
+static int timeout_user(struct connection *conn, struct user *user);
+static int set_nonblocking(int sock);
+static void server_tick(struct reactor *reactor, void *arg);
+static void print_stats(void);
+static void count_gets(struct pool_stats *stats, void *arg);
+static void print_pool(struct pool_stats *stats, void *arg);
+static void print_lock_site(struct lock_site *site, void *arg);
+static int init_reactors (void);
+static int whoelse_service (struct connection *, struct tokens *, struct user *);
+static int whoelsesince_service (struct connection *, struct tokens *, struct user *);
+static int broadcast_service (struct connection *, struct tokens *, struct user *);
 static enum status_code deploy_message(struct user *r, struct user *s, const char *msg);
-
-/* The name of each command and the respective handle */
-struct {
+static int queue_message(struct connection *, const char *sender, const char *msg);
+static int post_message(struct connection *, struct user *, const char *, const char *);
+static void message_task(void *arg);
+static int add_name(const char *name, void *arg);
+static int send_name_list(struct connection *, struct name_list *);
+static int send_result(struct connection *conn, struct frame *frame);
+static int offload(struct connection *, struct user *, struct tokens *,
+    uint32_t, service_handle);
+static void command_task(void *arg);
+static void command_done(void *arg);
+static int resume(struct connection *conn, struct user *user, int ret);
+static int init_workers(void);
+
+/* The name of each command and the respective handle. The slow ones (or
+ * ones that might block) are offloaded to the workers */
+struct command_service {
     const char *name;
     service_handle service;
     log_handle logger;
+    bool offload;
 } command_services[] = {
     // WARNING: Do not change the order!!!
     {
@@ -91,7 +164,8 @@ struct {
     {
         .name = "whoelsesince",
         .service = whoelsesince_service,
-        .logger = whoelsesince_logger
+        .logger = whoelsesince_logger,
+        .offload = true
     },
     {
         .name = "whoelse",
@@ -172,132 +246,392 @@ static void startprivate_logger(struct tokens *toks, const char *user_name)
 static void usage (void)
 {
     fprintf(stderr,
-        "Usage: ./server <server_port> <block_duration> <timeout>\n"
+        "Usage: ./server <server_port> <block_duration> <timeout> "
+        "[epoll|io_uring]\n"
     );
     exit(1);
 }
 
-/* This is where the new thread starts.
- * This will do the username and password authentication for the server.
- * If the user can't be authenicated the thread is killed */
-static void *thread_landing (void *arg)
+/* Called by the connection once the client's bytes are in its decoder,
+ * every complete payload is handled straight away and a partial one waits
+ * for the rest. The connection is closed if the client has gone away,
+ * logged out or failed to log in. Return -1 once it's been closed */
+static int client_event(struct connection *conn, ssize_t len)
 {
-    struct connection *conn = arg;
-    int sock = conn_get_sock(conn);
-    struct user *curr_user;
-
-    // Send the ACK, unblock client
-    if (send_payload_sic(sock, init_success) < 0) {
-        conn_free(conn);
-        return NULL;
+    if (len > 0) {
+        conn_touch(conn);
+        if (handle_payloads(conn, conn_get_decoder(conn)) == 0)
+            return 0;
     }
 
-    curr_user = auth_user(sock, server.users);
-    if (curr_user == NULL) {
-        conn_free(conn);
-        return NULL;
+    drop_conn(conn);
+    return -1;
+}
+
+/* Handle every complete payload the decoder is holding, or up to the one
+ * that leaves the connection busy (see offload()). Return -1 if the
+ * connection should be closed, otherwise 0 */
+static int handle_payloads(struct connection *conn, struct decoder *decoder)
+{
+    struct header head;
+    void *payload;
+    int ret;
+
+    while (conn_is_busy(conn) == false) {
+        ret = decoder_next(decoder, &head, &payload);
+        if (ret <= 0)
+            return ret;
+
+        ret = client_query(conn, head, payload);
+        free(payload);
+        if (ret < 0)
+            return -1;
     }
-    conn_set_user(conn, curr_user);
 
-    if (conn_broad_log_on(server.connections, curr_user) < 0) {
-        conn_free(conn);
-        return NULL;
+    return 0;
+}
+
+/* Hand the payload to the login process or the command handler depending on
+ * if the client has logged in yet. Return -1 if the connection should be
+ * closed, otherwise 0 */
+static int client_query(struct connection *conn, struct header head, void *p)
+{
+    struct user *user = conn_get_user(conn);
+
+    if (user == NULL)
+        return login_query(conn, head, p);
+
+    if (service_query(conn, user, head, p) < 0) {
+        // The client has disappeared without saying good bye
+        user_log_off(user);
+        return -1;
     }
 
-    if (list_add(server.connections, conn) < 0) {
-        conn_free(conn);
-        return NULL;
+    if (user_is_logged_on(user) == false)
+        return -1;
+
+    return 0;
+}
+
+/* Move the login of the connection along by one payload. Once the user is
+ * logged in the command session is started. Return -1 if the connection
+ * should be closed, otherwise 0 */
+static int login_query(struct connection *conn, struct header head, void *p)
+{
+    struct login *login = conn_get_login(conn);
+
+    if (head.task_id == client_init_conn && p != NULL)
+        conn_set_cic(conn, *(struct cic_payload *) p);
+
+    bool handshake = login_waiting_init(login);
+    int ret = login_step(login, conn, server.names, head, p);
+    if (ret < 0)
+        return ret;
+
+    // Past the handshake the client has the usual timeout instead
+    if (handshake == true && login_waiting_init(login) == false)
+        arm_idle(conn);
+
+    if (ret == 0)
+        return ret;
+
+    struct user *user = login_get_user(login);
+    conn_set_login(conn, NULL);
+
+    if (start_session(conn, user) < 0) {
+        user_log_off(user);
+        return -1;
     }
 
-    set_timeout(sock);
+    return 0;
+}
+
+/* The user has just logged in on the connection. Let everybody know, and
+ * give the user the messages they missed. Return -1 on error */
+static int start_session(struct connection *conn, struct user *user)
+{
+    conn_set_user(conn, user);
+
+    if (conn_broad_log_on(server.registry, user) < 0)
+        return -1;
+
+    // The backlog is queued before anybody else can find the connection,
+    // otherwise their messages could arrive before the backlog
+    if (handle_backlog(conn, user) < 0)
+        return -1;
 
-    client_command_handler(sock, curr_user);
+    // The backlog goes out the way the login did, tagging starts after it
+    if (conn_get_cic(conn).flags & CIC_TAGGED)
+        conn_set_tagged(conn, true);
 
-    list_rm(server.connections, conn, ptr_cmp);
+    return registry_add(server.registry, conn);
+}
+
+/* Remove the connection from the server and close it. If the connection is
+ * being watched this must be called on the connection's reactor */
+static void drop_conn(struct connection *conn)
+{
+    registry_rm(server.registry, conn);
+
+    // The client went away (or was kicked) without logging out
+    struct user *user = conn_get_user(conn);
+    if (user != NULL && user_is_logged_on(user) == true)
+        user_log_off(user);
+
+    // Give the client whatever is still queued (e.g. why it's being dropped)
+    conn_flush(conn);
+
+    conn_unwatch(conn);
     conn_free(conn);
+    logs("Connection closed\n");
+}
+
+/* Called once a second by each reactor, after the timers that are due (see
+ * idle_timeout()) */
+static void server_tick(struct reactor *reactor, UNUSED void *arg)
+{
+    // Free whatever the readers have finished with, even if nothing else is
+    // being retired
+    ebr_collect();
 
-    logs("Connection closed... killing thread\n");
-    return NULL;
+    // One reactor is plenty to keep an eye on the stats
+    if (reactor == server.shards[0].reactor)
+        print_stats();
 }
 
-/* Set the timeout time for when the socket is receiving from the client */
-static int set_timeout(int sock)
+/* Print how often slow clients have had their pushes dropped (or have been
+ * kicked), and how the workers and pools are doing, if anything has changed
+ * in the last STATS_INTERVAL seconds. The lock stats are always printed (LOCK_STATS) */
+static void print_stats(void)
 {
-    struct timeval tv = sec_to_tv(server.timeout);
-    int ret = setsockopt(
-        sock,
-        SOL_SOCKET,     // Needed to edit socket api
-        SO_RCVTIMEO,    // Timeout on recv
-        (char *) &tv,
-        sizeof(struct timeval)
+    time_t now = time(NULL);
+    if (now - server.last_stats < STATS_INTERVAL)
+        return;
+    server.last_stats = now;
+
+    struct conn_stats stats;
+    conn_get_stats(&stats);
+    if (memcmp(&stats, &server.stats, sizeof(stats)) != 0) {
+        server.stats = stats;
+        logs("Slow clients: %lu slow, %lu dropped old, %lu dropped new, "
+            "%lu kicked\n",
+            stats.slow,
+            stats.dropped_old,
+            stats.dropped_new,
+            stats.kicked
+        );
+    }
+
+    struct work_stats work;
+    workers_get_stats(server.workers, &work);
+    if (memcmp(&work, &server.work, sizeof(work)) != 0) {
+        server.work = work;
+        logs("Workers: %d threads, %zu deep, %zu queued, %lu run, "
+            "%lu stolen, %lu refused\n",
+            work.nworkers,
+            work.depth,
+            work.queued,
+            work.done,
+            work.stolen,
+            work.refused
+        );
+    }
+
+    unsigned long gets = 0;
+    pool_traverse(count_gets, &gets);
+    if (gets != server.pool_gets) {
+        server.pool_gets = gets;
+        pool_traverse(print_pool, NULL);
+    }
+
+    lock_stats_traverse(print_lock_site, NULL);
+}
+
+/* Add the number of pool_get()'s to the count in arg */
+static void count_gets(struct pool_stats *stats, void *arg)
+{
+    unsigned long *gets = arg;
+    *gets += stats->hits + stats->misses;
+}
+
+/* Print the hits and misses of the pool */
+static void print_pool(struct pool_stats *stats, UNUSED void *arg)
+{
+    logs("Pool \"%s\": %lu hits, %lu misses, %zu objects of %zu bytes\n",
+        stats->name,
+        stats->hits,
+        stats->misses,
+        stats->nobjs,
+        stats->size
     );
+}
 
-    // This should never fail
-    assert(ret >= 0);
+/* Print how contended the lock taken at the site is */
+static void print_lock_site(struct lock_site *site, UNUSED void *arg)
+{
+    logs("Lock %s:%d: %lu acquires, %lu contended, %luus waiting, "
+        "%luus held\n",
+        site->file,
+        site->line,
+        site->acquires,
+        site->contended,
+        site->wait_ns / 1000,
+        site->hold_ns / 1000
+    );
+}
 
-    return ret;
+/* Return how long the connection may be idle for before it is kicked, zero
+ * if it may idle forever */
+static time_t idle_limit(struct connection *conn)
+{
+    struct login *login = conn_get_login(conn);
+
+    if (login != NULL && login_waiting_init(login) == true)
+        return HANDSHAKE_TIMEOUT;
+
+    return server.timeout;
+}
+
+/* Return the number of seconds until the connection has been idle (or
+ * kicked) for too long, zero if it already has, -1 if it may idle forever */
+static time_t idle_left(struct connection *conn)
+{
+    // It gets a chance to read the "slow_consumer"
+    time_t kicked = conn_kicked_time(conn);
+    if (kicked >= 0)
+        return (kicked < SLOW_GRACE) ? SLOW_GRACE - kicked : 0;
+
+    time_t limit = idle_limit(conn);
+    if (limit == 0)
+        return -1;
+
+    time_t left = limit - conn_idle_time(conn);
+    return (left > 0) ? left : 0;
+}
+
+/* Arm the connection's timer for when it could next have been idle for too
+ * long. Must be called on the connection's reactor */
+static void arm_idle(struct connection *conn)
+{
+    struct reactor *reactor = conn_get_reactor(conn);
+    struct timer *timer = conn_get_timer(conn);
+    time_t left = idle_left(conn);
+
+    if (left < 0)
+        reactor_disarm(reactor, timer);
+    else
+        reactor_arm(reactor, timer, time(NULL) + left);
+}
+
+/* The connection's timer has gone off. conn_touch() doesn't move the timer,
+ * so if the client has sent something since it was armed it's just armed
+ * again, otherwise the client is kicked */
+static void idle_timeout(void *arg)
+{
+    struct connection *conn = arg;
+    struct user *user = conn_get_user(conn);
+
+    if (idle_left(conn) != 0) {
+        arm_idle(conn);
+        return;
+    }
+
+    // Clients still logging in aren't expecting a command
+    if (conn_kicked_time(conn) >= 0)
+        logs("Slow client kicked\n");
+    else if (user != NULL)
+        timeout_user(conn, user);
+    else
+        logs("Login timed out\n");
+
+    drop_conn(conn);
+}
+
+/* Make reads and writes on the socket return EAGAIN instead of waiting.
+ * Return -1 on error */
+static int set_nonblocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL);
+    if (flags < 0)
+        return -1;
+
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 }
 
 /* This is called when the user wants to log out */
-static int logout_service(int sock, UNUSED struct tokens *t, struct user *user)
+static int logout_service
+(
+    struct connection *conn,
+    UNUSED struct tokens *t,
+    struct user *user
+)
 {
     user_log_off(user);
 
-    if (send_payload_scmd(sock, task_ready, 0 /* ignored */) < 0)
+    if (conn_send(conn, pack_payload_scmd(task_ready, 0 /* ignored */)) < 0)
         return -1;
 
-    conn_broad_log_off(server.connections, user);
+    conn_broad_log_off(server.registry, user);
     return 0;
 }
 
 /* This is called when the user wants to start a private connections and
  * needs details about the respective user. This includes port number
  * and IPv4 address */
-static int startprivate_service(int sock, struct tokens *toks, struct user *user)
+static int startprivate_service
+(
+    struct connection *conn,
+    struct tokens *toks,
+    struct user *user
+)
 {
-    if (send_payload_scmd(sock, task_ready, 0 /* ignored */) < 0)
-        return -1;
-
-    struct user *receiver = user_get_by_name(server.users, toks->toks[1]);
+    struct user *receiver = user_get_by_name(server.names, toks->toks[1]);
     if (receiver == NULL)
-        return send_default_ssp(sock, bad_uname);
+        return send_default_ssp(conn, bad_uname);
 
     if (user_equal(receiver, user) == true)
-        return send_default_ssp(sock, dup_error);
+        return send_default_ssp(conn, dup_error);
 
     if (user_on_blocklist(receiver, user) == true)
-        return send_default_ssp(sock, user_blocked);
+        return send_default_ssp(conn, user_blocked);
 
-    struct connection *conn = NULL;
-    if (conn_get_by_user(server.connections, receiver, &conn) < 0)
+    struct connection *recv = NULL;
+    if (conn_get_by_user(server.registry, receiver, &recv) < 0)
         return -1;
 
-    if (conn == NULL)
-        return send_default_ssp(sock, user_offline);
+    if (recv == NULL)
+        return send_default_ssp(conn, user_offline);
 
-    return deploy_full_ssp(sock, conn);
+    int ret = deploy_full_ssp(conn, recv);
+    conn_unref(recv);
+    return ret;
 }
 
-/* Deploy the full ssp payload to the receiver specified by the sock,
- * not the receiver specified by the conn */
-static int deploy_full_ssp(int sock, struct connection *conn)
+/* Deploy the full ssp payload to the client on the conn, with the details
+ * of the receiver specified by the recv */
+static int deploy_full_ssp(struct connection *conn, struct connection *recv)
 {
-    unsigned short port = conn_get_port(conn);
-    struct in_addr addr = conn_get_in_addr(conn);
-    return send_payload_ssp(sock, task_success, port, addr);
+    unsigned short port = conn_get_port(recv);
+    struct in_addr addr = conn_get_in_addr(recv);
+    return send_result(conn, pack_payload_ssp(task_success, port, addr));
 }
 
 /* Return a ssp_payload where the code is specified but the port and addr
  * fields are filled with trash */
-static int send_default_ssp(int sock, enum status_code code)
+static int send_default_ssp(struct connection *conn, enum status_code code)
 {
     int port = 0;
     struct in_addr addr = {0};
-    return send_payload_ssp(sock, code, port, addr);
+    return send_result(conn, pack_payload_ssp(code, port, addr));
 }
 
 /* The current user wants to block user toks->toks[1] */
-static int unblock_service(int sock, struct tokens *toks, struct user *user)
+static int unblock_service
+(
+    struct connection *conn,
+    struct tokens *toks,
+    struct user *user
+)
 {
     assert(toks->toks[1] != NULL);
 
@@ -305,23 +639,23 @@ static int unblock_service(int sock, struct tokens *toks, struct user *user)
     if (safe_name == NULL)
         return -1;
 
-    if (send_payload_scmd(sock, task_ready, 0 /* ignored */) < 0) {
-        free(safe_name);
-        return -1;
-    }
-
-    enum status_code code = user_unblock(server.users, user, safe_name);
+    enum status_code code = user_unblock(server.names, user, safe_name);
     if (code == server_error) {
         free(safe_name);
         return -1;
     }
 
     free(safe_name);
-    return send_payload_suu(sock, code);
+    return send_result(conn, pack_payload_suu(code));
 }
 
 /* The current user wants to block user toks->toks[1] */
-static int block_service(int sock, struct tokens *toks, struct user *user)
+static int block_service
+(
+    struct connection *conn,
+    struct tokens *toks,
+    struct user *user
+)
 {
     assert(toks->toks[1] != NULL);
 
@@ -329,59 +663,32 @@ static int block_service(int sock, struct tokens *toks, struct user *user)
     if (safe_name == NULL)
         return -1;
 
-    if (send_payload_scmd(sock, task_ready, 0 /* ignored */) < 0) {
-        free(safe_name);
-        return -1;
-    }
-
-    enum status_code code = user_block(server.users, user, safe_name);
+    enum status_code code = user_block(server.names, user, safe_name);
     if (code == server_error) {
         free(safe_name);
         return -1;
     }
 
     free(safe_name);
-    return send_payload_sbu(sock, code);
+    return send_result(conn, pack_payload_sbu(code));
 }
 
 /* Handle sending the client the result of the whoelse command */
 static int whoelse_service
 (
-    int sock,
+    struct connection *conn,
     UNUSED struct tokens *toks,
     struct user *user
 )
 {
-    struct list *whoelse_list = user_whoelse(server.users, user);
-    if (whoelse_list == NULL)
-        return -1;
-
-    int len = list_len(whoelse_list);
-    int ret = send_payload_scmd(sock, task_ready, len);
-    if (ret < 0) {
-        list_free(whoelse_list, free);
-        return -1;
-    }
-
-    while (list_is_empty(whoelse_list) == false) {
-        char *name = list_pop(whoelse_list);
-        if (send_payload_sw(sock, name) < 0) {
-            list_free(whoelse_list, free);
-            free(name);
-            return -1;
-        }
-        free(name);
-    }
-
-    list_free(whoelse_list, free);
-
-    return 0;
+    // Unless somebody logged on or off this is just a copy of the last reply
+    return conn_send(conn, user_whoelse(user));
 }
 
 /* Handle sending the client the result of the whoelsesince command */
 static int whoelsesince_service
 (
-    int sock,
+    struct connection *conn,
     struct tokens *toks,
     struct user *user
 )
@@ -389,48 +696,77 @@ static int whoelsesince_service
     time_t off_time;
     sscanf(toks->toks[1], "%ld", &off_time);
 
-    struct list *whoelse_list = user_whoelsesince(server.users, user, off_time);
-    if (whoelse_list == NULL)
+    struct name_list *names = name_list_init();
+    if (names == NULL)
         return -1;
 
-    int len = list_len(whoelse_list);
-    int ret = send_payload_scmd(sock, task_ready, len);
-    if (ret < 0) {
-        list_free(whoelse_list, free);
+    if (user_whoelsesince(user, off_time, add_name, names) < 0) {
+        name_list_free(names);
         return -1;
     }
 
-    while (list_is_empty(whoelse_list) == false) {
-        char *name = list_pop(whoelse_list);
-        if (send_payload_sws(sock, name) < 0) {
-            list_free(whoelse_list, free);
-            free(name);
-            return -1;
-        }
-        free(name);
+    return send_name_list(conn, names);
+}
+
+/* Add the name to the end of the name_list in arg. Return -1 on error */
+static int add_name(const char *name, void *arg)
+{
+    return name_list_add(arg, name);
+}
+
+/* Queue the task_ready (with the number of names) followed by the pages of
+ * the list, which is free()'d either way. Return -1 on error */
+static int send_name_list(struct connection *conn, struct name_list *names)
+{
+    uint32_t len = name_list_len(names);
+    uint32_t npages = LIST_PAGES(len);
+
+    // All of the frames are queued at once so nothing else can be sent to
+    // the client in the middle of the list
+    struct frame **frames = malloc(sizeof(struct frame *) * (npages + 1));
+    if (frames == NULL) {
+        name_list_free(names);
+        return -1;
     }
 
-    list_free(whoelse_list, free);
+    frames[0] = pack_payload_scmd(task_ready, len);
+    name_list_finish(names, &frames[1]);
 
-    return 0;
+    int ret = conn_send_many(conn, frames, npages + 1);
+    free(frames);
+    return ret;
+}
+
+/* Queue the task_ready followed by the "frame" with the result. They go in
+ * one group so nothing else reaches the client in between, and a tagged
+ * client gets them as a single reply. Return -1 on error */
+static int send_result(struct connection *conn, struct frame *frame)
+{
+    struct frame *frames[] = {
+        pack_payload_scmd(task_ready, 0 /* ignored */),
+        frame,
+    };
+    return conn_send_many(conn, frames, ARRSIZE(frames));
 }
 
 /* Used for the user to send another message to the user by the name
  * of "toks->toks[1]". The message is stored in "toks->toks[2]" */
-static int message_service(int sock, struct tokens *toks, struct user *user)
+static int message_service
+(
+    struct connection *conn,
+    struct tokens *toks,
+    struct user *user
+)
 {
-    if (send_payload_scmd(sock, task_ready, 0 /* ignored */) < 0)
-        return -1;
-
     if (user_uname_cmp(user, toks->toks[1]) == 0)
-        return send_payload_sdmr(sock, dup_error);
+        return send_result(conn, pack_payload_sdmr(dup_error));
 
-    struct user *receiver = user_get_by_name(server.users, toks->toks[1]);
+    struct user *receiver = user_get_by_name(server.names, toks->toks[1]);
     if (receiver == NULL)
-        return send_payload_sdmr(sock, bad_uname);
+        return send_result(conn, pack_payload_sdmr(bad_uname));
 
     if (user_on_blocklist(receiver, user) == true)
-        return send_payload_sdmr(sock, user_blocked);
+        return send_result(conn, pack_payload_sdmr(user_blocked));
 
     char *safe_msg = malloc(MAX_MSG_LENGTH);
     if (safe_msg == NULL)
@@ -445,10 +781,13 @@ static int message_service(int sock, struct tokens *toks, struct user *user)
     }
 
     free(safe_msg);
-    return send_payload_sdmr(sock, code);
+    return send_result(conn, pack_payload_sdmr(code));
 }
 
-/* Do the actual sending of the message */
+/* Do the actual sending of the message. The message is only queued on the
+ * receiver's connection, their reactor does the writing. If the receiver is
+ * on another reactor the message is handed to it (in order with the
+ * broadcasts, which go the same way) */
 static enum status_code deploy_message
 (
     struct user *receiver,
@@ -462,28 +801,93 @@ static enum status_code deploy_message
     if (sender_name == NULL)
         return kill_me_now;
 
-    if (conn_get_by_user(server.connections, receiver, &recv_conn) < 0)
-        return -1;
-
-    if (recv_conn == NULL) {
-        if (user_add_to_backlog(receiver, sender_name, msg) < 0)
-            return kill_me_now;
-        return msg_stored;
+    if (conn_get_by_user(server.registry, receiver, &recv_conn) < 0) {
+        pool_strfree(sender_name);
+        return kill_me_now;
     }
 
-    int sock = conn_get_sock(recv_conn);
+    int ret = -1;
+    if (recv_conn != NULL) {
+        if (reactor_is_current(conn_get_reactor(recv_conn)) == true)
+            ret = queue_message(recv_conn, sender_name, msg);
+        else
+            ret = post_message(recv_conn, receiver, sender_name, msg);
+        conn_unref(recv_conn);
+    }
 
-    if (send_payload_scmd(sock, client_msg, 0 /* ignored */) < 0) {
-        free(sender_name);
-        return kill_me_now;
+    // The receiver may be offline, going offline or not keeping up. Either
+    // way they get the message next time they log in
+    enum status_code code = task_success;
+    if (ret < 0) {
+        ret = user_add_to_backlog(receiver, sender_name, msg);
+        if (ret < 0)
+            code = kill_me_now;
+        else if (ret > 0)
+            code = backlog_full;
+        else
+            code = msg_stored;
     }
 
-    if (send_payload_sdmm(sock, sender_name, msg) < 0) {
-        free(sender_name);
-        return kill_me_now;
+    pool_strfree(sender_name);
+    return code;
+}
+
+/* Queue the message from "sender" on the connection, return -1 on error */
+static int queue_message
+(
+    struct connection *conn,
+    const char *sender,
+    const char *msg
+)
+{
+    struct frame *frames[] = {
+        pack_payload_scmd(client_msg, 0 /* ignored */),
+        pack_payload_sdmm(sender, msg),
+    };
+    return conn_push(conn, push_message, frames, ARRSIZE(frames));
+}
+
+/* Hand the message to the reactor of the receiver's connection, which
+ * queues it or puts it in the receiver's backlog. Return -1 on error */
+static int post_message
+(
+    struct connection *conn,
+    struct user *receiver,
+    const char *sender,
+    const char *msg
+)
+{
+    struct delivery *delivery = malloc(sizeof(struct delivery));
+    if (delivery == NULL)
+        return -1;
+
+    conn_ref(conn);
+    delivery->conn = conn;
+    delivery->receiver = receiver;
+    snprintf(delivery->sender, sizeof(delivery->sender), "%s", sender);
+    snprintf(delivery->msg, sizeof(delivery->msg), "%s", msg);
+
+    if (reactor_post(conn_get_reactor(conn), message_task, delivery) < 0) {
+        conn_unref(conn);
+        free(delivery);
+        return -1;
     }
 
-    return task_success;
+    return 0;
+}
+
+/* Posted to the receiver's reactor by post_message(). The sender has been
+ * told the message was sent, so if it can't be queued it's kept for when
+ * the receiver next logs in */
+static void message_task(void *arg)
+{
+    struct delivery *delivery = arg;
+
+    if (queue_message(delivery->conn, delivery->sender, delivery->msg) < 0)
+        user_add_to_backlog(delivery->receiver, delivery->sender, delivery->msg);
+
+    conn_unref(delivery->conn);
+    free(delivery);
 }
 
 time_t server_uptime(void)
@@ -497,27 +901,32 @@ time_t server_block_dur(void)
 }
 
 /* Used to broadcast the message sent by the server to all other clients */
-static int broadcast_service(int sock, struct tokens *toks, struct user *user)
+static int broadcast_service
+(
+    struct connection *conn,
+    struct tokens *toks,
+    struct user *user
+)
 {
-    int num_blocked = conn_get_num_blocked(server.connections, user);
-    if (send_payload_scmd(sock, task_ready, num_blocked) < 0)
+    int num_blocked = conn_get_num_blocked(server.registry, user);
+    if (conn_send(conn, pack_payload_scmd(task_ready, num_blocked)) < 0)
         return -1;
 
     char *safe_msg = safe_strndup(toks->toks[1], MAX_MSG_LENGTH-1);
-    int ret = conn_broad_msg(server.connections, user, safe_msg);
+    int ret = conn_broad_msg(server.registry, user, safe_msg);
     free(safe_msg);
     return ret;
 }
 
 /* The client has given us a command which must be serviced, return a pointer
- * to the function that does the servicing */
-static service_handle lookup_service(const char *cmd)
+ * to the entry for the function that does the servicing */
+static struct command_service *lookup_service(const char *cmd)
 {
     unsigned int i;
     for (i = 0; i < ARRSIZE(command_services); i++) {
         const char *name = command_services[i].name;
         if (strncmp(cmd, name, strlen(name)-1) == 0) {
-            return command_services[i].service;
+            return &command_services[i];
         }
     }
 
@@ -527,13 +936,22 @@ static service_handle lookup_service(const char *cmd)
 /* The client has send me a question and I shall answer it */
 static int service_query
 (
-    int sock,
+    struct connection *conn,
     struct user *user,
     struct header head,
     void *payload
 )
 {
-    if (head.task_id != client_command) {
+    char *cmd;
+    uint32_t id;
+
+    if (head.task_id == client_command) {
+        cmd = ((struct ccmd_payload *) payload)->cmd;
+        id = 0;
+    } else if (head.task_id == client_request) {
+        cmd = ((struct creq_payload *) payload)->cmd;
+        id = ((struct creq_payload *) payload)->id;
+    } else {
         panic(
             "Received bad query: \"%s\"(%d)\n",
             id_to_str(head.task_id),
@@ -541,48 +959,156 @@ static int service_query
         );
     }
 
-    struct ccmd_payload *ccmd = payload;
-
     struct tokens *toks = NULL;
-    int ret = tokenise(ccmd->cmd, &toks);
+    int ret = tokenise(cmd, &toks);
     if (ret < 0) {
         return -1;
     }
 
+    // Whatever is sent back from here on answers request "id"
+    conn_reply_to(conn, id);
+
     if (toks == NULL) {
-        ret = send_payload_scmd(sock, bad_command, 0 /* ignored */);
+        ret = conn_send(conn, pack_payload_scmd(bad_command, 0 /* ignored */));
+        conn_reply_to(NULL, 0);
         return (ret < 0) ? -1 : 0;
     }
 
     log_command(toks, user);
 
-    service_handle service = lookup_service(toks->toks[0]);
-    assert(service != NULL);
+    struct command_service *cs = lookup_service(toks->toks[0]);
+    assert(cs != NULL && cs->service != NULL);
+
+    // If the workers are all full it's run here after all
+    if (cs->offload == true && offload(conn, user, toks, id, cs->service) == 0) {
+        conn_reply_to(NULL, 0);
+        return 0;
+    }
 
-    ret = service(sock, toks, user);
+    ret = cs->service(conn, toks, user);
     tokens_free(toks);
+    conn_reply_to(NULL, 0);
     return ret;
 }
 
+/* Hand the command to a worker so the reactor can get on with its other
+ * clients. Without a request "id" the connection is busy until it's done,
+ * so the client's next commands wait in the decoder and the replies stay in
+ * order. With one the client can tell the replies apart, so its next
+ * commands carry on and may well be answered first. Return -1 if the
+ * command couldn't be handed over */
+static int offload
+(
+    struct connection *conn,
+    struct user *user,
+    struct tokens *toks,
+    uint32_t id,
+    service_handle service
+)
+{
+    struct command *cmd = malloc(sizeof(struct command));
+    if (cmd == NULL)
+        return -1;
+
+    conn_ref(conn);
+    cmd->conn = conn;
+    cmd->user = user;
+    cmd->toks = toks;
+    cmd->service = service;
+    cmd->id = id;
+    cmd->ret = 0;
+
+    if (workers_submit(server.workers, command_task, cmd) < 0) {
+        conn_unref(conn);
+        free(cmd);
+        return -1;
+    }
+
+    // The worker can't finish before this, command_done() is run by us
+    if (id == 0)
+        conn_set_busy(conn, true);
+    return 0;
+}
+
+/* Run by a worker, see offload(). The replies can be queued from here, but
+ * the rest is up to the connection's reactor */
+static void command_task(void *arg)
+{
+    struct command *cmd = arg;
+
+    conn_reply_to(cmd->conn, cmd->id);
+    cmd->ret = cmd->service(cmd->conn, cmd->toks, cmd->user);
+    conn_reply_to(NULL, 0);
+    tokens_free(cmd->toks);
+
+    // The client is waiting on this, so it has to get there even if the
+    // reactor's mailbox is full
+    cmd->done = (struct handoff) {.func = command_done, .arg = cmd};
+    reactor_handoff(conn_get_reactor(cmd->conn), &cmd->done);
+}
+
+/* Posted to the connection's reactor once a worker has run the command.
+ * Whatever else the client has sent in the meantime is handled now (if it
+ * was left waiting, see offload()) */
+static void command_done(void *arg)
+{
+    struct command *cmd = arg;
+    struct connection *conn = cmd->conn;
+
+    // Only an untagged command leaves the connection busy, a tagged one can
+    // finish while that's still being run
+    if (cmd->id == 0)
+        conn_set_busy(conn, false);
+
+    // The client may have gone (or timed out) while it was being run
+    if (conn_is_closed(conn) == false && resume(conn, cmd->user, cmd->ret) < 0)
+        drop_conn(conn);
+
+    conn_unref(conn);
+    free(cmd);
+}
+
+/* Carry on with the connection the way client_query() would have if the
+ * service had returned "ret" there. Return -1 if the connection should be
+ * closed */
+static int resume(struct connection *conn, struct user *user, int ret)
+{
+    if (ret < 0) {
+        user_log_off(user);
+        return -1;
+    }
+
+    if (user_is_logged_on(user) == false)
+        return -1;
+
+    return handle_payloads(conn, conn_get_decoder(conn));
+}
+
 /* The client has just logged in and needs to receive their backlog of
  * messages */
-static int handle_backlog(int sock, struct user *user)
+static int handle_backlog(struct connection *conn, struct user *user)
 {
     int backlog_len = user_get_backlog_len(user);
-    if (send_payload_scmd(sock, backlog_msg, backlog_len) < 0)
+
+    struct frame **frames = malloc(sizeof(struct frame *) * (backlog_len + 1));
+    if (frames == NULL)
         return -1;
 
+    // A message still being pushed may be counted but not ready yet, it's
+    // left for next time
+    int nmsgs = 0;
     struct sdmm_payload *sdmm = NULL;
-    for (int i = 0; i < backlog_len; i++) {
-        sdmm = user_pop_backlog(user);
-        assert(sdmm != NULL);
-        if (send_payload_sdmm(sock, sdmm->sender, sdmm->msg) < 0) {
-            free(sdmm);
-            return -1;
-        }
+    while (nmsgs < backlog_len && (sdmm = user_pop_backlog(user)) != NULL) {
+        nmsgs += 1;
+        frames[nmsgs] = pack_payload_sdmm(sdmm->sender, sdmm->msg);
         free(sdmm);
     }
-    return 0;
+
+    frames[0] = pack_payload_scmd(backlog_msg, nmsgs);
+
+    int ret = conn_send_many(conn, frames, nmsgs + 1);
+    free(frames);
+    return ret;
 }
 
 /* Log the command to the display */
@@ -601,47 +1127,13 @@ static void log_command(struct tokens *toks, struct user *user)
             break;
         }
     }
-    free(user_name);
-}
-
-/* This handles all commands sent from the client to the server for commands,
- * not for spawning connections */
-static void client_command_handler(int sock, struct user *user)
-{
-    struct header head;
-    void *payload;
-    int ret;
-
-    if (handle_backlog(sock, user) < 0)
-        return;
-
-    while (1) {
-        ret = get_payload(sock, &head, &payload);
-
-        if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
-            timeout_user(sock, user);
-            return;
-        }
-
-        if (ret < 0)
-            return;
-
-        if (service_query(sock, user, head, payload) < 0) {
-            free (payload);
-            return;
-        }
-
-        free (payload);
-
-        if (user_is_logged_on(user) == false)
-            return;
-    }
+    pool_strfree(user_name);
 }
 
 /* The user has received a timeout and needs to be logged out */
-static int timeout_user(int sock, struct user *user)
+static int timeout_user(struct connection *conn, struct user *user)
 {
-    int ret = send_payload_scmd(sock, time_out, 0 /* ignored */);
+    int ret = conn_send(conn, pack_payload_scmd(time_out, 0 /* ignored */));
     user_log_off(user);
     return ret;
 }
@@ -656,6 +1148,13 @@ static int init_users (void)
     if (server.users == NULL)
         return -1;
 
+    server.names = user_name_index(0 /* grows as needed */);
+    server.ids = user_id_index(0 /* grows as needed */);
+    if (server.names == NULL || server.ids == NULL) {
+        free_users();
+        return -1;
+    }
+
     FILE *f = fopen(CRED_LIST, "r");
 
     while (fscanf(f, "%s %s", uname, pword) == 2) {
@@ -665,12 +1164,30 @@ static int init_users (void)
         if (user == NULL)
             goto init_users_fail;
 
-        if (list_add(server.users, user) < 0)
+        int ret = user_index(server.names, server.ids, user);
+        if (ret < 0) {
+            user_free(user);
+            goto init_users_fail;
+        }
+
+        // Only the first user with the name could ever log in
+        if (ret > 0) {
+            elogs("Duplicate user ignored: \"%s\"\n", uname);
+            user_free(user);
+        } else if (list_add(server.users, user) < 0) {
+            user_free(user);
             goto init_users_fail;
+        }
 
         zero_out(uname, MAX_UNAME);
         zero_out(pword, MAX_PWORD);
     }
+
+    // Every user now has their id, so there's a slot for each of them
+    server.registry = registry_init(user_max_id());
+    if (server.registry == NULL)
+        goto init_users_fail;
+
     fclose(f);
     return 0;
 
@@ -696,124 +1213,228 @@ static int init_args (const char *port, const char *dur, const char *timeout)
     return 0;
 }
 
-/* Initialise the server, connect and bind to port */
+/* Set how the reactors wait on the clients, SERVER_BACKEND if "name" is NULL.
+ * Return -1 if the name isn't one of "epoll" or "io_uring" */
+static int init_backend(const char *name)
+{
+    if (name == NULL)
+        server.backend = SERVER_BACKEND;
+    else if (strcmp(name, "epoll") == 0)
+        server.backend = reactor_epoll;
+    else if (strcmp(name, "io_uring") == 0)
+        server.backend = reactor_uring;
+    else
+        return -1;
+
+    return 0;
+}
+
+/* Initialise the server, a listening socket bound to the port for each
+ * reactor. Return -1 on error */
 static int init_server (void)
+{
+    for (int i = 0; i < SERVER_REACTORS; i++)
+        server.shards[i].listen_sock = -1;
+
+    for (int i = 0; i < SERVER_REACTORS; i++) {
+        server.shards[i].listen_sock = open_listener();
+        if (server.shards[i].listen_sock < 0) {
+            close_listeners();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Return a non-blocking socket listening on the port, which other sockets
+ * may listen on too. Return -1 on error */
+static int open_listener(void)
 {
     int ret = 0;
+    int one = 1;
 
     struct sockaddr_in server_address = {0};
     server_address.sin_family = AF_INET; // IPv4
     server_address.sin_port = htons(server.port); // Port
-    server.listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
 
-    server.connections = list_init();
-    if (server.connections == NULL)
+    if (sock < 0)
         return -1;
 
-    if (server.listen_sock < 0) {
-        list_free(server.connections, NULL);
+    // Accepted on a reactor, which must never wait
+    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (ret < 0 || set_nonblocking(sock) < 0) {
+        close(sock);
         return -1;
     }
 
     ret = bind(
-        server.listen_sock,
+        sock,
         (struct sockaddr *) &server_address,
         sizeof(server_address)
     );
     if (ret < 0) {
-        close(server.listen_sock);
-        list_free(server.connections, NULL);
+        close(sock);
         return -1;
     }
 
     ret = listen(
-        server.listen_sock,
+        sock,
         SERVER_BACKLOG
     );
     if (ret < 0) {
-        close(server.listen_sock);
-        list_free(server.connections, NULL);
+        close(sock);
         return -1;
     }
 
-    return 0;
+    return sock;
+}
+
+/* Close every listening socket that has been opened */
+static void close_listeners(void)
+{
+    for (int i = 0; i < SERVER_REACTORS; i++) {
+        if (server.shards[i].listen_sock >= 0)
+            close(server.shards[i].listen_sock);
+        server.shards[i].listen_sock = -1;
+    }
 }
 
 /* Free the list of users from memory (memory leaks are bad) */
 static void free_users (void)
 {
+    // The indexes don't own the users, the list does
+    registry_free(server.registry);
+    server.registry = NULL;
+    hash_free(server.names, NULL);
+    hash_free(server.ids, NULL);
+    server.names = NULL;
+    server.ids = NULL;
+
     if (server.users == NULL)
         return;
     list_free(server.users, (void*) user_free);
+    server.users = NULL;
 }
 
-static int ptr_cmp (void *a, void *b)
+/* A client has been accepted on the shard's listening socket, it belongs to
+ * the shard's reactor from the start */
+static void accept_event(void *arg, int sock)
 {
-    return (a - b);
+    struct shard *shard = arg;
+    struct connection *conn;
+    struct sockaddr_in client_addr = {0};
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    if (sock < 0) {
+        // Out of fds or memory, the next client to connect tries again
+        perror("accept: ");
+        return;
+    }
+
+    if (getpeername(sock, (struct sockaddr *) &client_addr,
+            &client_addr_len) < 0) {
+        close(sock);
+        return;
+    }
+
+    logs("New connection\n");
+
+    conn = conn_init ();
+    if (conn == NULL) {
+        close(sock);
+        return;
+    }
+    conn_set_sock(conn, sock);
+    conn_set_port(conn, client_addr.sin_port);
+    conn_set_in_addr(conn, client_addr.sin_addr);
+
+    if (dispatch_event (conn, shard->reactor) < 0) {
+        elogs("Failed to dispatch connection\n");
+        conn_free(conn);
+    }
 }
 
-/* Probe handler list to dispatch even and spawn new thread */
-static int dispatch_event (struct connection *conn)
+/* Give the connection to the reactor and start the login process, the client
+ * has HANDSHAKE_TIMEOUT seconds to start logging in. Must be called on the
+ * reactor. Return -1 on error, the connection is then still the caller's */
+static int dispatch_event (struct connection *conn, struct reactor *reactor)
 {
-    pthread_t *tid = malloc(sizeof(pthread_t));
-    if (tid == NULL)
+    conn_set_reactor(conn, reactor);
+    conn_set_slow_policy(conn, CONN_SLOW_POLICY, CONN_HIGH_WATER, CONN_LOW_WATER);
+
+    struct login *login = login_init();
+    if (login == NULL)
         return -1;
+    conn_set_login(conn, login);
 
-    conn_set_thread(conn, tid);
+    timer_init(conn_get_timer(conn), idle_timeout, conn);
 
-    if (pthread_create(tid, NULL, thread_landing, conn) != 0)
+    // The client may have already sent the client_init_conn, it's picked up
+    // as soon as we're back in the event loop
+    if (conn_watch(conn, client_event) < 0)
         return -1;
 
+    arm_idle(conn);
     return 0;
 }
 
-/* Where the actual magic happens.
- * Since the server must keep running it never returns. */
-static void run_server (void)
+/* Start the workers that run the slow commands for the reactors, return -1
+ * on error */
+static int init_workers(void)
 {
-    int sock;
-    struct connection *conn;
-    struct sockaddr_in client_addr = {0};
-    socklen_t client_addr_len = sizeof(client_addr);
-    while (1) {
-        sock = accept(
-            server.listen_sock,
-            (struct sockaddr *) &client_addr,
-            &client_addr_len
-        );
-        if (sock < 0) {
-            perror("accept: ");
-            continue;
-        }
+    server.workers = workers_init(SERVER_WORKERS, WORKER_DEPTH);
+    return (server.workers == NULL) ? -1 : 0;
+}
 
-        logs("New connection\n");
+/* Create and start the reactors that look after the clients, each pinned to
+ * a core and accepting on its own listening socket. They use the backend
+ * asked for if they can. Return -1 on error,
+ * otherwise 0 is returned */
+static int init_reactors (void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-        conn = conn_init ();
-        if (conn == NULL) {
-            conn_free(conn);
-            continue;
-        }
-        conn_set_sock(conn, sock);
-        conn_set_port(conn, client_addr.sin_port);
-        conn_set_in_addr(conn, client_addr.sin_addr);
-
-        struct cic_payload cic = {0};
-        if (recv_payload_cic(sock, &cic) < 0) {
-            conn_free(conn);
-            continue;
-        }
-        conn_set_cic(conn, cic);
+    for (int i = 0; i < SERVER_REACTORS; i++) {
+        struct shard *shard = &server.shards[i];
 
-        if (dispatch_event (conn) < 0) {
-            elogs("Failed to spawn thread\n");
-            conn_free(conn);
-            continue;
-        }
+        shard->reactor = reactor_init(server.backend);
+        if (shard->reactor == NULL)
+            return -1;
+
+        if (reactor_get_backend(shard->reactor) != server.backend)
+            elogs("io_uring isn't available, reactor %d is using epoll\n", i);
+
+        reactor_set_tick(shard->reactor, server_tick, NULL);
+        if (ncpus > 0)
+            reactor_set_cpu(shard->reactor, i % ncpus);
+
+        if (registry_add_shard(server.registry, shard->reactor) < 0)
+            return -1;
+
+        struct watch *watch = reactor_accept(
+            shard->reactor,
+            shard->listen_sock,
+            accept_event,
+            shard
+        );
+        if (watch == NULL)
+            return -1;
 
-        // The conn object is dispatched to a new thread and is no longer
-        // our responsibility.
-        conn = NULL;
+        if (reactor_start(shard->reactor) < 0)
+            return -1;
     }
+    return 0;
+}
+
+/* Where the actual magic happens. The reactors accept the clients and look
+ * after them from then on, so this thread has nothing left to do.
+ * Since the server must keep running it never returns. */
+static void run_server (void)
+{
+    while (1)
+        pause();
 }
 
 /* Set the time the server was started. This is used later for whoelsesince */
@@ -829,7 +1450,7 @@ static int set_start_time(void)
 int main (int argc, char **argv)
 {
 
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         fprintf(stderr, "Invalid number of arguments\n");
         usage ();
     }
@@ -839,6 +1460,11 @@ int main (int argc, char **argv)
         usage();
     }
 
+    if (init_backend ((argc == 5) ? argv[4] : NULL) < 0) {
+        fprintf(stderr, "Unknown backend \"%s\"\n", argv[4]);
+        usage();
+    }
+
     if (init_users () < 0) {
         elogs("Failed to initialise users list\n");
         elogs("Does \"" CRED_LIST "\" exist?\n");
@@ -855,8 +1481,21 @@ int main (int argc, char **argv)
         elogs("Failed to set the start time\n");
         elogs("Get a better computer\n");
         free_users();
-        close(server.listen_sock);
-        list_free(server.connections, (void*) conn_free);
+        close_listeners();
+        return 1;
+    }
+
+    if (init_workers () < 0) {
+        elogs("Failed to start the workers\n");
+        free_users();
+        close_listeners();
+        return 1;
+    }
+
+    if (init_reactors () < 0) {
+        elogs("Failed to start the reactors\n");
+        free_users();
+        close_listeners();
         return 1;
     }
 
@@ -5,94 +5,208 @@
  *                                         *
  *******************************************/
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "connection.h"
 #include "header.h"
 #include "logger.h"
+#include "pool.h"
+#include "slogin.h"
 #include "user.h"
 
-/* Query the user for their user name. Return the "user" if the user is legit
- * otherwise return NULL. NULL is also returned in case user is blocked,
- * already logged in, etc */
-static struct user *probe_user(int sock, struct list *users)
+/* Where the client is up to in the login process */
+enum login_state {
+    wait_init,                  /* Waiting for the client_init_conn */
+    wait_uname,                 /* Waiting for a (valid) username */
+    wait_pword,                 /* Waiting for the password of the user */
+};
+
+struct login {
+    enum login_state state;     /* What we expect from the client next */
+    struct user *user;          /* The user trying to log in */
+    int attempts;               /* Number of bad passwords so far */
+};
+
+/* Helper functions */
+static int handle_cic(struct login *, struct connection *, struct cic_payload *);
+static int handle_cua(struct login *, struct connection *, struct hash *, struct cua_payload *);
+static int handle_cpa(struct login *, struct connection *, struct cpa_payload *);
+static int deny_user(struct connection *conn, struct user *user);
+
+struct login *login_init(void)
 {
-    struct user *user;
-    struct cua_payload cua;
-
-    user = NULL;
-    while (1) {
-        cua = (struct cua_payload) {0};
-        if (recv_payload_cua(sock, &cua) < 0)
-            return NULL;
-        user = user_get_by_name(users, cua.username);
-
-        if (user != NULL) {
-            return (send_payload_sua(sock, init_success) < 0) ? NULL : user;
-        } else if (send_payload_sua(sock, bad_uname) < 0) {
-            return NULL;
-        }
-    };
+    struct login *ret = malloc(sizeof(struct login));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct login) {0};
+    ret->state = wait_init;
+    return ret;
 }
 
-/* Probe the user for credentials and sign in the user */
-static int sign_user(int sock, struct user *user)
+void login_free(struct login *login)
 {
-    char *name;
-    enum status_code code;
-    struct cpa_payload cpa;
+    free(login);
+}
 
-    for (int i = 0; i < NLOGIN_ATTEMPTS; i++) {
-        cpa = (struct cpa_payload) {0};
+bool login_waiting_init(struct login *login)
+{
+    assert(login != NULL);
+    return (login->state == wait_init);
+}
 
-        if (recv_payload_cpa(sock, &cpa) < 0)
-            return -1;
+struct user *login_get_user(struct login *login)
+{
+    assert(login != NULL);
+    return login->user;
+}
 
-        if (user_pword_cmp(user, cpa.password) == 0) {
-            code = user_log_on(user);
-            if (send_payload_spa(sock, code) < 0) {
-                user_log_off(user);
-                return -1;
-            }
-            return (code == init_success) ? (0) : (-1);
-        } else if (i < NLOGIN_ATTEMPTS - 1) {
-            if (send_payload_spa(sock, bad_pword) < 0)
-                return -1;
-        }
+int login_step
+(
+    struct login *login,
+    struct connection *conn,
+    struct hash *names,
+    struct header head,
+    void *payload
+)
+{
+    assert(login != NULL);
+
+    switch (login->state) {
+        case wait_init:
+            if (head.task_id != client_init_conn)
+                break;
+            if (head.data_len != sizeof(struct cic_payload))
+                break;
+            return handle_cic(login, conn, payload);
+
+        case wait_uname:
+            if (head.task_id != client_uname_auth)
+                break;
+            if (head.data_len != sizeof(struct cua_payload))
+                break;
+            return handle_cua(login, conn, names, payload);
+
+        case wait_pword:
+            if (head.task_id != client_pword_auth)
+                break;
+            if (head.data_len != sizeof(struct cpa_payload))
+                break;
+            return handle_cpa(login, conn, payload);
+    }
+
+    logs("Bad payload while logging in: \"%s\"(%d)\n",
+        id_to_str(head.task_id),
+        head.task_id
+    );
+    return -1;
+}
 
+/* The client has said hello, send the ACK to unblock the client. Clients
+ * that speak a different revision of the protocol are turned away */
+static int handle_cic
+(
+    struct login *login,
+    struct connection *conn,
+    struct cic_payload *cic
+)
+{
+    if (cic->version != PROTOCOL_VERSION) {
+        logs("Client speaks protocol %u, not %u\n",
+            cic->version,
+            PROTOCOL_VERSION
+        );
+        conn_send(conn, pack_payload_sic(init_failed));
+        return -1;
     }
 
-    if (user_is_logged_on(user) == true) {
-        send_payload_spa(sock, already_on);
-    } else {
-        send_payload_spa(sock, user_blocked);
-        user_set_blocked(user);
+    if (conn_send(conn, pack_payload_sic(init_success)) < 0)
+        return -1;
+
+    login->state = wait_uname;
+    return 0;
+}
+
+/* The client has given us their user name. If the user exists ask for the
+ * password, otherwise the client gets to try again */
+static int handle_cua
+(
+    struct login *login,
+    struct connection *conn,
+    struct hash *names,
+    struct cua_payload *cua
+)
+{
+    cua->username[MAX_UNAME-1] = '\0';
+
+    struct user *user = user_get_by_name(names, cua->username);
+    if (user == NULL)
+        return (conn_send(conn, pack_payload_sua(bad_uname)) < 0) ? -1 : 0;
+
+    if (conn_send(conn, pack_payload_sua(init_success)) < 0)
+        return -1;
+
+    login->user = user;
+    login->state = wait_pword;
+    return 0;
+}
+
+/* The client has given us the password, sign the user in if it's right.
+ * After too many bad passwords the user is blocked */
+static int handle_cpa
+(
+    struct login *login,
+    struct connection *conn,
+    struct cpa_payload *cpa
+)
+{
+    enum status_code code;
+    struct user *user = login->user;
+    char *name;
+
+    cpa->password[MAX_PWORD-1] = '\0';
+
+    if (user_pword_cmp(user, cpa->password) == 0) {
+        code = user_log_on(user);
+        if (conn_send(conn, pack_payload_spa(code)) < 0) {
+            if (code == init_success)
+                user_log_off(user);
+            return -1;
+        }
+
+        if (code != init_success)
+            return -1;
 
         name = user_get_uname(user);
-        printf("User blocked: \"%s\"\n", name);
-        free(name);
+        logs("User logged in: \"%s\"\n", name);
+        pool_strfree(name);
+        return 1;
     }
 
+    login->attempts += 1;
+    if (login->attempts < NLOGIN_ATTEMPTS)
+        return (conn_send(conn, pack_payload_spa(bad_pword)) < 0) ? -1 : 0;
+
+    deny_user(conn, user);
     return -1;
 }
 
-struct user *auth_user(int sock, struct list *users)
+/* The user has run out of password attempts, tell the client why they
+ * can't log in */
+static int deny_user(struct connection *conn, struct user *user)
 {
-    struct user *user;
     char *name;
 
-    user = probe_user(sock, users);
-    if (user == NULL) {
-        logs("Failed to initialising connection, closing thread\n");
-        return NULL;
-    }
+    if (user_is_logged_on(user) == true)
+        return conn_send(conn, pack_payload_spa(already_on));
 
-    if (sign_user(sock, user) < 0)
-        return NULL;
+    user_set_blocked(user, conn_get_reactor(conn));
 
     name = user_get_uname(user);
-    logs("User logged in: \"%s\"\n", name);
-    free(name);
+    printf("User blocked: \"%s\"\n", name);
+    pool_strfree(name);
 
-    return user;
+    return conn_send(conn, pack_payload_spa(user_blocked));
 }
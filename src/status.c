@@ -32,6 +32,8 @@ const char *code_to_str(enum status_code code)
         case backlog_msg:    return "backlog_msg";
         case user_unblocked: return "user_unblocked";
         case user_offline:   return "user_offline";
+        case slow_consumer:  return "slow_consumer";
+        case backlog_full:   return "backlog_full";
         default:             return "{Unkown code}";
     }
 }
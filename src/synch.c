@@ -8,14 +8,24 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include <pthread.h>
 
 #include "synch.h"
 
-struct lock {
-    pthread_mutex_t *mutex;
-};
+/* Every site a lock has been taken at (LOCK_STATS) */
+static struct lock_site *sites = NULL;
+
+/* Helper functions */
+static void acquire(struct lock *lock, struct lock_site *site);
+static void read_acquire(struct rwlock *rwlock, struct lock_site *site);
+static void write_acquire(struct rwlock *rwlock, struct lock_site *site);
+static void spin(struct lock *lock);
+static void count(struct lock_site *site, bool contended, unsigned long start);
+static void held(struct lock_site *site, unsigned long since);
+static unsigned long now_ns(void);
+static void cpu_relax(void);
 
 struct lock *lock_init(void)
 {
@@ -23,14 +33,7 @@ struct lock *lock_init(void)
     if (ret == NULL)
         return NULL;
 
-    ret->mutex = malloc(sizeof(pthread_mutex_t));
-    if (ret->mutex == NULL) {
-        free (ret);
-        return NULL;
-    }
-
-    if (pthread_mutex_init(ret->mutex, NULL) != 0) {
-        free (ret->mutex);
+    if (lock_setup(ret, lock_park) < 0) {
         free (ret);
         return NULL;
     }
@@ -38,22 +41,239 @@ struct lock *lock_init(void)
     return ret;
 }
 
-void lock_acquire(struct lock *lock)
+int lock_setup(struct lock *lock, enum lock_wait wait)
 {
     assert(lock);
-    pthread_mutex_lock(lock->mutex);
+
+    *lock = (struct lock) {0};
+    lock->wait = wait;
+
+    if (pthread_mutex_init(&lock->mutex, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+#ifdef LOCK_STATS
+#undef lock_acquire
+#undef rwlock_read
+#undef rwlock_write
+
+void lock_acquire_at(struct lock *lock, struct lock_site *site)
+{
+    acquire(lock, site);
+}
+
+void rwlock_read_at(struct rwlock *rwlock, struct lock_site *site)
+{
+    read_acquire(rwlock, site);
+}
+
+void rwlock_write_at(struct rwlock *rwlock, struct lock_site *site)
+{
+    write_acquire(rwlock, site);
+}
+#endif /* LOCK_STATS */
+
+void lock_acquire(struct lock *lock)
+{
+    acquire(lock, NULL);
 }
 
 void lock_release(struct lock *lock)
 {
     assert(lock);
-    pthread_mutex_unlock(lock->mutex);
+    held(lock->site, lock->since);
+    pthread_mutex_unlock(&lock->mutex);
 }
 
 void lock_free(struct lock *lock)
+{
+    if (lock == NULL)
+        return;
+
+    lock_teardown(lock);
+    free(lock);
+}
+
+void lock_teardown(struct lock *lock)
+{
+    assert(lock);
+
+    // Only fails if somebody is still holding it, which is a bug
+    int err = pthread_mutex_destroy(&lock->mutex);
+    assert(err != EBUSY);
+    (void) err;
+}
+
+int rwlock_setup(struct rwlock *rwlock)
+{
+    assert(rwlock);
+
+    *rwlock = (struct rwlock) {0};
+
+    if (pthread_rwlock_init(&rwlock->rwlock, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+void rwlock_read(struct rwlock *rwlock)
+{
+    read_acquire(rwlock, NULL);
+}
+
+void rwlock_write(struct rwlock *rwlock)
+{
+    write_acquire(rwlock, NULL);
+}
+
+void rwlock_release(struct rwlock *rwlock)
+{
+    assert(rwlock);
+
+    // Only the writer sets the site, readers leave it alone
+    struct lock_site *site = rwlock->site;
+    if (site != NULL) {
+        held(site, rwlock->since);
+        rwlock->site = NULL;
+    }
+
+    pthread_rwlock_unlock(&rwlock->rwlock);
+}
+
+void rwlock_teardown(struct rwlock *rwlock)
+{
+    assert(rwlock);
+
+    int err = pthread_rwlock_destroy(&rwlock->rwlock);
+    assert(err != EBUSY);
+    (void) err;
+}
+
+void lock_stats_traverse(void (*func)(struct lock_site *, void *), void *arg)
+{
+    assert(func != NULL);
+
+    struct lock_site *site = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+    for (; site != NULL; site = site->next)
+        func(site, arg);
+}
+
+/* Take the lock, the stats are put down to the site if it isn't NULL */
+static void acquire(struct lock *lock, struct lock_site *site)
 {
     assert(lock);
 
-    // Just like the Joker, I don't really have a plan.
-    while(pthread_mutex_destroy(lock->mutex) == EBUSY);
+    unsigned long start = (site != NULL) ? now_ns() : 0;
+
+    bool contended = (pthread_mutex_trylock(&lock->mutex) != 0);
+    if (contended == true)
+        spin(lock);
+
+    if (site != NULL) {
+        count(site, contended, start);
+        lock->site = site;
+        lock->since = now_ns();
+    }
+}
+
+/* Take the rwlock for reading */
+static void read_acquire(struct rwlock *rwlock, struct lock_site *site)
+{
+    assert(rwlock);
+
+    unsigned long start = (site != NULL) ? now_ns() : 0;
+
+    bool contended = (pthread_rwlock_tryrdlock(&rwlock->rwlock) != 0);
+    if (contended == true)
+        pthread_rwlock_rdlock(&rwlock->rwlock);
+
+    if (site != NULL)
+        count(site, contended, start);
+}
+
+/* Take the rwlock for writing */
+static void write_acquire(struct rwlock *rwlock, struct lock_site *site)
+{
+    assert(rwlock);
+
+    unsigned long start = (site != NULL) ? now_ns() : 0;
+
+    bool contended = (pthread_rwlock_trywrlock(&rwlock->rwlock) != 0);
+    if (contended == true)
+        pthread_rwlock_wrlock(&rwlock->rwlock);
+
+    if (site != NULL) {
+        count(site, contended, start);
+        rwlock->site = site;
+        rwlock->since = now_ns();
+    }
+}
+
+/* Somebody else has the lock, spin for a bit if the lock says to then go to
+ * sleep until it's ours */
+static void spin(struct lock *lock)
+{
+    if (lock->wait == lock_spin) {
+        for (int i = 0; i < LOCK_SPINS; i++) {
+            cpu_relax();
+            if (pthread_mutex_trylock(&lock->mutex) == 0)
+                return;
+        }
+    }
+
+    pthread_mutex_lock(&lock->mutex);
+}
+
+/* The lock was just taken at the site, put it down. The site goes on the
+ * list of sites the first time */
+static void count(struct lock_site *site, bool contended, unsigned long start)
+{
+    __atomic_fetch_add(&site->acquires, 1, __ATOMIC_RELAXED);
+
+    if (contended == true) {
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->wait_ns, now_ns() - start, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_load_n(&site->listed, __ATOMIC_RELAXED) == true)
+        return;
+    if (__atomic_exchange_n(&site->listed, true, __ATOMIC_RELAXED) == true)
+        return;
+
+    site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+        &sites,
+        &site->next,
+        site,
+        true,
+        __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED
+    ));
+}
+
+/* The lock taken at the site "since" is being released */
+static void held(struct lock_site *site, unsigned long since)
+{
+    if (site == NULL)
+        return;
+
+    __atomic_fetch_add(&site->hold_ns, now_ns() - since, __ATOMIC_RELAXED);
+}
+
+/* Nanoseconds since some point in the past */
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/* Tell the cpu we're spinning */
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
 }
@@ -0,0 +1,343 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* The ring is set up for one thread (SINGLE_ISSUER), which also runs the
+ * kernel's side of the requests while it waits (DEFER_TASKRUN) rather than
+ * being interrupted for it. These are also the newest flags used, a kernel
+ * that takes them has the multishot receives too (6.1) */
+#define SETUP_FLAGS ( \
+    IORING_SETUP_CQSIZE | \
+    IORING_SETUP_SUBMIT_ALL | \
+    IORING_SETUP_SINGLE_ISSUER | \
+    IORING_SETUP_DEFER_TASKRUN | \
+    IORING_SETUP_R_DISABLED \
+)
+
+/* Features the ring can't do without */
+#define NEED_FEATURES ( \
+    IORING_FEAT_SINGLE_MMAP | \
+    IORING_FEAT_NODROP | \
+    IORING_FEAT_EXT_ARG \
+)
+
+/* Completions there's room for per request. Multishot requests complete
+ * over and over, the kernel holds on to any that don't fit (NODROP) but
+ * that's slow */
+#define CQ_PER_SQ (4)
+
+struct uring {
+    int fd;                     /* From io_uring_setup() */
+
+    void *rings;                /* Both rings, shared with the kernel */
+    size_t rings_len;           /* Bytes mapped at rings */
+    struct io_uring_sqe *sqes;  /* The requests, indexed by sq_array */
+    size_t sqes_len;            /* Bytes mapped at sqes */
+
+    unsigned int *sq_head;      /* Next request the kernel takes */
+    unsigned int *sq_tail;      /* One past the last request it may take */
+    unsigned int *sq_array;     /* Which sqe is in each slot */
+    unsigned int sq_mask;       /* Slots - 1 */
+    unsigned int sq_entries;    /* Slots */
+    unsigned int sq_local;      /* sq_tail, including the requests that
+                                 * haven't been published yet */
+
+    unsigned int *cq_head;      /* Next completion to be looked at */
+    unsigned int *cq_tail;      /* One past the last completion */
+    unsigned int cq_mask;       /* Slots - 1 */
+    struct io_uring_cqe *cqes;  /* The completions */
+
+    struct io_uring_buf_ring *br; /* The provided buffers, see uring_buf() */
+    size_t br_len;              /* Bytes mapped at br */
+    char *data;                 /* Where the provided buffers point */
+    unsigned int nbufs;         /* Number of provided buffers */
+    unsigned int buf_len;       /* Bytes in each one */
+    uint16_t br_tail;           /* The next slot a buffer goes back into */
+};
+
+/* Helper functions */
+static int map_rings(struct uring *ring, struct io_uring_params *p);
+static int setup_bufs(struct uring *, unsigned int nbufs, unsigned int len);
+static int enter(struct uring *, unsigned int, unsigned int, void *, size_t);
+static void publish(struct uring *ring);
+static bool sq_full(struct uring *ring);
+
+struct uring *uring_init
+(
+    unsigned int entries,
+    unsigned int nbufs,
+    unsigned int buf_len
+)
+{
+    assert((entries & (entries - 1)) == 0);
+    assert((nbufs & (nbufs - 1)) == 0);
+
+    struct uring *ret = malloc(sizeof(struct uring));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct uring) {0};
+
+    struct io_uring_params p = {0};
+    p.flags = SETUP_FLAGS;
+    p.cq_entries = entries * CQ_PER_SQ;
+
+    ret->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ret->fd < 0) {
+        free(ret);
+        return NULL;
+    }
+
+    if ((p.features & NEED_FEATURES) != NEED_FEATURES
+        || map_rings(ret, &p) < 0
+        || setup_bufs(ret, nbufs, buf_len) < 0) {
+        uring_free(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+void uring_free(struct uring *ring)
+{
+    if (ring == NULL)
+        return;
+
+    // Closing the ring cancels whatever is still in flight
+    close(ring->fd);
+
+    if (ring->br != NULL)
+        munmap(ring->br, ring->br_len);
+    free(ring->data);
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->rings != NULL)
+        munmap(ring->rings, ring->rings_len);
+    free(ring);
+}
+
+int uring_enable(struct uring *ring)
+{
+    assert(ring != NULL);
+
+    return syscall(
+        __NR_io_uring_register,
+        ring->fd,
+        IORING_REGISTER_ENABLE_RINGS,
+        NULL,
+        0
+    );
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    assert(ring != NULL);
+
+    if (sq_full(ring) == true) {
+        publish(ring);
+        enter(ring, 0, 0, NULL, 0);
+        if (sq_full(ring) == true)
+            return NULL;
+    }
+
+    unsigned int i = ring->sq_local & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[i];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[i] = i;
+    ring->sq_local += 1;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring)
+{
+    assert(ring != NULL);
+
+    publish(ring);
+    return enter(ring, 0, 0, NULL, 0);
+}
+
+int uring_wait(struct uring *ring, int timeout)
+{
+    assert(ring != NULL);
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout / 1000,
+        .tv_nsec = (timeout % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t) (uintptr_t) &ts,
+    };
+
+    publish(ring);
+    unsigned int flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (enter(ring, 1, flags, &arg, sizeof(arg)) == 0)
+        return 0;
+
+    switch (errno) {
+        case ETIME:
+        case EINTR:
+            return 0;
+
+        // The completion ring overflowed, it's emptied before anything
+        // else is taken
+        case EBUSY:
+        case EAGAIN:
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+struct io_uring_cqe *uring_peek(struct uring *ring)
+{
+    assert(ring != NULL);
+
+    // Only we move the head, the kernel moves the tail
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_seen(struct uring *ring)
+{
+    assert(ring != NULL);
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char *uring_buf(struct uring *ring, uint16_t bid)
+{
+    assert(ring != NULL);
+    assert(bid < ring->nbufs);
+    return ring->data + (size_t) bid * ring->buf_len;
+}
+
+void uring_put_buf(struct uring *ring, uint16_t bid)
+{
+    assert(ring != NULL);
+    assert(bid < ring->nbufs);
+
+    unsigned int slot = ring->br_tail & (ring->nbufs - 1);
+    struct io_uring_buf *buf = &ring->br->bufs[slot];
+    buf->addr = (uint64_t) (uintptr_t) uring_buf(ring, bid);
+    buf->len = ring->buf_len;
+    buf->bid = bid;
+
+    // The buffer has to be filled in before the kernel can see it
+    ring->br_tail += 1;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Map the submission and completion rings (one mapping, SINGLE_MMAP) and the
+ * requests. Return -1 on error */
+static int map_rings(struct uring *ring, struct io_uring_params *p)
+{
+    size_t sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    size_t cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+    void *rings = mmap(NULL, ring->rings_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED)
+        return -1;
+    ring->rings = rings;
+
+    ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return -1;
+    ring->sqes = sqes;
+
+    char *base = rings;
+    ring->sq_head = (unsigned int *) (base + p->sq_off.head);
+    ring->sq_tail = (unsigned int *) (base + p->sq_off.tail);
+    ring->sq_array = (unsigned int *) (base + p->sq_off.array);
+    ring->sq_mask = *(unsigned int *) (base + p->sq_off.ring_mask);
+    ring->sq_entries = p->sq_entries;
+    ring->sq_local = *ring->sq_tail;
+
+    ring->cq_head = (unsigned int *) (base + p->cq_off.head);
+    ring->cq_tail = (unsigned int *) (base + p->cq_off.tail);
+    ring->cq_mask = *(unsigned int *) (base + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (base + p->cq_off.cqes);
+
+    return 0;
+}
+
+/* Register a ring of "nbufs" buffers of "len" bytes with the kernel and hand
+ * it every buffer. Return -1 on error */
+static int setup_bufs(struct uring *ring, unsigned int nbufs, unsigned int len)
+{
+    ring->nbufs = nbufs;
+    ring->buf_len = len;
+
+    ring->data = malloc((size_t) nbufs * len);
+    if (ring->data == NULL)
+        return -1;
+
+    // The ring itself must be page aligned
+    ring->br_len = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+        return -1;
+    ring->br = br;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t) (uintptr_t) br,
+        .ring_entries = nbufs,
+        .bgid = URING_BUF_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) < 0)
+        return -1;
+
+    for (unsigned int i = 0; i < nbufs; i++)
+        uring_put_buf(ring, i);
+
+    return 0;
+}
+
+/* Send the published requests to the kernel, then wait for "min_complete"
+ * completions if IORING_ENTER_GETEVENTS is in the flags. Return -1 on
+ * error */
+static int enter
+(
+    struct uring *ring,
+    unsigned int min_complete,
+    unsigned int flags,
+    void *arg,
+    size_t argsz
+)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int to_submit = *ring->sq_tail - head;
+
+    long ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+        flags, arg, argsz);
+    return (ret < 0) ? -1 : 0;
+}
+
+/* Let the kernel see every request handed out by uring_get_sqe() */
+static void publish(struct uring *ring)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+}
+
+/* Return true if there's no room for another request */
+static bool sq_full(struct uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return (ring->sq_local - head == ring->sq_entries);
+}
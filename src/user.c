@@ -14,68 +14,107 @@
 #include <string.h>
 #include <time.h>
 
+#include "hash.h"
+#include "idset.h"
 #include "list.h"
+#include "pool.h"
 #include "queue.h"
+#include "reactor.h"
 #include "server.h"
 #include "synch.h"
 #include "user.h"
 #include "util.h"
 
+/* The low bit of the presence is set while the user is logged on, the rest is
+ * the time they last logged on */
+#define ONLINE (1)
+
 struct user {
-    char uname[MAX_UNAME];
+    /* Changed by the login path and read by every thread, so these are only
+     * touched atomically. They share a cache line with nothing else */
+    _Alignas(CACHE_LINE) time_t presence;   /* (log on time << 1) | ONLINE,
+                                             * zero if never logged on */
+    time_t blocked_until;       /* When the block ends, zero if not blocked */
+
+    /* These never change after user_init(), so they're read without locks */
+    _Alignas(CACHE_LINE) char uname[MAX_UNAME];
     char pword[MAX_PWORD];
     uint32_t id;
-    time_t block_time;          /* Time the user was blocked, 0=never blocked */
-    bool logged_on;
-    time_t log_time;            /* Epoch time since user logged on */
-    struct lock *lock;          /* Prevent race conditions */
-    struct list *block_list;    /* The list of blocked users, all char*'s */
+
+    struct list_link login;     /* On the logins list, see user_log_on() */
+    struct list_link online;    /* On the online list while logged on */
+
+    struct idset *blocked;      /* The ids of the users this user blocks, it
+                                 * has its own lock for changes */
     struct queue *backlog;      /* Backlog of messages to send the client when
-                                 * they log in */
+                                 * they log in, NULL until the first one */
+
+    struct timer unblock;       /* Ends the block, see user_set_blocked() */
+    struct reactor *reactor;    /* The reactor the unblock timer is armed on */
 };
 
 /* Unique counter for all of the users, so that they don't need to be
  * identified by username each time */
 static uint32_t user_count = 1;
 
+/* Everyone who has logged on, in the order they last logged on. Logging on
+ * moves the user to the end, so whoelsesince only walks back as far as the
+ * window it was asked for */
+static struct {
+    struct ilist list;          /* Of each user's login link */
+    struct lock lock;           /* Held to change the list or log on */
+} logins = {
+    .list = ILIST_INITIALIZER(logins.list),
+    .lock = LOCK_INITIALIZER,
+};
+
+/* The whoelse reply for everybody online, built once and shared until
+ * somebody logs on or off */
+struct roster {
+    int refs;                   /* References held, free()'d at zero */
+    unsigned long version;      /* The online.version it was built from */
+    uint32_t len;               /* Number of users online */
+    const char **names;         /* The name of each user online */
+    struct frame **pages;       /* The names packed, LIST_PAGES(len) pages */
+};
+
+/* Everyone who is logged on. The version is bumped whenever somebody logs on
+ * or off, which is what tells whoelse the roster is out of date */
+static struct {
+    struct ilist list;          /* Of each online user's online link */
+    unsigned long version;      /* Bumped when the list changes */
+    struct roster *roster;      /* The last roster built, may be out of date */
+    struct lock lock;           /* Held to touch any of the above */
+} online = {
+    .list = ILIST_INITIALIZER(online.list),
+    .lock = LOCK_INITIALIZER,
+};
+
 /* Helper functions */
-static int name_cmp(void *n1, void *n2);
-static void rm_name_from_list(struct list *list, const char *name);
-static bool already_blocked(struct list *block_list, const char *victim);
 static struct sdmm_payload *generate_sdmm(const char *name, const char *msg);
-static int add_to_block_list(struct list *block_list, const char *name);
-static bool valid_whoelse(struct user *user, struct user *execption);
-static int add_username_to_list(struct list *name_list, struct user *curr_user);
-static bool valid_whoelsesince (struct user *curr, struct user *exce, time_t offt);
-static bool has_logged_on_recently(struct user *user, time_t off_time);
-static int uname_cmp_wrapper(void *n1, void *n2);
-static bool has_logged_on(struct user *user);
+static struct queue *get_backlog(struct user *user);
+static struct roster *get_roster(void);
+static struct roster *roster_init(unsigned long version);
+static void roster_unref(struct roster *roster);
+static struct frame *roster_reply(struct roster *roster, struct user *except);
+static time_t log_time(struct user *user);
+static void online_update(struct user *user);
+static void end_block(void *arg);
+static uint32_t name_hash(const void *key);
+static int name_match(void *item, const void *key);
+static uint32_t id_hash(const void *key);
+static int id_match(void *item, const void *key);
 
 struct user *user_init (const char uname[MAX_UNAME], const char pword[MAX_PWORD])
 {
-    struct user *ret = malloc(sizeof(struct user));
+    struct user *ret = aligned_alloc(CACHE_LINE, sizeof(struct user));
     if (!ret)
         return NULL;
 
     *ret = (struct user) {0};
 
-    ret->lock = lock_init();
-    if (ret->lock == NULL) {
-        free(ret);
-        return NULL;
-    }
-
-    ret->block_list = list_init();
-    if (ret->block_list == NULL) {
-        lock_free(ret->lock);
-        free(ret);
-        return NULL;
-    }
-
-    ret->backlog = queue_init();
-    if (ret->backlog == NULL) {
-        lock_free(ret->lock);
-        list_free(ret->block_list, NULL);
+    ret->blocked = idset_init();
+    if (ret->blocked == NULL) {
         free(ret);
         return NULL;
     }
@@ -86,8 +125,9 @@ struct user *user_init (const char uname[MAX_UNAME], const char pword[MAX_PWORD]
     memcpy(ret->pword, pword, MAX_PWORD);
     ret->pword[MAX_PWORD-1] = '\0';
 
-    ret->block_time = 0;
-    ret->logged_on = false;
+    ret->blocked_until = 0;
+    ret->presence = 0;
+    timer_init(&ret->unblock, end_block, ret);
 
     ret->id = user_count;
     user_count += 1;
@@ -103,34 +143,22 @@ void user_free (struct user *user)
     if (user == NULL)
         return;
 
-    struct lock *l = user->lock;
-    lock_acquire(l);
-
-    list_free(user->block_list, free);
+    idset_free(user->blocked);
     queue_free(user->backlog, free);
 
     free(user);
-
-    lock_release(l);
-    lock_free(l);
 }
 
 int user_uname_cmp (struct user *user, const char uname[MAX_UNAME])
 {
-    int ret;
-    lock_acquire(user->lock);
-    ret = strncmp(user->uname, uname, MAX_UNAME);
-    lock_release(user->lock);
-    return ret;
+    // The name never changes, so it's read without any locks
+    return strncmp(user->uname, uname, MAX_UNAME);
 }
 
 int user_pword_cmp (struct user *user, const char pword[MAX_PWORD])
 {
-    int ret;
-    lock_acquire(user->lock);
-    ret = strncmp(user->pword, pword, MAX_PWORD);
-    lock_release(user->lock);
-    return ret;
+    // Neither does the password
+    return strncmp(user->pword, pword, MAX_PWORD);
 }
 
 uint32_t user_getid (struct user *user)
@@ -138,90 +166,123 @@ uint32_t user_getid (struct user *user)
     return user->id;
 }
 
-struct user *user_get_by_name (struct list *users, const char uname[MAX_UNAME])
+struct hash *user_name_index(size_t size)
 {
-    int cmp (void *item, void *arg)
-    {
-        struct user *user = item;
-        char *name = arg;
-        return strncmp(user->uname, name, MAX_UNAME);
-    }
-    return list_get (users, cmp, (void*) uname);
+    return hash_init(size, name_hash, name_match);
 }
 
-void user_set_blocked(struct user *user)
+struct hash *user_id_index(size_t size)
 {
-    lock_acquire(user->lock);
-    user->block_time = time(NULL);
-    lock_release(user->lock);
+    return hash_init(size, id_hash, id_match);
 }
 
-char *user_get_uname(struct user *user)
+int user_index(struct hash *names, struct hash *ids, struct user *user)
 {
-    char *buff = malloc(MAX_UNAME);
-    if (buff == NULL)
-        return NULL;
+    assert(user != NULL);
+
+    // The name and id never change, no need for the lock
+    int ret = hash_add(names, user->uname, user);
+    if (ret != 0)
+        return ret;
+
+    return hash_add(ids, &user->id, user);
+}
+
+uint32_t user_max_id(void)
+{
+    return user_count - 1;
+}
+
+struct user *user_get_by_name (struct hash *names, const char uname[MAX_UNAME])
+{
+    return hash_get(names, uname);
+}
+
+struct user *user_get_by_id (struct hash *ids, uint32_t id)
+{
+    return hash_get(ids, &id);
+}
+
+void user_set_blocked(struct user *user, struct reactor *reactor)
+{
+    time_t dur = server_block_dur();
+    if (dur <= 0)
+        return;
+
+    // Whoever starts the block arms the timer. Blocking again before it
+    // ends only pushes the end back, the timer takes care of that
+    time_t until = time(NULL) + dur;
+    if (__atomic_exchange_n(&user->blocked_until, until, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    user->reactor = reactor;
+    reactor_arm(reactor, &user->unblock, until);
+}
 
-    lock_acquire(user->lock);
-    memcpy(buff, user->uname, MAX_UNAME);
-    lock_release(user->lock);
-    buff[MAX_UNAME-1] = '\0';
-    return buff;
+char *user_get_uname(struct user *user)
+{
+    // The name never changes, and always fits in a pooled string
+    return pool_strdup(user->uname);
 }
 
 enum status_code user_log_on(struct user *user)
 {
-    enum status_code ret;
     assert(user);
-    lock_acquire(user->lock);
-
-    if (time(NULL) - user->block_time < server_block_dur()) {
-        ret = user_blocked;
-    } else if (user->logged_on == true) {
-        ret = already_on;
-    } else {
-        user->logged_on = true;
-        user->log_time = time(NULL);
-        ret = init_success;
-    }
 
-    lock_release(user->lock);
-    return ret;
+    if (user_is_blocked(user) == true)
+        return user_blocked;
+
+    // The time is taken with the lock held, which keeps the logins in order
+    lock_acquire(&logins.lock);
+
+    // Logging on from two places at once, only one of them wins
+    time_t old = __atomic_load_n(&user->presence, __ATOMIC_ACQUIRE);
+    do {
+        if (old & ONLINE) {
+            lock_release(&logins.lock);
+            return already_on;
+        }
+    } while (!__atomic_compare_exchange_n(
+        &user->presence,
+        &old,
+        (time(NULL) << 1) | ONLINE,
+        true,
+        __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE
+    ));
+
+    ilist_rm(&logins.list, &user->login);
+    ilist_add(&logins.list, &user->login);
+    lock_release(&logins.lock);
+
+    online_update(user);
+    return init_success;
 }
 
 void user_log_off(struct user *user)
 {
-    lock_acquire(user->lock);
-    user->logged_on = false;
-    lock_release(user->lock);
+    // The time they logged on is kept for whoelsesince
+    time_t old = __atomic_fetch_and(
+        &user->presence,
+        ~(time_t) ONLINE,
+        __ATOMIC_RELEASE
+    );
+    if ((old & ONLINE) == 0)
+        return;
+
+    online_update(user);
 }
 
 bool user_is_logged_on(struct user *user)
 {
-    bool ret;
-
     assert(user != NULL);
-
-    lock_acquire(user->lock);
-    ret = user->logged_on;
-    lock_release(user->lock);
-
-    return ret;
+    return (__atomic_load_n(&user->presence, __ATOMIC_ACQUIRE) & ONLINE);
 }
 
 bool user_is_blocked(struct user *user)
 {
-    bool ret;
-    time_t dur_blocked;
-
     assert (user != NULL);
-
-    lock_acquire(user->lock);
-    dur_blocked = time(NULL) - user->block_time;
-    ret = (dur_blocked < server_block_dur());
-    lock_release(user->lock);
-
-    return ret;
+    return (__atomic_load_n(&user->blocked_until, __ATOMIC_ACQUIRE) != 0);
 }
 
 bool user_equal(struct user *user1, struct user *user2)
@@ -235,143 +296,141 @@ bool user_equal(struct user *user1, struct user *user2)
     return true;
 }
 
-struct list *user_whoelse(struct list *users, struct user *exception)
+struct frame *user_whoelse(struct user *exception)
 {
-    struct iter *iter = NULL;
-    struct list *name_list = NULL;
-
-    iter = list_iter_init(users);
-    if (iter == NULL)
-        goto user_whoelse_error;
-
-    name_list = list_init();
-    if (name_list == NULL)
-        goto user_whoelse_error;
-
-    while(iter_has_next(iter) == true) {
-        struct user *curr_user = iter_get(iter);
-
-        if (valid_whoelse(curr_user, exception) == false) {
-            iter_next(iter);
-            continue;
-        }
-
-        if (add_username_to_list(name_list, curr_user) < 0)
-            goto user_whoelse_error;
-
-        // Yeahhhh boiiii, This is C++ in the wild
-        iter_next(iter);
-    }
-
-    iter_free(iter);
-    return name_list;
+    struct roster *roster = get_roster();
+    if (roster == NULL)
+        return NULL;
 
-user_whoelse_error:
-    iter_free(iter);
-    list_free(name_list, free);
-    return NULL;
+    struct frame *ret = roster_reply(roster, exception);
+    roster_unref(roster);
+    return ret;
 }
 
-struct list *user_whoelsesince
+int user_whoelsesince
 (
-    struct list *users,
     struct user *exception,
-    time_t off_time
+    time_t off_time,
+    int (*func)(const char *name, void *arg),
+    void *arg
 )
 {
-    (void) off_time;
-    struct iter *iter = NULL;
-    struct list *name_list = NULL;
+    time_t since = time(NULL) - off_time;
+    struct list_link *link;
+    struct user **users = NULL;
+    int cap = 0, len = 0;
+    int ret = 0;
+
+    // Only the users are taken with the lock held, so logging on doesn't
+    // wait for func(). The first walk just counts the window so there's room
+    // for it, and it's walked again if more have logged on since
+    lock_acquire(&logins.lock);
+    while (1) {
+        len = 0;
+        ilist_for_each_reverse(&logins.list, link) {
+            struct user *curr_user = ilist_item(link, struct user, login);
+
+            // Everyone before this logged on even earlier
+            if (log_time(curr_user) < since)
+                break;
+
+            if (len < cap)
+                users[len] = curr_user;
+            len += 1;
+        }
 
-    iter = list_iter_init(users);
-    if (iter == NULL)
-        goto user_whoelsesince_error;
+        if (len <= cap)
+            break;
+        lock_release(&logins.lock);
 
-    name_list = list_init();
-    if (name_list == NULL)
-        goto user_whoelsesince_error;
+        free(users);
+        cap = len;
+        users = malloc(sizeof(struct user *) * cap);
+        if (users == NULL)
+            return -1;
 
-    while(iter_has_next(iter) == true) {
-        struct user *curr_user = iter_get(iter);
+        lock_acquire(&logins.lock);
+    }
+    lock_release(&logins.lock);
 
-        if (valid_whoelsesince(curr_user, exception, off_time) == false) {
-            iter_next(iter);
+    for (int i = 0; i < len; i++) {
+        if (users[i] == exception)
             continue;
-        }
-
-        if (add_username_to_list(name_list, curr_user) < 0)
-            goto user_whoelsesince_error;
 
-        iter_next(iter);
+        // The name never changes, so it's handed over as is
+        if (func(users[i]->uname, arg) < 0) {
+            ret = -1;
+            break;
+        }
     }
 
-    iter_free(iter);
-    return name_list;
-
-user_whoelsesince_error:
-    iter_free(iter);
-    list_free(name_list, free);
-    return NULL;
+    free(users);
+    return ret;
 }
 
 enum status_code user_block
 (
-    struct list *users,
+    struct hash *names,
     struct user *blocker,
     const char *victim_name
 )
 {
-    struct user *victim = user_get_by_name(users, victim_name);
+    struct user *victim = user_get_by_name(names, victim_name);
     if (victim == NULL)
         return bad_uname;
 
     if (user_uname_cmp(blocker, victim_name) == 0)
         return dup_error;
 
-    if (already_blocked(blocker->block_list, victim_name) == true)
-        return user_blocked;
-
-    if (add_to_block_list(blocker->block_list, victim_name) < 0)
-        return server_error;
-
-    return task_success;
+    switch (idset_add(blocker->blocked, victim->id)) {
+        case 0:
+            return task_success;
+        case 1:
+            return user_blocked;
+        default:
+            return server_error;
+    }
 }
 
 enum status_code user_unblock
 (
-    struct list *users,
+    struct hash *names,
     struct user *unblocker,
     const char *victim_name
 )
 {
-    struct user *victim = user_get_by_name(users, victim_name);
+    struct user *victim = user_get_by_name(names, victim_name);
     if (victim == NULL)
         return bad_uname;
 
     if (user_uname_cmp(unblocker, victim_name) == 0)
         return dup_error;
 
-    if (already_blocked(unblocker->block_list, victim_name) == false)
+    if (idset_rm(unblocker->blocked, victim->id) != 0)
         return user_unblocked;
 
-    rm_name_from_list(unblocker->block_list, victim_name);
     return task_success;
 }
 
 bool user_on_blocklist (struct user *reciver, struct user *sender)
 {
-    struct user *user = list_get(reciver->block_list, name_cmp, sender->uname);
-    return (user != NULL);
+    return idset_has(reciver->blocked, sender->id);
 }
 
 int user_add_to_backlog(struct user *user, const char *name, const char *msg)
 {
+    struct queue *backlog = get_backlog(user);
+    if (backlog == NULL)
+        return -1;
+
     struct sdmm_payload *sdmm = generate_sdmm(name, msg);
     if (sdmm == NULL)
         return -1;
 
-    if (queue_push(user->backlog, sdmm) < 0)
-        return -1;
+    if (queue_push(backlog, sdmm) < 0) {
+        free(sdmm);
+        return 1;
+    }
 
     return 0;
 }
@@ -379,13 +438,38 @@ int user_add_to_backlog(struct user *user, const char *name, const char *msg)
 int user_get_backlog_len(struct user *user)
 {
     assert(user != NULL);
-    return queue_len(user->backlog);
+    struct queue *backlog = __atomic_load_n(&user->backlog, __ATOMIC_ACQUIRE);
+    return (backlog != NULL) ? queue_len(backlog) : 0;
 }
 
 struct sdmm_payload *user_pop_backlog(struct user *user)
 {
     assert(user != NULL);
-    return queue_pop(user->backlog);
+    struct queue *backlog = __atomic_load_n(&user->backlog, __ATOMIC_ACQUIRE);
+    return (backlog != NULL) ? queue_pop(backlog) : NULL;
+}
+
+/* Return the user's backlog, it's made the first time somebody messages
+ * them while they're offline (most users never need one). Return NULL on
+ * error */
+static struct queue *get_backlog(struct user *user)
+{
+    struct queue *ret = __atomic_load_n(&user->backlog, __ATOMIC_ACQUIRE);
+    if (ret != NULL)
+        return ret;
+
+    struct queue *new = queue_init(BACKLOG_MAX);
+    if (new == NULL)
+        return NULL;
+
+    // Somebody else may be making one at the same time, theirs wins
+    if (__atomic_compare_exchange_n(&user->backlog, &ret, new, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == false) {
+        queue_free(new, NULL);
+        return ret;
+    }
+
+    return new;
 }
 
 /* Given the name (of the sender) and the message generate a sdmm_payload */
@@ -402,116 +486,199 @@ static struct sdmm_payload *generate_sdmm(const char *name, const char *msg)
     return sdmm;
 }
 
-/* Add the victim_name to the block list, return -1 on error, otherwise
- * return 0 */
-static int add_to_block_list(struct list *block_list, const char *name)
+/* Return when the user last logged on, zero if they never have */
+static time_t log_time(struct user *user)
 {
-    char *name_dup = alloc_copy(name, MAX_UNAME);
-    if (name_dup == NULL)
-        return -1;
-
-    if (list_add(block_list, name_dup) < 0) {
-        free(name_dup);
-        return -1;
-    }
-
-    return 0;
+    assert(user != NULL);
+    return __atomic_load_n(&user->presence, __ATOMIC_ACQUIRE) >> 1;
 }
 
-/* Return true of the "victim" is in the "blocked_list" */
-static bool already_blocked(struct list *block_list, const char *victim)
+/* The user has just logged on or off, put them on (or take them off) the
+ * online list to match. Whoever takes the lock last sees the latest
+ * presence, so a log off and a log on racing each other can't leave the
+ * list out of step with it */
+static void online_update(struct user *user)
 {
-    return !!list_get(block_list, uname_cmp_wrapper, (void *) victim);
+    lock_acquire(&online.lock);
+    ilist_rm(&online.list, &user->online);
+    if (user_is_logged_on(user) == true)
+        ilist_add(&online.list, &user->online);
+    online.version += 1;
+    lock_release(&online.lock);
 }
 
-/* Wrapper for some yummy void pointers to compare two usernames */
-static int uname_cmp_wrapper(void *n1, void *n2)
+/* Return a reference to a roster of whoever is online right now, it's only
+ * built if somebody has logged on or off since the last one. Return NULL on
+ * error */
+static struct roster *get_roster(void)
 {
-    return strncmp(n1, n2, MAX_UNAME);
+    lock_acquire(&online.lock);
+
+    struct roster *ret = online.roster;
+    if (ret == NULL || ret->version != online.version) {
+        ret = roster_init(online.version);
+        if (ret == NULL) {
+            lock_release(&online.lock);
+            return NULL;
+        }
+        roster_unref(online.roster);
+        online.roster = ret;
+    }
+
+    __atomic_fetch_add(&ret->refs, 1, __ATOMIC_RELAXED);
+    lock_release(&online.lock);
+    return ret;
 }
 
-/* Return true if the "curr_user" is valid for the whoelsesince command */
-static bool valid_whoelsesince
-(
-    struct user *curr_user,
-    struct user *exception,
-    time_t off_time
-)
+/* Build a roster of everybody on the online list, the caller holds the only
+ * reference. Must hold the online lock. Return NULL on error */
+static struct roster *roster_init(unsigned long version)
 {
-    if (user_equal(curr_user, exception) == true)
-        return false;
+    struct roster *ret = malloc(sizeof(struct roster));
+    if (ret == NULL)
+        return NULL;
 
-    if (server_uptime() < off_time && has_logged_on(curr_user) == true) {
-        return true;
+    uint32_t len = online.list.len;
+    *ret = (struct roster) {0};
+    ret->refs = 1;
+    ret->version = version;
+    ret->len = len;
+
+    // The names never change, so the roster just points at them
+    ret->names = malloc(sizeof(const char *) * (len + 1));
+    ret->pages = malloc(sizeof(struct frame *) * LIST_PAGES(len));
+    if (ret->names == NULL || ret->pages == NULL)
+        goto roster_init_error;
+
+    struct list_link *link;
+    uint32_t i = 0;
+    ilist_for_each(&online.list, link) {
+        struct user *user = ilist_item(link, struct user, online);
+        ret->names[i++] = user->uname;
     }
 
-    if (has_logged_on_recently(curr_user, off_time) == true) {
-        return true;
-    }
+    if (pack_name_list(ret->names, len, ret->pages) < 0)
+        goto roster_init_error;
 
-    return false;
-}
+    return ret;
 
-/* Return true if the user has logged on, return false if the user has
- * never logged on */
-static bool has_logged_on(struct user *user)
-{
-    assert(user != NULL);
-    return (user->log_time != 0);
+roster_init_error:
+    free(ret->names);
+    free(ret->pages);
+    free(ret);
+    return NULL;
 }
 
-/* Return true of the user has logged on in the last "off_time" seconds,
- * otherwise return false */
-static bool has_logged_on_recently(struct user *user, time_t off_time)
+/* Drop a reference to the roster, the last one free()'s it */
+static void roster_unref(struct roster *roster)
 {
-    assert(user != NULL);
-    time_t time_since_log_on = time(NULL) - user->log_time;
-    return (time_since_log_on <= off_time);
+    if (roster == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&roster->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    for (uint32_t i = 0; i < LIST_PAGES(roster->len); i++)
+        frame_free(roster->pages[i]);
+    free(roster->pages);
+    free(roster->names);
+    free(roster);
 }
 
-/* Add the username of curr_user to the name list. Return -1 on error,
- * zero is returned on success */
-static int add_username_to_list(struct list *name_list, struct user *curr_user)
+/* Return the whoelse reply (the task_ready and then the pages of names) for
+ * the user "except", which is everyone in the roster but them, as one frame.
+ * Only the page with their name is packed again. Return NULL on error */
+static struct frame *roster_reply(struct roster *roster, struct user *except)
 {
-    char *name = malloc(MAX_UNAME);
-    if (name == NULL)
-        return -1;
+    uint32_t npages = LIST_PAGES(roster->len);
+    struct frame **frames = malloc(sizeof(struct frame *) * (npages + 1));
+    if (frames == NULL)
+        return NULL;
 
-    memcpy(name, curr_user->uname, MAX_UNAME);
+    // The user asking is (almost always) online
+    uint32_t at = 0;
+    while (at < roster->len && roster->names[at] != except->uname)
+        at += 1;
+
+    frames[0] = pack_payload_scmd(task_ready, roster->len - (at < roster->len));
+    for (uint32_t i = 0; i < npages; i++)
+        frames[i + 1] = frame_ref(roster->pages[i]);
+
+    if (at < roster->len) {
+        uint32_t page = at / LIST_PAGE;
+        uint32_t first = page * LIST_PAGE;
+        uint32_t n = roster->len - first;
+        if (n > LIST_PAGE)
+            n = LIST_PAGE;
+
+        // Their page without them, the rest of the page moves up one
+        const char **names = malloc(sizeof(const char *) * n);
+        if (names != NULL) {
+            memcpy(names, &roster->names[first], sizeof(*names) * (at - first));
+            memcpy(
+                &names[at - first],
+                &roster->names[at + 1],
+                sizeof(*names) * (first + n - at - 1)
+            );
+        }
 
-    if (list_add(name_list, name) < 0) {
-        free(name);
-        return -1;
+        frame_free(frames[page + 1]);
+        frames[page + 1] = (names != NULL)
+            ? pack_payload_snl(names, n - 1, page + 1 < npages)
+            : NULL;
+        free(names);
     }
 
-    return 0;
+    // A NULL frame (from an error) makes this fail too
+    struct frame *ret = frame_join(frames, npages + 1);
+    free(frames);
+    return ret;
 }
 
-/* Remove name from list of names. The list is a list of char*'s, NOT users */
-static void rm_name_from_list(struct list *list, const char *name)
+/* The unblock timer has gone off, end the block unless it was pushed back
+ * in the meantime (see user_set_blocked()). Runs on user->reactor */
+static void end_block(void *arg)
 {
-    char *old_name = list_rm(list, (void *) name, name_cmp);
-    assert(old_name != NULL);
-    free(old_name);
+    struct user *user = arg;
+    time_t until = __atomic_load_n(&user->blocked_until, __ATOMIC_ACQUIRE);
+
+    // Once the block is cleared somebody else may start the next one, so
+    // the timer can't be touched after that
+    if (until <= time(NULL) && __atomic_compare_exchange_n(
+        &user->blocked_until,
+        &until,
+        0,
+        false,
+        __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE
+    ))
+        return;
+
+    reactor_arm(user->reactor, &user->unblock, until);
 }
 
-/* Return true if the user is valid for the whoelse command, otherwise
- * return false */
-static bool valid_whoelse(struct user *curr_user, struct user *exception)
+/* Hash the username for the name index */
+static uint32_t name_hash(const void *key)
 {
+    return hash_str(key, MAX_UNAME);
+}
 
-    if (user_is_logged_on(curr_user) == false)
-        return false;
-
-    if (user_equal(curr_user, exception) == true)
-        return false;
+/* Return 0 if the user has the username */
+static int name_match(void *item, const void *key)
+{
+    struct user *user = item;
+    return strncmp(user->uname, key, MAX_UNAME);
+}
 
-    return true;
+/* Hash the user id for the id index */
+static uint32_t id_hash(const void *key)
+{
+    return hash_u32(*(const uint32_t *) key);
 }
 
-/* Taking two users as void pointers, return 0 if they are equals, otherwise
- * 1 is return (to indicate they are different) */
-static int name_cmp(void *u1, void *u2)
+/* Return 0 if the user has the id */
+static int id_match(void *item, const void *key)
 {
-    return strncmp(u1, u2, MAX_UNAME);
+    struct user *user = item;
+    return (user->id == *(const uint32_t *) key) ? 0 : 1;
 }
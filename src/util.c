@@ -11,8 +11,12 @@
 #include <stdarg.h>
 #include <string.h>
 
+#include "pool.h"
 #include "util.h"
 
+/* The most tokens a command can have */
+#define MAX_TOKENS (3)
+
 /* The name of each valid command */
 static const char *cmd_names[] = {
     "message", "broadcast", "whoelsesince", "whoelse", "block", "unblock",
@@ -29,6 +33,14 @@ _Static_assert(
     "Separators and names don't match!"
 );
 
+/* The tokens and the array of strings, allocated together from a pool */
+struct tokens_buf {
+    struct tokens tokens;
+    char *strings[MAX_TOKENS];
+};
+
+static struct pool tokens_pool = POOL_INIT("tokens", struct tokens_buf);
+
 /* Helper functions */
 static const char *get_first_non_space(const char *line);
 static int get_max_seps(const char *line);
@@ -81,11 +93,12 @@ int tokenise(const char *line, struct tokens **toks)
 
     *toks = NULL;
 
-    struct tokens *tokens = malloc(sizeof(struct tokens));
-    if (tokens == NULL)
+    struct tokens_buf *buf = pool_get(&tokens_pool);
+    if (buf == NULL)
         return -1;
 
-    *tokens = (struct tokens) {0};
+    *buf = (struct tokens_buf) {0};
+    struct tokens *tokens = &buf->tokens;
 
     char *temp = strdup(line);
     if (temp == NULL) {
@@ -115,23 +128,20 @@ int tokenise(const char *line, struct tokens **toks)
         return 0;
     }
 
-    char **strings = calloc(n, sizeof(char *));
-    if (strings == NULL) {
-        tokens_free(tokens);
-        return -1;
-    }
+    assert(n <= MAX_TOKENS);
+    char **strings = buf->strings;
 
     temp = strdup(line);
 
     int i = 0;
     char *next = strtok_r(temp, " ", &saveptr);
-    strings[i++] = strdup(next);
+    strings[i++] = pool_strdup(next);
     while (i < n-1 && (next = strtok_r(NULL, " ", &saveptr)) != NULL)
-        strings[i++] = strdup(next);
+        strings[i++] = pool_strdup(next);
 
     if (i != n) {
         next += strlen(next) + 1;
-        strings[i] = strdup(next);
+        strings[i] = pool_strdup(next);
     }
     free(temp);
 
@@ -180,11 +190,11 @@ void tokens_free(struct tokens *t) {
         return;
 
     for (int i = 0; i < t->ntokens; i++) {
-        free(t->toks[i]);
+        pool_strfree(t->toks[i]);
     }
 
-    free(t->toks);
-    free(t);
+    // The tokens are the start of a tokens_buf
+    pool_put(&tokens_pool, t);
 }
 
 void zero_out(void *buffer, unsigned int len)
@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "util.h"
+#include "wheel.h"
+
+#define SLOT_BITS (6)
+#define SLOTS (1 << SLOT_BITS)
+#define LEVELS (4)
+
+/* The number of seconds one slot of the level covers */
+#define SPAN(level) ((time_t) 1 << (SLOT_BITS * (level)))
+
+struct wheel {
+    time_t now;                 /* The last second that has been handled */
+    struct ilist slots[LEVELS][SLOTS];
+};
+
+/* Helper functions */
+static void place(struct wheel *wheel, struct timer *timer);
+static void turn(struct wheel *wheel);
+static void take_slot(struct ilist *slot, struct ilist *into);
+
+struct wheel *wheel_init(time_t now)
+{
+    struct wheel *ret = malloc(sizeof(struct wheel));
+    if (ret == NULL)
+        return NULL;
+
+    ret->now = now;
+    for (int level = 0; level < LEVELS; level++) {
+        for (int i = 0; i < SLOTS; i++)
+            ilist_init(&ret->slots[level][i]);
+    }
+
+    return ret;
+}
+
+void wheel_free(struct wheel *wheel)
+{
+    free(wheel);
+}
+
+void timer_init(struct timer *timer, timer_func func, void *arg)
+{
+    assert(timer != NULL);
+    assert(func != NULL);
+
+    *timer = (struct timer) {0};
+    timer->func = func;
+    timer->arg = arg;
+}
+
+void wheel_add(struct wheel *wheel, struct timer *timer, time_t when)
+{
+    assert(wheel != NULL);
+    assert(timer != NULL && timer->func != NULL);
+
+    wheel_rm(wheel, timer);
+
+    // The current second has already been handled
+    timer->when = (when > wheel->now) ? when : wheel->now + 1;
+    place(wheel, timer);
+}
+
+void wheel_rm(UNUSED struct wheel *wheel, struct timer *timer)
+{
+    assert(timer != NULL);
+
+    if (timer->slot == NULL)
+        return;
+
+    ilist_rm(timer->slot, &timer->link);
+    timer->slot = NULL;
+}
+
+bool timer_armed(struct timer *timer)
+{
+    assert(timer != NULL);
+    return (timer->slot != NULL);
+}
+
+void wheel_advance(struct wheel *wheel, time_t now)
+{
+    assert(wheel != NULL);
+
+    while (wheel->now < now)
+        turn(wheel);
+}
+
+/* Put the timer in the lowest level that reaches timer->when. Timers further
+ * away than the top level reaches are parked in its furthest slot, and
+ * placed again when they come down from there */
+static void place(struct wheel *wheel, struct timer *timer)
+{
+    time_t when = timer->when;
+    int level = 0;
+
+    while (level < LEVELS - 1 && when - wheel->now >= SPAN(level + 1))
+        level += 1;
+
+    if (when - wheel->now >= SPAN(LEVELS))
+        when = wheel->now + SPAN(LEVELS) - 1;
+
+    int i = (when >> (SLOT_BITS * level)) & (SLOTS - 1);
+    timer->slot = &wheel->slots[level][i];
+    ilist_add(timer->slot, &timer->link);
+}
+
+/* Move the wheel on by a second. Every level that has come round to a new
+ * slot hands that slot's timers down, then the timers due this second go off */
+static void turn(struct wheel *wheel)
+{
+    time_t now = ++wheel->now;
+    struct ilist due;
+    struct list_link *link;
+
+    for (int level = 1; level < LEVELS; level++) {
+        if ((now & (SPAN(level) - 1)) != 0)
+            break;
+
+        int i = (now >> (SLOT_BITS * level)) & (SLOTS - 1);
+        take_slot(&wheel->slots[level][i], &due);
+        while ((link = ilist_pop(&due)) != NULL)
+            place(wheel, ilist_item(link, struct timer, link));
+    }
+
+    // Taken out first, a timer armed again from its func could otherwise
+    // land back in this slot and go off forever
+    take_slot(&wheel->slots[0][now & (SLOTS - 1)], &due);
+    while ((link = ilist_pop(&due)) != NULL) {
+        struct timer *timer = ilist_item(link, struct timer, link);
+        timer->slot = NULL;
+        timer->func(timer->arg);
+    }
+}
+
+/* Move every timer in the slot onto the (uninitialised) "into" list. They
+ * can still be stopped with wheel_rm() while they're there */
+static void take_slot(struct ilist *slot, struct ilist *into)
+{
+    struct list_link *link;
+
+    ilist_init(into);
+    while ((link = ilist_pop(slot)) != NULL) {
+        ilist_add(into, link);
+        ilist_item(link, struct timer, link)->slot = into;
+    }
+}
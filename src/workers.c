@@ -0,0 +1,297 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "deque.h"
+#include "pool.h"
+#include "queue.h"
+#include "util.h"
+#include "workers.h"
+
+struct job {
+    work_func func;             /* Called on a worker thread */
+    void *arg;                  /* Passed to func */
+};
+
+/* Only the worker's own thread writes to its counters, so they're kept on
+ * its own cache line */
+struct worker {
+    _Alignas(CACHE_LINE) struct workers *pool;
+    pthread_t thread;
+    struct queue *mailbox;      /* Jobs handed to this worker */
+    bool emptying;              /* Somebody is popping the mailbox */
+    struct deque *deque;        /* Jobs this worker is about to run */
+    unsigned int seed;          /* Picks who to steal from first */
+    unsigned long done;         /* Jobs run by this worker */
+    unsigned long stolen;       /* ... that were taken from another */
+};
+
+struct workers {
+    int nworkers;
+    size_t depth;               /* Room in each mailbox (and deque) */
+    struct worker *workers;
+    unsigned int next;          /* The next worker to hand a job to */
+    unsigned long refused;      /* Jobs nobody had room for */
+
+    int sleepers;               /* Workers waiting on wake */
+    pthread_mutex_t mutex;      /* Held to go to sleep or wake them up */
+    pthread_cond_t wake;        /* Signalled when there's work */
+};
+
+static struct pool job_pool = POOL_INIT("jobs", struct job);
+
+/* Helper functions */
+static void *worker_landing(void *arg);
+static struct job *next_job(struct worker *worker);
+static int refill(struct worker *worker);
+static struct job *steal(struct worker *worker);
+static struct job *raid(struct worker *victim);
+static void doze(struct worker *worker);
+static void rouse(struct workers *workers);
+static bool has_work(struct workers *workers);
+
+struct workers *workers_init(int nworkers, size_t depth)
+{
+    assert(nworkers > 0);
+
+    struct workers *ret = malloc(sizeof(struct workers));
+    if (ret == NULL)
+        return NULL;
+
+    *ret = (struct workers) {0};
+    ret->nworkers = nworkers;
+    ret->depth = depth;
+    pthread_mutex_init(&ret->mutex, NULL);
+    pthread_cond_init(&ret->wake, NULL);
+
+    ret->workers = aligned_alloc(CACHE_LINE, sizeof(struct worker) * nworkers);
+    if (ret->workers == NULL) {
+        free(ret);
+        return NULL;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *worker = &ret->workers[i];
+        *worker = (struct worker) {0};
+        worker->pool = ret;
+        worker->seed = i;
+        worker->mailbox = queue_init(depth);
+        worker->deque = deque_init(depth);
+        if (worker->mailbox == NULL || worker->deque == NULL)
+            panic("Failed to set up worker %d\n", i);
+    }
+
+    // The workers never stop, so they're started once they all exist
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *worker = &ret->workers[i];
+        if (pthread_create(&worker->thread, NULL, worker_landing, worker) != 0)
+            panic("Failed to start worker %d\n", i);
+    }
+
+    return ret;
+}
+
+int workers_submit(struct workers *workers, work_func func, void *arg)
+{
+    assert(workers != NULL);
+    assert(func != NULL);
+
+    struct job *job = pool_get(&job_pool);
+    if (job == NULL)
+        return -1;
+
+    job->func = func;
+    job->arg = arg;
+
+    unsigned int first = __atomic_fetch_add(&workers->next, 1,
+        __ATOMIC_RELAXED);
+
+    int i;
+    for (i = 0; i < workers->nworkers; i++) {
+        struct worker *worker = &workers->workers[(first + i) %
+            workers->nworkers];
+        if (queue_push(worker->mailbox, job) == 0)
+            break;
+    }
+
+    if (i == workers->nworkers) {
+        __atomic_add_fetch(&workers->refused, 1, __ATOMIC_RELAXED);
+        pool_put(&job_pool, job);
+        return -1;
+    }
+
+    // Any idle worker can take it, see steal()
+    rouse(workers);
+    return 0;
+}
+
+void workers_get_stats(struct workers *workers, struct work_stats *ret)
+{
+    assert(workers != NULL);
+    assert(ret != NULL);
+
+    *ret = (struct work_stats) {0};
+    ret->nworkers = workers->nworkers;
+    ret->depth = workers->depth;
+    ret->refused = __atomic_load_n(&workers->refused, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < workers->nworkers; i++) {
+        struct worker *worker = &workers->workers[i];
+        ret->queued += queue_len(worker->mailbox);
+        ret->queued += deque_len(worker->deque);
+        ret->done += __atomic_load_n(&worker->done, __ATOMIC_RELAXED);
+        ret->stolen += __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED);
+    }
+}
+
+/* This is where each worker's thread starts, it never returns */
+static void *worker_landing(void *arg)
+{
+    struct worker *worker = arg;
+
+    while (1) {
+        struct job *job = next_job(worker);
+        if (job == NULL) {
+            doze(worker);
+            continue;
+        }
+
+        job->func(job->arg);
+        pool_put(&job_pool, job);
+        __atomic_store_n(&worker->done, worker->done + 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/* Return the next job for the worker to run: its own newest, then whatever
+ * has been handed to it, then another worker's. NULL if there's nothing */
+static struct job *next_job(struct worker *worker)
+{
+    struct job *job = deque_pop(worker->deque);
+    if (job != NULL)
+        return job;
+
+    if (refill(worker) > 0) {
+        job = deque_pop(worker->deque);
+        if (job != NULL)
+            return job;
+    }
+
+    return steal(worker);
+}
+
+/* Move the worker's mail onto its deque, as much as fits. If there's more
+ * than the worker is about to run the others are woken up to steal it.
+ * Return the number of jobs moved */
+static int refill(struct worker *worker)
+{
+    // A thief is emptying the mailbox, what it leaves is taken next time
+    if (__atomic_exchange_n(&worker->emptying, true, __ATOMIC_ACQUIRE))
+        return 0;
+
+    int moved = 0;
+    struct job *job;
+    while ((job = queue_peek(worker->mailbox)) != NULL) {
+        if (deque_push(worker->deque, job) < 0)
+            break;
+        queue_pop(worker->mailbox);
+        moved += 1;
+    }
+
+    __atomic_store_n(&worker->emptying, false, __ATOMIC_RELEASE);
+
+    if (moved > 1)
+        rouse(worker->pool);
+
+    return moved;
+}
+
+/* Take a job from another worker, starting from a random one so the thieves
+ * don't all go after the same worker. NULL if nobody has anything spare */
+static struct job *steal(struct worker *worker)
+{
+    struct workers *workers = worker->pool;
+    int n = workers->nworkers;
+    int first = rand_r(&worker->seed) % n;
+
+    for (int i = 0; i < n; i++) {
+        struct worker *victim = &workers->workers[(first + i) % n];
+        if (victim == worker)
+            continue;
+
+        struct job *job = deque_steal(victim->deque);
+        if (job == NULL)
+            job = raid(victim);
+
+        if (job != NULL) {
+            __atomic_store_n(&worker->stolen, worker->stolen + 1,
+                __ATOMIC_RELAXED);
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+/* Take the oldest job from the victim's mailbox. The victim may be busy on a
+ * long job and not get to its mail for a while. NULL if there's none (or
+ * somebody else is emptying it) */
+static struct job *raid(struct worker *victim)
+{
+    if (queue_len(victim->mailbox) == 0)
+        return NULL;
+
+    if (__atomic_exchange_n(&victim->emptying, true, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    struct job *job = queue_pop(victim->mailbox);
+    __atomic_store_n(&victim->emptying, false, __ATOMIC_RELEASE);
+    return job;
+}
+
+/* Sleep until there might be work. A job submitted after the worker last
+ * looked is either seen by has_work() or wakes it up */
+static void doze(struct worker *worker)
+{
+    struct workers *workers = worker->pool;
+
+    pthread_mutex_lock(&workers->mutex);
+    __atomic_add_fetch(&workers->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (has_work(workers) == false)
+        pthread_cond_wait(&workers->wake, &workers->mutex);
+
+    __atomic_sub_fetch(&workers->sleepers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+/* Wake up every sleeping worker, there's work for one of them */
+static void rouse(struct workers *workers)
+{
+    // Pairs with doze(), either the sleeper is counted here or it sees the
+    // work before it sleeps
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&workers->sleepers, __ATOMIC_RELAXED) == 0)
+        return;
+
+    pthread_mutex_lock(&workers->mutex);
+    pthread_cond_broadcast(&workers->wake);
+    pthread_mutex_unlock(&workers->mutex);
+}
+
+/* Return true if any worker has a job waiting */
+static bool has_work(struct workers *workers)
+{
+    for (int i = 0; i < workers->nworkers; i++) {
+        struct worker *worker = &workers->workers[i];
+        if (queue_len(worker->mailbox) > 0)
+            return true;
+        if (deque_len(worker->deque) > 0)
+            return true;
+    }
+    return false;
+}